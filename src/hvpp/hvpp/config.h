@@ -11,3 +11,51 @@
 // in VMWare and you don't want the VMWare Tools to crash.
 //
 #define HVPP_ENABLE_VMWARE_WORKAROUND
+
+//
+// Uncomment this if you want to enable Page-Modification Logging (if
+// supported by the CPU).  This also enables EPT accessed/dirty flags.
+// See vcpu_t::pml_harvest().
+//
+// #define HVPP_ENABLE_PML
+
+//
+// Comment this out if you don't want the VCPUs to join split 2MB EPT
+// regions back to 2MB pages (see ept_t::coalesce()).  The hypervisor
+// requests the join every given number of milliseconds (rounded up to
+// HVPP_EPT_POOL_REFILL_PERIOD), each VCPU performs it on its next
+// VM-exit.  Regions whose PTs are pinned (by EPT hooks, memory snapshots
+// or the reverse map) are skipped - disable this if you keep pointers
+// to PTEs by other means.
+//
+#define HVPP_EPT_COALESCE_INTERVAL 1000
+
+//
+// Number of pre-zeroed tables kept in the table pool of each EPT (see
+// ept_t::pool_refill()).  Each table takes 8kb (the table and its shadow
+// page).  The pool is refilled by the hypervisor every given number of
+// milliseconds once it falls below 1/4 of its capacity.
+//
+#define HVPP_EPT_POOL_CAPACITY 128
+#define HVPP_EPT_POOL_REFILL_PERIOD 50
+
+//
+// Comment this out if you want to save extended processor state on
+// VM-exits by FXSAVE only.  Otherwise XSAVEC/XSAVEOPT/XSAVE is used
+// (if supported by the CPU and enabled by the OS).
+// See vcpu_t::xstate_mode().
+//
+#define HVPP_ENABLE_XSAVE
+
+//
+// Uncomment this if you want to measure how many cycles each handler
+// of vmexit_compositor_handler spends on each exit reason.  Results
+// are printed when the compositor is destroyed.
+//
+// #define HVPP_ENABLE_COMPOSITOR_ACCOUNTING
+
+//
+// Comment this out if you don't want to record latency histograms of
+// VM-exits (see vcpu_t::exit_latency()).
+//
+#define HVPP_ENABLE_EXIT_LATENCY
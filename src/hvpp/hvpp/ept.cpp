@@ -1,49 +1,97 @@
 #include "ept.h"
 
+#include "ia32/msr.h"
+#include "ia32/vmx.h"
+
 #include "lib/assert.h"
+#include "lib/bitmap.h"
 #include "lib/mm.h"
 
 namespace hvpp {
 
 auto ept_t::initialize() noexcept -> error_code_t
 {
+  if (auto err = initialize_root())
+  {
+    return err;
+  }
+
   //
-  // Initialize EPT's PML4.  Each PML4 maps 512GB of memory. We would be fine
-  // with just one PML4 in most scenarios, but we have to waste single page
-  // on it anyway.  Single page can handle 512 PML4s (their size is 8 bytes)
-  // so just fill the whole page with 512 PML4s.
+  // Pre-allocate tables, so that splits in VMX-root mode don't need
+  // to allocate memory.
   //
-  static_assert(sizeof(epte_t) * 512 == page_size);
+  pool_refill();
 
-  epml4_ = new epte_t[512];
-  hvpp_assert(epml4_ != nullptr);
+  return error_code_t{};
+}
 
-  if (!epml4_)
-  {
-    return make_error_code_t(std::errc::not_enough_memory);
-  }
+auto ept_t::initialize_view() noexcept -> error_code_t
+{
+  //
+  // Views take tables from the pool of their base EPT.
+  //
+  return initialize_root();
+}
 
-  memset(epml4_, 0, sizeof(epte_t) * 512);
+void ept_t::attach(ept_t& base) noexcept
+{
+  hvpp_assert(!base_ && !base.base_);
 
   //
-  // Get physical address of EPT's PML4.
+  // Share all subtrees of the base EPT.
   //
-  pa_t empl4_pa = pa_t::from_va(epml4_);
+  share_table(epml4_, base.epml4_);
+
+  eptptr_.enable_access_and_dirty_flags = base.eptptr_.enable_access_and_dirty_flags;
+
+  base_ = &base;
+  next_view_ = base.first_view_;
+  base.first_view_ = this;
+  base.view_count_ += 1;
+}
+
+void ept_t::detach() noexcept
+{
+  hvpp_assert(base_);
 
   //
-  // Initialize EPT pointer.
-  // It's not really JUST pointer, but Intel Manual calls it this way.
+  // Drop references to all tables - tables which have been copied by
+  // this view are returned to the pool of the base EPT, therefore this
+  // must be done before the view is unlinked.
   //
-  eptptr_.flags = 0;
-  eptptr_.memory_type = static_cast<uint64_t>(memory_manager::mtrr().type(empl4_pa));
-  eptptr_.page_walk_length = ept_ptr_t::page_walk_length_4;
-  eptptr_.page_frame_number = empl4_pa.pfn();
+  unmap_table(epml4_);
 
-  return error_code_t{};
+  auto link = &base_->first_view_;
+
+  while (*link != this)
+  {
+    link = &(*link)->next_view_;
+  }
+
+  *link = next_view_;
+  base_->view_count_ -= 1;
+
+  next_view_ = nullptr;
+  base_ = nullptr;
+
+  //
+  // Split regions tracked by the view have been dropped too.
+  //
+  split_pd_count_ = 0;
 }
 
 void ept_t::destroy() noexcept
 {
+  if (base_)
+  {
+    detach();
+  }
+
+  //
+  // Views must be detached before their base EPT is destroyed.
+  //
+  hvpp_assert(!first_view_);
+
   eptptr_.flags = 0;
 
   if (epml4_)
@@ -53,6 +101,25 @@ void ept_t::destroy() noexcept
 
     epml4_ = nullptr;
   }
+
+  rmap_disable();
+
+  //
+  // Release the table pool and the overflow list.
+  //
+  for (auto list : { &pool_head_, &pool_overflow_head_ })
+  {
+    auto entry = list->exchange(nullptr);
+
+    while (entry)
+    {
+      auto next = entry->next;
+      delete[] reinterpret_cast<epte_t*>(entry);
+      entry = next;
+    }
+  }
+
+  pool_depth_ = 0;
 }
 
 void ept_t::map_identity() noexcept
@@ -92,13 +159,27 @@ void ept_t::map_identity() noexcept
 
   for (pa_t pa = 0; pa < _512gb; pa += ept_pd_t::size)
   {
-    map_2mb(pa, pa);
+    //
+    // The identity map needs more tables than the pool holds - refill
+    // it whenever it runs dry (we're not in VMX-root mode yet).
+    //
+    if (!pool_depth_)
+    {
+      pool_refill();
+    }
+
+    if (!map_2mb(pa, pa))
+    {
+      hvpp_assert(0);
+      break;
+    }
   }
 }
 
 epte_t* ept_t::map(pa_t guest_pa, pa_t host_pa,
                    epte_t::access_type access /* = epte_t::access_type::read_write_execute */,
-                   pml large /* = pml::pt */) noexcept
+                   pml large /* = pml::pt */,
+                   bool suppress_ve /* = true */) noexcept
 {
   //
   // Map provided guest physical address to provided host physical address.
@@ -107,28 +188,136 @@ epte_t* ept_t::map(pa_t guest_pa, pa_t host_pa,
   // The range of mapped memory is derived from the size of the paging
   // structure.
   //
-  return map_pml4(guest_pa, host_pa, epml4_, access, large);
+  switch (large)
+  {
+    case pml::pdpt: return map<ept_pdpt_t>(guest_pa, host_pa, access, suppress_ve);
+    case pml::pd:   return map<ept_pd_t>  (guest_pa, host_pa, access, suppress_ve);
+    default:        break;
+  }
+
+  hvpp_assert(large == pml::pt);
+  return map<ept_pt_t>(guest_pa, host_pa, access, suppress_ve);
+}
+
+template <typename ept_table_t>
+epte_t* ept_t::map(pa_t guest_pa, pa_t host_pa,
+                   epte_t::access_type access /* = epte_t::access_type::read_write_execute */,
+                   bool suppress_ve /* = true */) noexcept
+{
+  static_assert(ept_table_t::level != pml::pml4,
+                "Cannot map 512GB pages");
+
+  //
+  // Descend to the table which holds the entry of the desired level,
+  // creating (or unsharing) the tables on the way.
+  //
+  // If a table can't be taken from the pool, nothing is mapped.
+  //
+  auto pml4e = &epml4_[guest_pa.index(pml::pml4)];
+  auto table = map_subtable(pml4e);
+
+  if (!table)
+  {
+    return nullptr;
+  }
+
+  //
+  // Large pages on the way are split first - they have no subtable
+  // which could be descended into.
+  //
+  if constexpr (ept_table_t::level <= pml::pd)
+  {
+    auto pdpte = &table[guest_pa.index(pml::pdpt)];
+
+    table = pdpte->large_page
+      ? split_entry(pdpte, guest_pa & ept_pdpt_t::mask, pml::pdpt)
+      : map_subtable(pdpte);
+
+    if (!table)
+    {
+      return nullptr;
+    }
+  }
+
+  if constexpr (ept_table_t::level == pml::pt)
+  {
+    auto pde = &table[guest_pa.index(pml::pd)];
+    auto track = !pde->is_present();
+
+    table = pde->large_page
+      ? split_entry(pde, guest_pa & ept_pd_t::mask, pml::pd)
+      : map_subtable(pde);
+
+    if (!table)
+    {
+      return nullptr;
+    }
+
+    if (track)
+    {
+      track_split(guest_pa);
+    }
+  }
+
+  auto entry = &table[guest_pa.index(ept_table_t::level)];
+
+  if constexpr (ept_table_t::level == pml::pt)
+  {
+    rmap_remove(entry);
+    entry->update(host_pa, memory_manager::mtrr().type(guest_pa), access);
+  }
+  else
+  {
+    //
+    // Entry which points to a subtable is unmapped first, so that the
+    // subtable (and its subtables) is released - the same as map_range()
+    // does.  Large entry is just removed from the reverse map.
+    //
+    unmap_entry(entry, ept_table_t::level);
+
+    //
+    // Large pages are always mapped with full access.
+    //
+    (void)(access);
+    entry->update(host_pa, memory_manager::mtrr().type(guest_pa), true);
+  }
+
+  entry->suppress_ve = suppress_ve;
+  rmap_insert(entry, ept_table_t::level, guest_pa & ept_table_t::mask);
+
+  const bool propagated = propagate(guest_pa & ept_table_t::mask, ept_table_t::size, [&](ept_t& view) noexcept {
+    return view.map<ept_table_t>(guest_pa, host_pa, access, suppress_ve) != nullptr;
+  });
+
+  return propagated ? entry : nullptr;
 }
 
+template epte_t* ept_t::map<ept_pt_t>  (pa_t, pa_t, epte_t::access_type, bool) noexcept;
+template epte_t* ept_t::map<ept_pd_t>  (pa_t, pa_t, epte_t::access_type, bool) noexcept;
+template epte_t* ept_t::map<ept_pdpt_t>(pa_t, pa_t, epte_t::access_type, bool) noexcept;
+
 epte_t* ept_t::map_4kb(pa_t guest_pa, pa_t host_pa,
-                       epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+                       epte_t::access_type access /* = epte_t::access_type::read_write_execute */,
+                       bool suppress_ve /* = true */) noexcept
 {
-  return map(guest_pa, host_pa, access, pml::pt);
+  return map<ept_pt_t>(guest_pa, host_pa, access, suppress_ve);
 }
 
 epte_t* ept_t::map_2mb(pa_t guest_pa, pa_t host_pa,
-                       epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+                       epte_t::access_type access /* = epte_t::access_type::read_write_execute */,
+                       bool suppress_ve /* = true */) noexcept
 {
-  return map(guest_pa, host_pa, access, pml::pd);
+  return map<ept_pd_t>(guest_pa, host_pa, access, suppress_ve);
 }
 
 epte_t* ept_t::map_1gb(pa_t guest_pa, pa_t host_pa,
-                       epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+                       epte_t::access_type access /* = epte_t::access_type::read_write_execute */,
+                       bool suppress_ve /* = true */) noexcept
 {
-  return map(guest_pa, host_pa, access, pml::pdpt);
+  return map<ept_pdpt_t>(guest_pa, host_pa, access, suppress_ve);
 }
 
-void ept_t::split_1gb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept
+bool ept_t::split_1gb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept
 {
   //
   // Split
@@ -136,10 +325,10 @@ void ept_t::split_1gb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept
   //          into
   //    PD entries (512, large, 2MB).
   //
-  split<ept_pdpt_t, ept_pd_t>(guest_pa, host_pa);
+  return split<ept_pdpt_t, ept_pd_t>(guest_pa, host_pa);
 }
 
-void ept_t::split_2mb_to_4kb(pa_t guest_pa, pa_t host_pa) noexcept
+bool ept_t::split_2mb_to_4kb(pa_t guest_pa, pa_t host_pa) noexcept
 {
   //
   // Split
@@ -147,10 +336,10 @@ void ept_t::split_2mb_to_4kb(pa_t guest_pa, pa_t host_pa) noexcept
   //          into
   //    PT entries (512, 4kb).
   //
-  split<ept_pd_t, ept_pt_t>(guest_pa, host_pa);
+  return split<ept_pd_t, ept_pt_t>(guest_pa, host_pa);
 }
 
-void ept_t::join_2mb_to_1gb(pa_t guest_pa, pa_t host_pa) noexcept
+bool ept_t::join_2mb_to_1gb(pa_t guest_pa, pa_t host_pa) noexcept
 {
   //
   // Join (merge)
@@ -158,10 +347,10 @@ void ept_t::join_2mb_to_1gb(pa_t guest_pa, pa_t host_pa) noexcept
   //          into
   //    PDPT entry (1, large, 1GB).
   //
-  join<ept_pd_t, ept_pdpt_t>(guest_pa, host_pa);
+  return join<ept_pd_t, ept_pdpt_t>(guest_pa, host_pa);
 }
 
-void ept_t::join_4kb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept
+bool ept_t::join_4kb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept
 {
   //
   // Join (merge)
@@ -169,286 +358,1833 @@ void ept_t::join_4kb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept
   //          into
   //    PD entry (1, large, 2MB).
   //
-  join<ept_pt_t, ept_pd_t>(guest_pa, host_pa);
+  return join<ept_pt_t, ept_pd_t>(guest_pa, host_pa);
 }
 
-ept_ptr_t ept_t::ept_pointer() const noexcept
+bool ept_t::remap_4kb(epte_t* pte, pa_t guest_pa, pa_t host_pa,
+                      epte_t::access_type access) noexcept
 {
-  return eptptr_;
-}
+  rmap_remove(pte);
+  pte->update(host_pa, static_cast<memory_type>(pte->memory_type), access);
+  rmap_insert(pte, pml::pt, guest_pa);
 
-//
-// Private
-//
+  return propagate(guest_pa & ept_pt_t::mask, ept_pt_t::size, [&](ept_t& view) noexcept {
+    return view.map_4kb(guest_pa, host_pa, access, pte->suppress_ve) != nullptr;
+  });
+}
 
-template <
-  typename ept_table_from_t,
-  typename ept_table_to_t
->
-void ept_t::split(pa_t guest_pa, pa_t host_pa) noexcept
+auto ept_t::map_range(pa_t guest_pa, pa_t host_pa, size_t size,
+                      epte_t::access_type access /* = epte_t::access_type::read_write_execute */,
+                      size_t* entry_count /* = nullptr */) noexcept -> error_code_t
 {
   //
-  // Sanity compile-time checks - allow to use only EPT descriptors.
-  // See ia32/ept.h.
-  //
-  static_assert(std::is_base_of_v<ept_descriptor_tag,
-                                  ept_table_from_t::descriptor_tag>,
-                "Wrong ept_table_from_t type");
-
-
-  static_assert(std::is_base_of_v<ept_descriptor_tag,
-                                  ept_table_to_t::descriptor_tag>,
-                "Wrong ept_table_to_t type");
-
-  //
-  // Splitting pages (breaking large page into smaller ones) is possible
-  // only down accross one level (i.e. PDPT -> PD, PD -> PT).  If you
-  // desire to split PDPT into PTs (2 levels apart), you have to split
-  // the PDPT first and then split resulting PDs again into PTs.
+  // Map provided guest physical range to provided host physical range.
+  // At each position, the largest page size to which both guest_pa and
+  // host_pa are aligned (and which still fits into the remaining size)
+  // is used.  Large pages which partially overlap the range are split,
+  // subtables which are fully covered by larger page are unmapped (i.e.
+  // joined).
   //
-  static_assert(ept_table_from_t::level - 1 == ept_table_to_t::level,
-                "Cannot split page-tables accros multiple levels");
-
+  // Tables are descended only when a table boundary is crossed - e.g.
+  // remapping of 64MB range with 4kb pages results in 32 PD lookups,
+  // not in 16K full top-down walks.
   //
-  // PML4 is not splittable (doesn't have the "large_page" flag).
-  // Although this might change in the future CPUs.
+  // If a table can't be taken from the pool, the walk stops - the part
+  // of the range before the failed entry stays remapped.
   //
-  static_assert(ept_table_from_t::level != pml::pml4,
-                "Cannot split PML4 into PDPTs");
+  hvpp_assert(byte_offset(guest_pa.value()) == 0);
+  hvpp_assert(byte_offset(host_pa.value()) == 0);
+  hvpp_assert(byte_offset(size) == 0);
 
-  //
-  // Fetch the EPT entry for the provided guest physical address.
-  // The returned EPT entry is fetched at the "ept_table_from_t::level",
-  // this means that if we're splitting from PD to PTs, we've fetched PD entry.
-  //
-  auto entry = ept_entry(guest_pa, ept_table_from_t::level);
+  const pa_t range_guest_pa = guest_pa;
+  const pa_t range_host_pa  = host_pa;
 
-  //
-  // Make sure that the fetched entry is indeed large.
-  // We can't split non-large pages - they already are splitted.
-  //
-  hvpp_assert(entry->large_page);
+  size_t touched_count = 0;
+  pa_t guest_pa_end = guest_pa + size;
 
-  //
-  // Unmap the entry, i.e. make it non-present and reset the PFN.
-  //
-  unmap_entry(entry, ept_table_from_t::level);
+  auto failed = [&]() noexcept {
+    if (entry_count)
+    {
+      *entry_count = touched_count;
+    }
 
-  //
-  // Map the unmapped physical memory range again, this time with smaller
-  // EPT entries.
-  //
-  // If we're splitting 2MB page into 4kb pages, we're mapping range
-  // [ guest_pa, guest_pa + 2MB ].
-  //
-  // Note: Each paging structure on Intel architectures always contain 512
-  //       entries (one PDPT can contain 512 PDs, one PD can contain 512 PTs,
-  //       one PT can contain 512 pages).  This is convenient because at the
-  //       same time, each EPT structure has 8 bytes - therefore those 512
-  //       entries can always fit into single 4kb page.
-  //
-  //       This means that this for-loop always exetues 512-times, no matter
-  //       what the ept_table_from_t is.
-  //
-  for (uint64_t i = 0; i < ept_table_from_t::count; i++)
+    return make_error_code_t(std::errc::not_enough_memory);
+  };
+
+  auto can_map = [&](auto descriptor) noexcept {
+    using ept_table_t = decltype(descriptor);
+    return (guest_pa.value() & ~ept_table_t::mask) == 0 &&
+           (host_pa.value()  & ~ept_table_t::mask) == 0 &&
+           (guest_pa_end - guest_pa).value() >= ept_table_t::size;
+  };
+
+  auto advance = [&](uint64_t page_size) noexcept {
+    guest_pa += page_size;
+    host_pa  += page_size;
+    touched_count += 1;
+  };
+
+  while (guest_pa < guest_pa_end)
   {
-    map(guest_pa + (i * ept_table_to_t::size), // offset = iteration * page_size
-        host_pa  + (i * ept_table_to_t::size), // offset = iteration * page_size
-        epte_t::access_type::read_write_execute,
-        ept_table_to_t::level);
-  }
-}
+    auto pdpt = map_subtable(&epml4_[guest_pa.index(pml::pml4)]);
 
-template <
-  typename ept_table_from_t,
-  typename ept_table_to_t
->
-void ept_t::join(pa_t guest_pa, pa_t host_pa) noexcept
-{
-  //
-  // Sanity compile-time checks - allow to use only EPT descriptors.
-  // See ia32/ept.h.
-  //
-  static_assert(std::is_base_of_v<ept_descriptor_tag,
-                                  ept_table_from_t::descriptor_tag>,
-                "Wrong ept_table_from_t type");
+    if (!pdpt)
+    {
+      return failed();
+    }
 
+    do
+    {
+      auto pdpte = &pdpt[guest_pa.index(pml::pdpt)];
+
+      if (pdpte_1gb_pages_ && can_map(ept_pdpt_t{}))
+      {
+        unmap_entry(pdpte, pml::pdpt);
+        pdpte->update(host_pa, memory_manager::mtrr().type(guest_pa), true, access);
+        pdpte->suppress_ve = true;
+        rmap_insert(pdpte, pml::pdpt, guest_pa);
+        advance(ept_pdpt_t::size);
+        continue;
+      }
+
+      auto pd = pdpte->large_page
+        ? split_entry(pdpte, guest_pa & ept_pdpt_t::mask, pml::pdpt)
+        : map_subtable(pdpte);
+
+      if (!pd)
+      {
+        return failed();
+      }
+
+      do
+      {
+        auto pde = &pd[guest_pa.index(pml::pd)];
+
+        if (can_map(ept_pd_t{}))
+        {
+          unmap_entry(pde, pml::pd);
+          pde->update(host_pa, memory_manager::mtrr().type(guest_pa), true, access);
+          pde->suppress_ve = true;
+          rmap_insert(pde, pml::pd, guest_pa);
+          advance(ept_pd_t::size);
+          continue;
+        }
 
-  static_assert(std::is_base_of_v<ept_descriptor_tag,
-                                  ept_table_to_t::descriptor_tag>,
-                "Wrong ept_table_to_t type");
+        auto track = !pde->is_present();
 
-  //
-  // Joining pages (merging pages into one large page) is possible
-  // only up accross one level (i.e. PD -> PDPT, PT -> PD).  If you
-  // desire to join PTs into PDPT (2 levels apart), you have to join
-  // each PT into PDs first and then join resulting PDs again into PDPT.
-  //
-  static_assert(ept_table_from_t::level + 1 == ept_table_to_t::level,
-                "Cannot join page-tables accros multiple levels");
+        auto pt = pde->large_page
+          ? split_entry(pde, guest_pa & ept_pd_t::mask, pml::pd)
+          : map_subtable(pde);
 
-  //
-  // PDPTs are not joinable into PML4 (PML4 doesn't have the "large_page" flag).
-  // Although this might change in the future CPUs.
-  //
-  static_assert(ept_table_from_t::level != pml::pdpt,
-                "Cannot join PDPTs to PML4");
+        if (!pt)
+        {
+          return failed();
+        }
 
-  //
-  // Make sure the guest physical address is aligned with respect to the
-  // target EPT structure; i.e. if we're joining PTs into PD, the guest_pa
-  // must be aligned to 2MB boundary.  If we're joining PDs into PDPT,
-  // the guest_pa must be aligned to 1GB boundary.
-  //
-  hvpp_assert((guest_pa & ept_table_to_t::mask) == guest_pa);
-  guest_pa = page_align(guest_pa.value(), ept_table_to_t{});
+        if (track)
+        {
+          track_split(guest_pa);
+        }
 
-  //
-  // Fetch the EPT entry for the provided guest physical address.
-  // The returned EPT entry is fetched at the "ept_table_to_t::level",
-  // this means that if we're joining PTs into PD, we've fetched PD entry.
-  //
-  auto entry = ept_entry(guest_pa, ept_table_to_t::level);
+        do
+        {
+          auto pte = &pt[guest_pa.index(pml::pt)];
+          rmap_remove(pte);
+          pte->update(host_pa, memory_manager::mtrr().type(guest_pa), access);
+          pte->suppress_ve = true;
+          rmap_insert(pte, pml::pt, guest_pa);
+          advance(ept_pt_t::size);
+        } while (guest_pa < guest_pa_end && guest_pa.index(pml::pt) != 0);
+      } while (guest_pa < guest_pa_end && guest_pa.index(pml::pd) != 0);
+    } while (guest_pa < guest_pa_end && guest_pa.index(pml::pdpt) != 0);
+  }
 
-  //
-  // Make sure that the fetched entry is not large.
-  // We can't join large pages.
-  //
-  if (entry->large_page)
+  if (entry_count)
   {
-    hvpp_assert(0);
-    return;
+    *entry_count = touched_count;
   }
 
-  //
-  // Unmap the entry, i.e. make it non-present and reset the PFN.
-  // This will also deallocate entries in the subtable (e.g. if entry is PD,
-  // the PT it points to (entry->page_frame_number) will get automatically
-  // deallocated).
-  //
-  unmap_entry(entry, ept_table_to_t::level);
+  const bool propagated = propagate(range_guest_pa, size, [&](ept_t& view) noexcept {
+    return !view.map_range(range_guest_pa, range_host_pa, size, access);
+  });
 
-  //
-  // Map the unmapped physical memory range again, this time with single
-  // large EPT entry.
-  //
-  map(guest_pa,
-      host_pa,
-      epte_t::access_type::read_write_execute,
-      ept_table_to_t::level);
+  return propagated
+    ? error_code_t{}
+    : make_error_code_t(std::errc::not_enough_memory);
 }
 
-epte_t* ept_t::ept_entry(pa_t guest_pa, pml level /* = pml::pt */) noexcept
+auto ept_t::protect_range(pa_t guest_pa, size_t size,
+                          epte_t::access_type access,
+                          size_t* entry_count /* = nullptr */) noexcept -> error_code_t
 {
   //
-  // Get EPT entry at desired level for provided guest physical address.
-  // Start at PML4 and traverse down the paging hierarchy.
-  // Returns nullptr for unmapped (non-present) physical addresses.
+  // Set provided access on already mapped guest physical range.
+  // Large pages which are fully covered by the range keep their size,
+  // large pages which partially overlap the range are split.
   //
-  auto pml4e = &epml4_[guest_pa.index(pml::pml4)];
-  auto pdpte = pml4e->is_present()
-    ? &pml4e->subtable()[guest_pa.index(pml::pdpt)]
-    : nullptr;
+  // Entries which have never been mapped (see is_unmapped()) are skipped.
+  // Note that we can't use is_present() for this purpose, because
+  // entries with access_type::none are also "not present" - and we
+  // want to be able to restore their access later.
+  //
+  // If a table can't be taken from the pool, the walk stops - the part
+  // of the range before the failed entry keeps the new access.
+  //
+  hvpp_assert(byte_offset(guest_pa.value()) == 0);
+  hvpp_assert(byte_offset(size) == 0);
 
-  if (!pdpte || pdpte->large_page || level == pml::pdpt)
-  {
-    return pdpte;
-  }
+  const pa_t range_guest_pa = guest_pa;
 
-  auto pde = pdpte->is_present()
-    ? &pdpte->subtable()[guest_pa.index(pml::pd)]
-    : nullptr;
+  size_t touched_count = 0;
+  pa_t guest_pa_end = guest_pa + size;
 
-  if (!pde || pde->large_page || level == pml::pd)
-  {
-    return pde;
-  }
+  auto failed = [&]() noexcept {
+    if (entry_count)
+    {
+      *entry_count = touched_count;
+    }
 
-  auto pte = pde->is_present()
-    ? &pde->subtable()[guest_pa.index(pml::pt)]
-    : nullptr;
+    return make_error_code_t(std::errc::not_enough_memory);
+  };
 
-  return pte;
-}
+  auto is_covered = [&](auto descriptor) noexcept {
+    using ept_table_t = decltype(descriptor);
+    return (guest_pa.value() & ~ept_table_t::mask) == 0 &&
+           (guest_pa_end - guest_pa).value() >= ept_table_t::size;
+  };
 
-epte_t* ept_t::map_subtable(epte_t* table) noexcept
-{
+  auto skip = [&](auto descriptor) noexcept {
+    using ept_table_t = decltype(descriptor);
+    guest_pa = (guest_pa & ept_table_t::mask) + ept_table_t::size;
+  };
+
+  while (guest_pa < guest_pa_end)
+  {
+    auto pml4e = &epml4_[guest_pa.index(pml::pml4)];
+
+    if (!pml4e->is_present())
+    {
+      skip(ept_pml4_t{});
+      continue;
+    }
+
+    auto pdpt = map_subtable(pml4e);
+
+    if (!pdpt)
+    {
+      return failed();
+    }
+
+    do
+    {
+      auto pdpte = &pdpt[guest_pa.index(pml::pdpt)];
+
+      if (is_unmapped(pdpte))
+      {
+        skip(ept_pdpt_t{});
+        continue;
+      }
+
+      if (pdpte->large_page && is_covered(ept_pdpt_t{}))
+      {
+        pdpte->update(access);
+        skip(ept_pdpt_t{});
+        touched_count += 1;
+        continue;
+      }
+
+      auto pd = pdpte->large_page
+        ? split_entry(pdpte, guest_pa & ept_pdpt_t::mask, pml::pdpt)
+        : map_subtable(pdpte);
+
+      if (!pd)
+      {
+        return failed();
+      }
+
+      do
+      {
+        auto pde = &pd[guest_pa.index(pml::pd)];
+
+        if (is_unmapped(pde))
+        {
+          skip(ept_pd_t{});
+          continue;
+        }
+
+        if (pde->large_page && is_covered(ept_pd_t{}))
+        {
+          pde->update(access);
+          skip(ept_pd_t{});
+          touched_count += 1;
+          continue;
+        }
+
+        auto pt = pde->large_page
+          ? split_entry(pde, guest_pa & ept_pd_t::mask, pml::pd)
+          : map_subtable(pde);
+
+        if (!pt)
+        {
+          return failed();
+        }
+
+        do
+        {
+          auto pte = &pt[guest_pa.index(pml::pt)];
+
+          if (!is_unmapped(pte))
+          {
+            pte->update(access);
+            touched_count += 1;
+          }
+
+          skip(ept_pt_t{});
+        } while (guest_pa < guest_pa_end && guest_pa.index(pml::pt) != 0);
+      } while (guest_pa < guest_pa_end && guest_pa.index(pml::pd) != 0);
+    } while (guest_pa < guest_pa_end && guest_pa.index(pml::pdpt) != 0);
+  }
+
+  if (entry_count)
+  {
+    *entry_count = touched_count;
+  }
+
+  const bool propagated = propagate(range_guest_pa, size, [&](ept_t& view) noexcept {
+    return !view.protect_range(range_guest_pa, size, access);
+  });
+
+  return propagated
+    ? error_code_t{}
+    : make_error_code_t(std::errc::not_enough_memory);
+}
+
+size_t ept_t::coalesce() noexcept
+{
+  //
+  // Note that released PTs which are shared with views stay alive
+  // until the views drop them too (see release_table()).
+  //
+  // Attributes which must be identical in all PTEs of the region.
+  // Page frame numbers must be contiguous instead, accessed and dirty
+  // flags are ignored.
+  //
+  epte_t attribute_mask;
+  attribute_mask.flags = ~0ull;
+  attribute_mask.page_frame_number = 0;
+  attribute_mask.accessed = 0;
+  attribute_mask.dirty = 0;
+
+  size_t joined_count = 0;
+
+  for (size_t i = 0; i < split_pd_count_; )
+  {
+    auto guest_pa = split_pd_[i];
+    auto pde = walk<ept_pd_t>(guest_pa);
+
+    if (!pde || !pde->is_present() || pde->large_page)
+    {
+      //
+      // Region has been unmapped or joined in the meantime - stop
+      // tracking it.
+      //
+      split_pd_[i] = split_pd_[--split_pd_count_];
+      continue;
+    }
+
+    auto pt = subtable_of(pde);
+
+    if (table_counter(pt, pin_counter))
+    {
+      //
+      // Someone keeps pointers to the PTEs of this region.
+      //
+      ++i;
+      continue;
+    }
+
+    auto first_pfn = pt[0].page_frame_number;
+    auto attributes = pt[0].flags & attribute_mask.flags;
+
+    //
+    // Host memory must be 2MB aligned, otherwise it can't be mapped
+    // by 2MB page.
+    //
+    bool can_join = pt[0].is_present() &&
+                    (pa_t::from_pfn(first_pfn).value() & ~ept_pd_t::mask) == 0;
+
+    for (uint64_t j = 1; can_join && j < ept_pt_t::count; ++j)
+    {
+      can_join = pt[j].page_frame_number == first_pfn + j &&
+                 (pt[j].flags & attribute_mask.flags) == attributes;
+    }
+
+    if (!can_join)
+    {
+      ++i;
+      continue;
+    }
+
+    epte_t large_pde;
+    large_pde.flags = attributes;
+    large_pde.page_frame_number = first_pfn;
+    large_pde.large_page = true;
+
+    unmap_entry(pde, pml::pd);
+    *pde = large_pde;
+    rmap_insert(pde, pml::pd, guest_pa);
+
+    split_pd_[i] = split_pd_[--split_pd_count_];
+    ++joined_count;
+  }
+
+  coalesce_count_ += joined_count;
+  return joined_count;
+}
+
+void ept_t::pin(epte_t* pte) noexcept
+{
+  auto pt = table_of(pte);
+  table_counter(pt, pin_counter, table_counter(pt, pin_counter) + 1);
+}
+
+void ept_t::unpin(epte_t* pte) noexcept
+{
+  auto pt = table_of(pte);
+  auto pin_count = table_counter(pt, pin_counter);
+
+  hvpp_assert(pin_count > 0);
+
+  if (pin_count > 0)
+  {
+    table_counter(pt, pin_counter, pin_count - 1);
+  }
+}
+
+auto ept_t::rmap_enable(size_t capacity) noexcept -> error_code_t
+{
+  hvpp_assert(rmap_ == nullptr);
+
+  //
+  // Round the capacity up to the power of 2, so that the hash can be
+  // masked instead of divided.
+  //
+  size_t rounded_capacity = 1;
+
+  while (rounded_capacity < capacity)
+  {
+    rounded_capacity <<= 1;
+  }
+
+  rmap_ = new rmap_record_t[rounded_capacity];
+
+  if (!rmap_)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  memset(rmap_, 0, sizeof(rmap_record_t) * rounded_capacity);
+
+  rmap_capacity_ = rounded_capacity;
+  rmap_count_ = 0;
+  rmap_overflow_count_ = 0;
+
+  return error_code_t{};
+}
+
+void ept_t::rmap_disable() noexcept
+{
+  if (rmap_)
+  {
+    //
+    // Release pins of the recorded PTEs.
+    //
+    for (size_t i = 0; i < rmap_capacity_; ++i)
+    {
+      if (rmap_[i].entry && rmap_[i].level == pml::pt)
+      {
+        unpin(rmap_[i].entry);
+      }
+    }
+
+    delete[] rmap_;
+    rmap_ = nullptr;
+  }
+
+  rmap_capacity_ = 0;
+  rmap_count_ = 0;
+}
+
+auto ept_t::revoke(pa_t host_pa, size_t* entry_count /* = nullptr */) noexcept -> error_code_t
+{
+  host_pa = host_pa & ept_pt_t::mask;
+
+  size_t revoked_count = 0;
+
+  if (rmap_)
+  {
+    //
+    // Split all large aliases which cover the host page.  Splitting
+    // replaces the large record with records of the smaller pages,
+    // therefore we have to look the table up again after each split.
+    // Note that protect_range() splits down to the 4kb page and revokes
+    // its access - the PTE is counted below.
+    //
+    for (auto level : { pml::pdpt, pml::pd })
+    {
+      while (auto record = rmap_find(host_pa, level))
+      {
+        auto guest_pa = record->guest_pa + (host_pa - pa_t::from_pfn(record->host_pfn));
+
+        if (auto err = protect_range(guest_pa, page_size, epte_t::access_type::none))
+        {
+          if (entry_count)
+          {
+            *entry_count = revoked_count;
+          }
+
+          return err;
+        }
+      }
+    }
+
+    //
+    // Revoke access of all 4kb aliases.
+    //
+    const auto mask = rmap_capacity_ - 1;
+    const auto host_pfn = host_pa.pfn();
+
+    for (auto index = (host_pfn * 0x9e3779b97f4a7c15ull) & mask;
+         rmap_[index].entry;
+         index = (index + 1) & mask)
+    {
+      auto& record = rmap_[index];
+
+      if (record.host_pfn == host_pfn && record.level == pml::pt)
+      {
+        record.entry->update(epte_t::access_type::none);
+        revoked_count += 1;
+      }
+    }
+  }
+
+  //
+  // Finally, revoke access of the identity mapping (if it exists).
+  //
+  auto is_identity = [this, host_pa]() noexcept {
+    auto pml4e = &epml4_[host_pa.index(pml::pml4)];
+
+    if (!pml4e->is_present())
+    {
+      return false;
+    }
+
+    auto pdpte = &subtable_of(pml4e)[host_pa.index(pml::pdpt)];
+
+    if (is_unmapped(pdpte) || pdpte->large_page)
+    {
+      return !is_unmapped(pdpte) &&
+             pa_t::from_pfn(pdpte->page_frame_number) == (host_pa & ept_pdpt_t::mask);
+    }
+
+    auto pde = &subtable_of(pdpte)[host_pa.index(pml::pd)];
+
+    if (is_unmapped(pde) || pde->large_page)
+    {
+      return !is_unmapped(pde) &&
+             pa_t::from_pfn(pde->page_frame_number) == (host_pa & ept_pd_t::mask);
+    }
+
+    auto pte = &subtable_of(pde)[host_pa.index(pml::pt)];
+
+    return !is_unmapped(pte) &&
+           pa_t::from_pfn(pte->page_frame_number) == host_pa;
+  };
+
+  error_code_t err;
+
+  if (is_identity())
+  {
+    size_t identity_count = 0;
+    err = protect_range(host_pa, page_size, epte_t::access_type::none, &identity_count);
+    revoked_count += identity_count;
+  }
+
+  if (entry_count)
+  {
+    *entry_count = revoked_count;
+  }
+
+  return err;
+}
+
+auto ept_t::ad_enable() noexcept -> error_code_t
+{
+  if (!msr::read<msr::vmx_ept_vpid_cap_t>().ept_accessed_and_dirty_flags)
+  {
+    return make_error_code_t(std::errc::not_supported);
+  }
+
+  eptptr_.enable_access_and_dirty_flags = true;
+  return error_code_t{};
+}
+
+void ept_t::ad_disable() noexcept
+{
+  eptptr_.enable_access_and_dirty_flags = false;
+}
+
+size_t ept_t::harvest(pa_t guest_pa, size_t size,
+                      void* accessed_bitmap, void* dirty_bitmap) noexcept
+{
+  hvpp_assert(ad_enabled());
+  hvpp_assert(byte_offset(guest_pa.value()) == 0);
+  hvpp_assert(byte_offset(size) == 0);
+
+  auto tsc_start = ia32_asm_read_tsc();
+
+  const auto guest_pa_begin = guest_pa;
+  const auto guest_pa_end   = guest_pa + size;
+  const auto page_count     = static_cast<int>(size >> page_shift);
+
+  bitmap accessed(accessed_bitmap, page_count);
+  bitmap dirty(dirty_bitmap, page_count);
+
+  if (accessed_bitmap) { accessed.clear(); }
+  if (dirty_bitmap)    { dirty.clear();    }
+
+  epte_t ad_mask;
+  ad_mask.flags = 0;
+  ad_mask.accessed = true;
+  ad_mask.dirty = true;
+
+  size_t entry_count = 0;
+
+  //
+  // Atomically clear A/D flags of the entry and mark the part of the
+  // entry which overlaps the range in the bitmaps.
+  //
+  auto harvest_entry = [&](epte_t* entry, pa_t entry_pa, uint64_t entry_size) noexcept {
+    auto entry_flags = reinterpret_cast<std::atomic_uint64_t*>(&entry->flags)
+                         ->fetch_and(~ad_mask.flags);
+
+    if (!(entry_flags & ad_mask.flags))
+    {
+      return;
+    }
+
+    auto first = std::max(entry_pa, guest_pa_begin);
+    auto last  = std::min(entry_pa + entry_size, guest_pa_end);
+
+    auto index = static_cast<int>((first - guest_pa_begin).value() >> page_shift);
+    auto count = static_cast<int>((last - first).value() >> page_shift);
+
+    epte_t previous;
+    previous.flags = entry_flags;
+
+    if (previous.accessed && accessed_bitmap) { accessed.set(index, count); }
+    if (previous.dirty    && dirty_bitmap)    { dirty.set(index, count);    }
+
+    entry_count += 1;
+  };
+
+  auto skip = [&](auto descriptor) noexcept {
+    using ept_table_t = decltype(descriptor);
+    guest_pa = (guest_pa & ept_table_t::mask) + ept_table_t::size;
+  };
+
+  while (guest_pa < guest_pa_end)
+  {
+    auto pml4e = &epml4_[guest_pa.index(pml::pml4)];
+
+    if (!pml4e->is_present())
+    {
+      skip(ept_pml4_t{});
+      continue;
+    }
+
+    auto pdpt = subtable_of(pml4e);
+
+    do
+    {
+      auto pdpte = &pdpt[guest_pa.index(pml::pdpt)];
+
+      if (is_unmapped(pdpte) || pdpte->large_page)
+      {
+        if (!is_unmapped(pdpte))
+        {
+          harvest_entry(pdpte, guest_pa & ept_pdpt_t::mask, ept_pdpt_t::size);
+        }
+
+        skip(ept_pdpt_t{});
+        continue;
+      }
+
+      auto pd = subtable_of(pdpte);
+
+      do
+      {
+        auto pde = &pd[guest_pa.index(pml::pd)];
+
+        if (is_unmapped(pde) || pde->large_page)
+        {
+          if (!is_unmapped(pde))
+          {
+            harvest_entry(pde, guest_pa & ept_pd_t::mask, ept_pd_t::size);
+          }
+
+          skip(ept_pd_t{});
+          continue;
+        }
+
+        auto pt = subtable_of(pde);
+
+        //
+        // Most of the PTs are usually untouched since the last harvest.
+        // Check them with simple OR-reduction over the covered entries
+        // first (which is easily vectorized by the compiler) and issue
+        // the atomic operations only if any flag is set.
+        //
+        const auto first = static_cast<uint64_t>(guest_pa.index(pml::pt));
+        const auto last  = std::min<uint64_t>(
+          ept_pt_t::count,
+          first + ((guest_pa_end - guest_pa).value() >> page_shift));
+
+        uint64_t pt_flags = 0;
+
+        for (auto i = first; i < last; ++i)
+        {
+          pt_flags |= pt[i].flags;
+        }
+
+        if (pt_flags & ad_mask.flags)
+        {
+          for (auto i = first; i < last; ++i)
+          {
+            if (pt[i].flags & ad_mask.flags)
+            {
+              harvest_entry(&pt[i], (guest_pa & ept_pd_t::mask) + i * ept_pt_t::size, ept_pt_t::size);
+            }
+          }
+        }
+
+        guest_pa = (guest_pa & ept_pd_t::mask) + last * ept_pt_t::size;
+      } while (guest_pa < guest_pa_end && guest_pa.index(pml::pd) != 0);
+    } while (guest_pa < guest_pa_end && guest_pa.index(pml::pdpt) != 0);
+  }
+
+  //
+  // Cleared A/D flags aren't visible to the CPU until the cached
+  // mappings are invalidated.
+  //
+  if (entry_count)
+  {
+    invalidate();
+  }
+
+  harvest_bytes_  += size;
+  harvest_cycles_ += ia32_asm_read_tsc() - tsc_start;
+
+  return entry_count;
+}
+
+bool ept_t::clear_dirty(pa_t guest_pa) noexcept
+{
+  auto entry = walk(guest_pa);
+
+  if (!entry)
+  {
+    return false;
+  }
+
+  epte_t dirty_mask;
+  dirty_mask.flags = 0;
+  dirty_mask.dirty = true;
+
+  auto entry_flags = reinterpret_cast<std::atomic_uint64_t*>(&entry->flags)
+                       ->fetch_and(~dirty_mask.flags);
+
+  return !!(entry_flags & dirty_mask.flags);
+}
+
+void ept_t::pool_refill() noexcept
+{
+  //
+  // Views don't have their own pool (see allocate_table()).
+  //
+  hvpp_assert(!base_);
+
+  //
+  // Release tables which haven't fit into the pool.
+  //
+  auto entry = pool_overflow_head_.exchange(nullptr, std::memory_order_acquire);
+
+  while (entry)
+  {
+    auto next = entry->next;
+    delete[] reinterpret_cast<epte_t*>(entry);
+    entry = next;
+  }
+
+  if (pool_depth_ >= pool_capacity)
+  {
+    return;
+  }
+
+  while (pool_depth_ < pool_capacity)
+  {
+    auto table = new epte_t[512 * 2];
+
+    if (!table)
+    {
+      break;
+    }
+
+    memset(table, 0, table_size);
+    free_table(table);
+  }
+
+  ++pool_refill_count_;
+}
+
+size_t ept_t::snapshot(void* buffer, size_t size) const noexcept
+{
+  auto header  = reinterpret_cast<ept_snapshot_header_t*>(buffer);
+  auto records = reinterpret_cast<ept_snapshot_record_t*>(header + 1);
+
+  const auto record_capacity = size >= sizeof(*header)
+    ? (size - sizeof(*header)) / sizeof(ept_snapshot_record_t)
+    : 0;
+
+  ept_snapshot_record_t current = {};
+  uint64_t record_count = 0;
+
+  auto flush = [&]() noexcept {
+    if (current.page_count)
+    {
+      if (record_count < record_capacity)
+      {
+        records[record_count] = current;
+      }
+
+      ++record_count;
+    }
+  };
+
+  //
+  // Extend the current run by the entry, or start new run if the entry
+  // can't be merged with it.
+  //
+  auto emit = [&](const epte_t* entry, uint64_t guest_pa, pml level) noexcept {
+    const auto page_size = uint64_t(4096) << (9 * static_cast<int>(level));
+    const auto host_pa   = pa_t::from_pfn(entry->page_frame_number).value() & ~(page_size - 1);
+    const auto flags     = static_cast<uint8_t>(
+      (entry->suppress_ve ? ept_snapshot_record_t::flag_suppress_ve : 0) |
+      (entry->accessed    ? ept_snapshot_record_t::flag_accessed    : 0) |
+      (entry->dirty       ? ept_snapshot_record_t::flag_dirty       : 0));
+
+    if (current.page_count                                        &&
+        current.page_count  != ~uint32_t(0)                       &&
+        current.level       == static_cast<uint8_t>(level)        &&
+        current.access      == static_cast<uint8_t>(entry->access) &&
+        current.memory_type == entry->memory_type                 &&
+        current.flags       == flags                              &&
+        current.guest_pa_end() == guest_pa                        &&
+        current.host_pa + current.size() == host_pa)
+    {
+      ++current.page_count;
+      return;
+    }
+
+    flush();
+
+    current.guest_pa    = guest_pa;
+    current.host_pa     = host_pa;
+    current.page_count  = 1;
+    current.level       = static_cast<uint8_t>(level);
+    current.access      = static_cast<uint8_t>(entry->access);
+    current.memory_type = static_cast<uint8_t>(entry->memory_type);
+    current.flags       = flags;
+  };
+
+  for (uint64_t i4 = 0; i4 < ept_pml4_t::count; ++i4)
+  {
+    const auto pml4e = &epml4_[i4];
+
+    if (!pml4e->is_present())
+    {
+      continue;
+    }
+
+    const auto pdpt = subtable_of(pml4e);
+
+    for (uint64_t i3 = 0; i3 < ept_pdpt_t::count; ++i3)
+    {
+      const auto pdpte    = &pdpt[i3];
+      const auto pdpte_pa = i4 * ept_pml4_t::size + i3 * ept_pdpt_t::size;
+
+      if (is_unmapped(pdpte))
+      {
+        continue;
+      }
+
+      if (pdpte->large_page)
+      {
+        emit(pdpte, pdpte_pa, pml::pdpt);
+        continue;
+      }
+
+      const auto pd = subtable_of(pdpte);
+
+      for (uint64_t i2 = 0; i2 < ept_pd_t::count; ++i2)
+      {
+        const auto pde    = &pd[i2];
+        const auto pde_pa = pdpte_pa + i2 * ept_pd_t::size;
+
+        if (is_unmapped(pde))
+        {
+          continue;
+        }
+
+        if (pde->large_page)
+        {
+          emit(pde, pde_pa, pml::pd);
+          continue;
+        }
+
+        const auto pt = subtable_of(pde);
+
+        for (uint64_t i1 = 0; i1 < ept_pt_t::count; ++i1)
+        {
+          if (!is_unmapped(&pt[i1]))
+          {
+            emit(&pt[i1], pde_pa + i1 * ept_pt_t::size, pml::pt);
+          }
+        }
+      }
+    }
+  }
+
+  flush();
+
+  if (size >= sizeof(*header))
+  {
+    header->magic        = ept_snapshot_header_t::magic_value;
+    header->version      = ept_snapshot_header_t::version_value;
+    header->record_size  = sizeof(ept_snapshot_record_t);
+    header->record_count = std::min<uint64_t>(record_count, record_capacity);
+    header->ept_pointer  = eptptr_.flags;
+  }
+
+  return sizeof(*header) + record_count * sizeof(ept_snapshot_record_t);
+}
+
+auto ept_t::restore(const void* buffer, size_t size) noexcept -> error_code_t
+{
+  const auto records = ept_snapshot_records(buffer, size);
+
+  if (!records)
+  {
+    return make_error_code_t(std::errc::invalid_argument);
+  }
+
+  const auto record_count = reinterpret_cast<const ept_snapshot_header_t*>(buffer)->record_count;
+
+  for (uint64_t i = 0; i < record_count; ++i)
+  {
+    const auto& record = records[i];
+
+    if (record.level > static_cast<uint8_t>(pml::pdpt) ||
+        (record.level == static_cast<uint8_t>(pml::pdpt) && !pdpte_1gb_pages_))
+    {
+      return make_error_code_t(std::errc::not_supported);
+    }
+
+    const auto level  = static_cast<pml>(record.level);
+    const auto access = static_cast<epte_t::access_type>(record.access);
+
+    for (uint64_t page = 0; page < record.page_count; ++page)
+    {
+      const auto offset = page * record.page_size();
+
+      //
+      // Large pages are mapped with full access by map() - access,
+      // memory type and A/D flags are fixed up afterwards.
+      //
+      auto entry = map(pa_t(record.guest_pa + offset),
+                       pa_t(record.host_pa  + offset),
+                       access, level,
+                       !!(record.flags & ept_snapshot_record_t::flag_suppress_ve));
+
+      if (!entry)
+      {
+        return make_error_code_t(std::errc::not_enough_memory);
+      }
+
+      entry->update(access);
+      entry->memory_type = record.memory_type;
+      entry->accessed    = !!(record.flags & ept_snapshot_record_t::flag_accessed);
+      entry->dirty       = !!(record.flags & ept_snapshot_record_t::flag_dirty);
+    }
+  }
+
+  return {};
+}
+
+ept_ptr_t ept_t::ept_pointer() const noexcept
+{
+  return eptptr_;
+}
+
+void ept_t::invalidate() noexcept
+{
+  if (invept_single_context_ && !view_count_)
+  {
+    vmx::invept_single_context(eptptr_);
+  }
+  else
+  {
+    vmx::invept_all_contexts();
+  }
+}
+
+//
+// Private
+//
+
+auto ept_t::initialize_root() noexcept -> error_code_t
+{
+  //
+  // Initialize EPT's PML4.  Each PML4 maps 512GB of memory. We would be fine
+  // with just one PML4 in most scenarios, but we have to waste single page
+  // on it anyway.  Single page can handle 512 PML4s (their size is 8 bytes)
+  // so just fill the whole page with 512 PML4s.
+  //
+  // Each EPT table is followed by its shadow page (see subtable_of()).
+  //
+  static_assert(sizeof(epte_t) * 512 == page_size);
+  static_assert(sizeof(epte_t*) == sizeof(epte_t));
+
+  epml4_ = new epte_t[512 * 2];
+  hvpp_assert(epml4_ != nullptr);
+
+  if (!epml4_)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  memset(epml4_, 0, table_size);
+  clear_table(epml4_);
+
+  //
+  // Get physical address of EPT's PML4.
+  //
+  pa_t empl4_pa = pa_t::from_va(epml4_);
+
+  //
+  // Initialize EPT pointer.
+  // It's not really JUST pointer, but Intel Manual calls it this way.
+  //
+  eptptr_.flags = 0;
+  eptptr_.memory_type = static_cast<uint64_t>(memory_manager::mtrr().type(empl4_pa));
+  eptptr_.page_walk_length = ept_ptr_t::page_walk_length_4;
+  eptptr_.page_frame_number = empl4_pa.pfn();
+
+  //
+  // 1GB pages are optional - map_range() uses them only if the CPU
+  // supports them.
+  //
+  auto ept_vpid_cap = msr::read<msr::vmx_ept_vpid_cap_t>();
+  pdpte_1gb_pages_       = !!ept_vpid_cap.pdpte_1gb_pages;
+  invept_single_context_ = !!ept_vpid_cap.invept_single_context;
+
+  split_pd_count_ = 0;
+  split_overflow_count_ = 0;
+  coalesce_count_ = 0;
+
+  harvest_bytes_ = 0;
+  harvest_cycles_ = 0;
+
+  rmap_ = nullptr;
+  rmap_capacity_ = 0;
+  rmap_count_ = 0;
+  rmap_overflow_count_ = 0;
+
+  base_ = nullptr;
+  first_view_ = nullptr;
+  next_view_ = nullptr;
+  view_count_ = 0;
+
+  pool_head_ = nullptr;
+  pool_depth_ = 0;
+  pool_overflow_head_ = nullptr;
+  pool_refill_count_ = 0;
+  pool_miss_count_ = 0;
+
+  return error_code_t{};
+}
+
+template <
+  typename ept_table_from_t,
+  typename ept_table_to_t
+>
+bool ept_t::split(pa_t guest_pa, pa_t host_pa) noexcept
+{
+  //
+  // Sanity compile-time checks - allow to use only EPT descriptors.
+  // See ia32/ept.h.
+  //
+  static_assert(std::is_base_of_v<ept_descriptor_tag,
+                                  ept_table_from_t::descriptor_tag>,
+                "Wrong ept_table_from_t type");
+
+
+  static_assert(std::is_base_of_v<ept_descriptor_tag,
+                                  ept_table_to_t::descriptor_tag>,
+                "Wrong ept_table_to_t type");
+
+  //
+  // Splitting pages (breaking large page into smaller ones) is possible
+  // only down accross one level (i.e. PDPT -> PD, PD -> PT).  If you
+  // desire to split PDPT into PTs (2 levels apart), you have to split
+  // the PDPT first and then split resulting PDs again into PTs.
+  //
+  static_assert(ept_table_from_t::level - 1 == ept_table_to_t::level,
+                "Cannot split page-tables accros multiple levels");
+
+  //
+  // PML4 is not splittable (doesn't have the "large_page" flag).
+  // Although this might change in the future CPUs.
+  //
+  static_assert(ept_table_from_t::level != pml::pml4,
+                "Cannot split PML4 into PDPTs");
+
+  //
+  // Fetch the EPT entry for the provided guest physical address.
+  // The returned EPT entry is fetched at the "ept_table_from_t::level",
+  // this means that if we're splitting from PD to PTs, we've fetched PD entry.
+  //
+  auto entry = walk<ept_table_from_t>(guest_pa);
+
+  //
+  // Make sure that the fetched entry is indeed large.
+  // We can't split non-large pages - they already are splitted.
+  //
+  hvpp_assert(entry && entry->large_page);
+
+  //
+  // Map the physical memory range again, this time with smaller EPT
+  // entries.  The first map() splits the large entry itself (see
+  // split_entry()) - if the subtable can't be taken from the pool,
+  // the large entry is left intact.  The remaining entries then reuse
+  // the subtable.
+  //
+  // If we're splitting 2MB page into 4kb pages, we're mapping range
+  // [ guest_pa, guest_pa + 2MB ].
+  //
+  // Note: Each paging structure on Intel architectures always contain 512
+  //       entries (one PDPT can contain 512 PDs, one PD can contain 512 PTs,
+  //       one PT can contain 512 pages).  This is convenient because at the
+  //       same time, each EPT structure has 8 bytes - therefore those 512
+  //       entries can always fit into single 4kb page.
+  //
+  //       This means that this for-loop always exetues 512-times, no matter
+  //       what the ept_table_from_t is.
+  //
+  for (uint64_t i = 0; i < ept_table_from_t::count; i++)
+  {
+    if (!map(guest_pa + (i * ept_table_to_t::size), // offset = iteration * page_size
+             host_pa  + (i * ept_table_to_t::size), // offset = iteration * page_size
+             epte_t::access_type::read_write_execute,
+             ept_table_to_t::level))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+template <
+  typename ept_table_from_t,
+  typename ept_table_to_t
+>
+bool ept_t::join(pa_t guest_pa, pa_t host_pa) noexcept
+{
+  //
+  // Sanity compile-time checks - allow to use only EPT descriptors.
+  // See ia32/ept.h.
+  //
+  static_assert(std::is_base_of_v<ept_descriptor_tag,
+                                  ept_table_from_t::descriptor_tag>,
+                "Wrong ept_table_from_t type");
+
+
+  static_assert(std::is_base_of_v<ept_descriptor_tag,
+                                  ept_table_to_t::descriptor_tag>,
+                "Wrong ept_table_to_t type");
+
+  //
+  // Joining pages (merging pages into one large page) is possible
+  // only up accross one level (i.e. PD -> PDPT, PT -> PD).  If you
+  // desire to join PTs into PDPT (2 levels apart), you have to join
+  // each PT into PDs first and then join resulting PDs again into PDPT.
+  //
+  static_assert(ept_table_from_t::level + 1 == ept_table_to_t::level,
+                "Cannot join page-tables accros multiple levels");
+
+  //
+  // PDPTs are not joinable into PML4 (PML4 doesn't have the "large_page" flag).
+  // Although this might change in the future CPUs.
+  //
+  static_assert(ept_table_from_t::level != pml::pdpt,
+                "Cannot join PDPTs to PML4");
+
+  //
+  // Make sure the guest physical address is aligned with respect to the
+  // target EPT structure; i.e. if we're joining PTs into PD, the guest_pa
+  // must be aligned to 2MB boundary.  If we're joining PDs into PDPT,
+  // the guest_pa must be aligned to 1GB boundary.
+  //
+  hvpp_assert((guest_pa & ept_table_to_t::mask) == guest_pa);
+  guest_pa = page_align(guest_pa.value(), ept_table_to_t{});
+
+  //
+  // Fetch the EPT entry for the provided guest physical address.
+  // The returned EPT entry is fetched at the "ept_table_to_t::level",
+  // this means that if we're joining PTs into PD, we've fetched PD entry.
+  //
+  auto entry = walk<ept_table_to_t>(guest_pa);
+
+  //
+  // Make sure that the fetched entry is not large.
+  // We can't join large pages.
+  //
+  if (!entry || entry->large_page)
+  {
+    hvpp_assert(0);
+    return false;
+  }
+
+  //
+  // Map the physical memory range again, this time with single large
+  // EPT entry.  map() unmaps the entry first - this will also deallocate
+  // entries in the subtable (e.g. if entry is PD, the PT it points to
+  // (entry->page_frame_number) will get automatically deallocated).
+  //
+  return map(guest_pa,
+             host_pa,
+             epte_t::access_type::read_write_execute,
+             ept_table_to_t::level) != nullptr;
+}
+
+template <typename ept_table_t>
+epte_t* ept_t::walk(pa_t guest_pa) noexcept
+{
+  static_assert(ept_table_t::level != pml::pml4,
+                "Cannot walk to PML4 entry");
+
+  //
+  // Start at PML4 and traverse down the paging hierarchy.
+  // Returns nullptr for unmapped (non-present) physical addresses.
+  // The level checks are resolved at compile-time.
+  //
+  auto pml4e = &epml4_[guest_pa.index(pml::pml4)];
+
+  if (!pml4e->is_present())
+  {
+    return nullptr;
+  }
+
+  auto pdpte = &subtable_of(pml4e)[guest_pa.index(pml::pdpt)];
+
+  if constexpr (ept_table_t::level == pml::pdpt)
+  {
+    return pdpte;
+  }
+  else
+  {
+    if (pdpte->large_page || !pdpte->is_present())
+    {
+      return pdpte->large_page ? pdpte : nullptr;
+    }
+
+    auto pde = &subtable_of(pdpte)[guest_pa.index(pml::pd)];
+
+    if constexpr (ept_table_t::level == pml::pd)
+    {
+      return pde;
+    }
+    else
+    {
+      if (pde->large_page || !pde->is_present())
+      {
+        return pde->large_page ? pde : nullptr;
+      }
+
+      return &subtable_of(pde)[guest_pa.index(pml::pt)];
+    }
+  }
+}
+
+template epte_t* ept_t::walk<ept_pt_t>  (pa_t) noexcept;
+template epte_t* ept_t::walk<ept_pd_t>  (pa_t) noexcept;
+template epte_t* ept_t::walk<ept_pdpt_t>(pa_t) noexcept;
+
+epte_t* ept_t::ept_entry(pa_t guest_pa, pml level /* = pml::pt */) noexcept
+{
+  switch (level)
+  {
+    case pml::pdpt: return walk<ept_pdpt_t>(guest_pa);
+    case pml::pd:   return walk<ept_pd_t>(guest_pa);
+    default:        return walk<ept_pt_t>(guest_pa);
+  }
+}
+
+bool ept_t::translate(pa_t guest_pa, bool write, pa_t& host_pa) noexcept
+{
+  auto entry = walk(guest_pa);
+
+  if (!entry || !entry->read_access || (write && !entry->write_access))
+  {
+    return false;
+  }
+
+  //
+  // Large entry maps the offset into the large page as well.
+  //
+  const auto entry_size = !entry->large_page
+    ? ept_pt_t::size
+    : walk<ept_pdpt_t>(guest_pa) == entry
+      ? ept_pdpt_t::size
+      : ept_pd_t::size;
+
+  host_pa = pa_t::from_pfn(entry->page_frame_number) + (guest_pa & (entry_size - 1));
+  return true;
+}
+
+epte_t* ept_t::allocate_table() noexcept
+{
+  if (base_)
+  {
+    return base_->allocate_table();
+  }
+
+  //
+  // Pop pre-zeroed page from the pool.
+  //
+  auto entry = pool_head_.load(std::memory_order_acquire);
+
+  while (entry && !pool_head_.compare_exchange_weak(entry, entry->next,
+                                                    std::memory_order_acquire))
+  {
+    ;
+  }
+
+  if (entry)
+  {
+    --pool_depth_;
+
+    //
+    // The shadow page is already zeroed, the entries are overwritten
+    // below (including the "next" pointer).
+    //
+    auto table = reinterpret_cast<epte_t*>(entry);
+    clear_table(table);
+    return table;
+  }
+
+  //
+  // The pool is exhausted - the allocator can't be used here (see
+  // pool_refill()), the caller fails.
+  //
+  ++pool_miss_count_;
+  return nullptr;
+}
+
+void ept_t::free_table(epte_t* table) noexcept
+{
+  //
+  // Table (including its shadow page) must be zeroed before it is returned to the pool (freshly
+  // allocated tables are zeroed by the caller).
+  //
+  if (base_)
+  {
+    base_->free_table(table);
+    return;
+  }
+
+  //
+  // If the pool is full, the table is left for pool_refill() - the
+  // allocator can't be used in VMX-root mode.
+  //
+  const bool overflow = pool_depth_ >= pool_capacity;
+  auto& head = overflow ? pool_overflow_head_ : pool_head_;
+
+  auto entry = reinterpret_cast<pool_entry_t*>(table);
+  entry->next = head.load(std::memory_order_relaxed);
+
+  while (!head.compare_exchange_weak(entry->next, entry,
+                                     std::memory_order_release))
+  {
+    ;
+  }
+
+  if (!overflow)
+  {
+    ++pool_depth_;
+  }
+}
+
+void ept_t::release_table(epte_t* table, pml level) noexcept
+{
+  //
+  // Drop one reference to the table.  The table (and its subtables) is
+  // released only by its last reference - until then, only its entries
+  // are removed from the reverse map of this EPT.
+  //
+  if (auto share_count = table_counter(table, share_counter))
+  {
+    table_counter(table, share_counter, share_count - 1);
+    rmap_remove_table(table, level);
+    return;
+  }
+
+  if (level == pml::pt)
+  {
+    if (rmap_)
+    {
+      for (int i = 0; i < 512; ++i)
+      {
+        rmap_remove(&table[i]);
+      }
+    }
+  }
+  else
+  {
+    unmap_table(table, level);
+  }
+
+  memset(table, 0, table_size);
+  free_table(table);
+}
+
+void ept_t::share_table(epte_t* table, epte_t* source) noexcept
+{
+  //
+  // Copy entries of the source table and mark all its subtables as
+  // shared.  The share counter of each table holds the number of its
+  // references besides the first one.
+  //
+  memcpy(table, source, page_size);
+
+  for (int i = 0; i < 512; ++i)
+  {
+    auto subtable = subtable_of(&source[i]);
+
+    link_subtable(&table[i], subtable, subtable != nullptr);
+
+    if (subtable)
+    {
+      table_counter(subtable, share_counter, table_counter(subtable, share_counter) + 1);
+    }
+  }
+}
+
+epte_t* ept_t::unshare_subtable(epte_t* entry) noexcept
+{
+  //
+  // Copy-on-write - replace the shared subtable by its private copy.
+  // Subtables of the copy are still shared.  Access and other bits
+  // of the entry are preserved.
+  //
+  hvpp_assert(is_shared(entry));
+
+  auto shared_subtable = subtable_of(entry);
+  auto share_count = table_counter(shared_subtable, share_counter);
+
+  if (!share_count)
+  {
+    //
+    // All other references have been dropped meanwhile (e.g. the base
+    // EPT has coalesced the region) - take over the subtable.
+    //
+    link_subtable(entry, shared_subtable);
+    return shared_subtable;
+  }
+
+  auto subtable = allocate_table();
+
+  if (!subtable)
+  {
+    return nullptr;
+  }
+
+  share_table(subtable, shared_subtable);
+  table_counter(shared_subtable, share_counter, share_count - 1);
+
+  entry->update(pa_t::from_va(subtable), static_cast<epte_t::access_type>(entry->access));
+  link_subtable(entry, subtable);
+  return subtable;
+}
+
+epte_t* ept_t::map_subtable(epte_t* table) noexcept
+{
   //
   // Get or create next level of EPT table hierarchy.
   // PML4 -> PDPT -> PD -> PT
+  // Returns nullptr if the subtable can't be taken from the pool.
   //
   if (table->is_present())
   {
-    return table->subtable();
+    return is_shared(table)
+      ? unshare_subtable(table)
+      : subtable_of(table);
   }
 
-  auto subtable = new epte_t[512];
-  hvpp_assert(subtable != nullptr);
-  memset(subtable, 0, sizeof(epte_t) * 512);
-  static_assert(sizeof(epte_t) * 512 == page_size);
+  auto subtable = allocate_table();
+
+  if (!subtable)
+  {
+    return nullptr;
+  }
 
   table->update(pa_t::from_va(subtable));
+  link_subtable(table, subtable);
   return subtable;
 }
 
-epte_t* ept_t::map_pml4(pa_t guest_pa, pa_t host_pa, epte_t* pml4,
-                        epte_t::access_type access, pml large) noexcept
+epte_t* ept_t::split_entry(epte_t* entry, pa_t guest_pa, pml level) noexcept
 {
-  auto pml4e = &pml4[guest_pa.index(pml::pml4)];
-  auto pdpt = map_subtable(pml4e);
+  //
+  // Split large entry (1GB PDPTE or 2MB PDE) into 512 smaller entries in
+  // the newly created subtable.  Unlike split(), the original mapping
+  // (host PFN and access) is preserved in the resulting entries and
+  // the table is filled in place - without walking the hierarchy for
+  // each entry.
+  //
+  // The guest_pa must be aligned to the size of the large entry.
+  // Returns nullptr (and the entry is left intact) if the subtable can't
+  // be taken from the pool.
+  //
+  hvpp_assert(entry->large_page);
+  hvpp_assert(level == pml::pdpt || level == pml::pd);
+
+  const auto sublevel     = level - 1;
+  const auto subpage_size = sublevel == pml::pd ? ept_pd_t::size : ept_pt_t::size;
+  const auto host_pa      = pa_t::from_pfn(entry->page_frame_number);
+  const auto access       = static_cast<epte_t::access_type>(entry->access);
+  const auto suppress_ve  = entry->suppress_ve;
+
+  auto subtable = allocate_table();
+
+  if (!subtable)
+  {
+    return nullptr;
+  }
+
+  for (uint64_t i = 0; i < 512; ++i)
+  {
+    subtable[i].update(host_pa  + i * subpage_size,
+                       memory_manager::mtrr().type(guest_pa + i * subpage_size),
+                       sublevel != pml::pt,
+                       access);
+
+    subtable[i].suppress_ve = suppress_ve;
+
+    rmap_insert(&subtable[i], sublevel, guest_pa + i * subpage_size);
+  }
+
+  rmap_remove(entry);
+  entry->clear();
+  entry->update(pa_t::from_va(subtable));
+  link_subtable(entry, subtable);
+
+  if (level == pml::pd)
+  {
+    track_split(guest_pa);
+  }
 
-  return map_pdpt(guest_pa, host_pa, pdpt, access, large);
+  return subtable;
 }
 
-epte_t* ept_t::map_pdpt(pa_t guest_pa, pa_t host_pa, epte_t* pdpt,
-                        epte_t::access_type access, pml large) noexcept
+void ept_t::clear_entry(epte_t* entry) noexcept
 {
-  auto pdpte = &pdpt[guest_pa.index(pml::pdpt)];
+  entry->clear();
+  entry->suppress_ve = true;
+}
 
-  if (large == pml::pdpt)
+void ept_t::clear_table(epte_t* table) noexcept
+{
+  for (int i = 0; i < 512; ++i)
   {
-    pdpte->update(host_pa, memory_manager::mtrr().type(guest_pa), true);
-    return pdpte;
+    clear_entry(&table[i]);
+  }
+}
+
+bool ept_t::is_unmapped(const epte_t* entry) noexcept
+{
+  epte_t unmapped;
+  clear_entry(&unmapped);
+
+  return (entry->flags & ~unmapped.flags) == 0;
+}
+
+uint32_t ept_t::table_counter(epte_t* table, int counter) noexcept
+{
+  auto item = &shadow(table + counter * 2);
+
+  return static_cast<uint32_t>(((item[0] & shadow_mask) >> 1) |
+                               ((item[1] & shadow_mask) >> 1) << 11);
+}
+
+void ept_t::table_counter(epte_t* table, int counter, uint32_t value) noexcept
+{
+  hvpp_assert(value < (1u << 22));
+
+  constexpr auto counter_mask = shadow_mask & ~shared_tag;
+
+  auto item = &shadow(table + counter * 2);
+
+  item[0] = (item[0] & ~counter_mask) | ((uintptr_t(value)       << 1) & counter_mask);
+  item[1] = (item[1] & ~counter_mask) | ((uintptr_t(value >> 11) << 1) & counter_mask);
+}
+
+void ept_t::track_split(pa_t guest_pa) noexcept
+{
+  guest_pa = guest_pa & ept_pd_t::mask;
+
+  for (size_t i = 0; i < split_pd_count_; ++i)
+  {
+    if (split_pd_[i] == guest_pa)
+    {
+      return;
+    }
   }
 
-  auto pd = map_subtable(pdpte);
-  return map_pd(guest_pa, host_pa, pd, access, large);
+  if (split_pd_count_ < max_split_count)
+  {
+    split_pd_[split_pd_count_++] = guest_pa;
+  }
+  else
+  {
+    ++split_overflow_count_;
+  }
 }
 
-epte_t* ept_t::map_pd(pa_t guest_pa, pa_t host_pa, epte_t* pd,
-                      epte_t::access_type access, pml large) noexcept
+auto ept_t::rmap_find(pa_t host_pa, pml level) noexcept -> rmap_record_t*
 {
-  auto pde = &pd[guest_pa.index(pml::pd)];
+  const auto size = level == pml::pdpt ? ept_pdpt_t::size
+                  : level == pml::pd   ? ept_pd_t::size
+                  :                      ept_pt_t::size;
 
-  if (large == pml::pd)
+  const auto mask = rmap_capacity_ - 1;
+  const auto host_pfn = pa_t(host_pa.value() & ~(size - 1)).pfn();
+
+  for (auto index = (host_pfn * 0x9e3779b97f4a7c15ull) & mask;
+       rmap_[index].entry;
+       index = (index + 1) & mask)
   {
-    pde->update(host_pa, memory_manager::mtrr().type(guest_pa), true);
-    return pde;
+    auto& record = rmap_[index];
+
+    if (record.host_pfn == host_pfn && record.level == level)
+    {
+      return &record;
+    }
   }
 
-  auto pt = map_subtable(pde);
-  return map_pt(guest_pa, host_pa, pt, access, large);
+  return nullptr;
 }
 
-epte_t* ept_t::map_pt(pa_t guest_pa, pa_t host_pa, epte_t* pt,
-                      epte_t::access_type access, pml large) noexcept
+void ept_t::rmap_insert(epte_t* entry, pml level, pa_t guest_pa) noexcept
 {
-  auto pte = &pt[guest_pa.index(pml::pt)];
+  if (!rmap_)
+  {
+    return;
+  }
 
-  (void)(large);
-  hvpp_assert(large == pml::pt);
+  //
+  // Identity mappings are not recorded.
+  //
+  const auto host_pfn = entry->page_frame_number;
+
+  if (host_pfn == guest_pa.pfn())
+  {
+    return;
+  }
+
+  //
+  // Keep the load factor below 3/4.
+  //
+  if (rmap_count_ >= rmap_capacity_ / 4 * 3)
+  {
+    ++rmap_overflow_count_;
+    return;
+  }
+
+  const auto mask = rmap_capacity_ - 1;
+  auto index = (host_pfn * 0x9e3779b97f4a7c15ull) & mask;
+
+  while (rmap_[index].entry)
+  {
+    index = (index + 1) & mask;
+  }
+
+  rmap_[index] = { host_pfn, guest_pa, entry, level };
+  ++rmap_count_;
+
+  //
+  // The record holds pointer to the entry - keep its PT alive.
+  //
+  if (level == pml::pt)
+  {
+    pin(entry);
+  }
+}
+
+void ept_t::rmap_remove(epte_t* entry) noexcept
+{
+  if (!rmap_ || is_unmapped(entry))
+  {
+    return;
+  }
+
+  const auto mask = rmap_capacity_ - 1;
+  const auto host_pfn = entry->page_frame_number;
+  auto index = (host_pfn * 0x9e3779b97f4a7c15ull) & mask;
+
+  while (rmap_[index].entry != entry)
+  {
+    if (!rmap_[index].entry)
+    {
+      //
+      // Not recorded (identity mapping or overflow).
+      //
+      return;
+    }
+
+    index = (index + 1) & mask;
+  }
+
+  if (rmap_[index].level == pml::pt)
+  {
+    unpin(entry);
+  }
+
+  //
+  // Backward-shift deletion - move the following records of the same
+  // cluster into the hole, if their home slot allows it.  This keeps
+  // the table free of tombstones.
+  //
+  auto hole = index;
+
+  for (;;)
+  {
+    index = (index + 1) & mask;
+
+    if (!rmap_[index].entry)
+    {
+      break;
+    }
+
+    auto home = (rmap_[index].host_pfn * 0x9e3779b97f4a7c15ull) & mask;
+
+    if (((index - home) & mask) >= ((index - hole) & mask))
+    {
+      rmap_[hole] = rmap_[index];
+      hole = index;
+    }
+  }
+
+  rmap_[hole].entry = nullptr;
+  --rmap_count_;
+}
+
+void ept_t::rmap_remove_table(epte_t* table, pml level) noexcept
+{
+  if (!rmap_)
+  {
+    return;
+  }
+
+  for (int i = 0; i < 512; ++i)
+  {
+    auto entry = &table[i];
+
+    if (level == pml::pt || entry->large_page)
+    {
+      rmap_remove(entry);
+    }
+    else if (entry->is_present())
+    {
+      rmap_remove_table(subtable_of(entry), level - 1);
+    }
+  }
+}
+
+bool ept_t::diverges(ept_t& base, pa_t guest_pa, size_t size) noexcept
+{
+  //
+  // This view diverges from the base EPT in the range if any entry which
+  // maps the range in the base EPT isn't reached by this view - i.e. the
+  // view has copied (or not yet created) some table on the path.
+  //
+  const pa_t guest_pa_end = guest_pa + size;
+
+  while (guest_pa < guest_pa_end)
+  {
+    pml level;
+    pml view_level;
+
+    auto entry = base.path_end(guest_pa, level);
+
+    if (path_end(guest_pa, view_level) != entry)
+    {
+      return true;
+    }
+
+    const uint64_t entry_size = level == pml::pml4 ? ept_pml4_t::size
+                              : level == pml::pdpt ? ept_pdpt_t::size
+                              : level == pml::pd   ? ept_pd_t::size
+                              :                      ept_pt_t::size;
+
+    guest_pa = (guest_pa & ~(entry_size - 1)) + entry_size;
+  }
+
+  return false;
+}
+
+epte_t* ept_t::path_end(pa_t guest_pa, pml& level) noexcept
+{
+  //
+  // Deepest entry on the path to the guest physical address - either
+  // the leaf entry or the first entry which doesn't have any subtable.
+  //
+  auto table = epml4_;
+  level = pml::pml4;
+
+  for (;;)
   {
-    pte->update(host_pa, memory_manager::mtrr().type(guest_pa), access);
-    return pte;
+    auto entry = &table[guest_pa.index(level)];
+
+    if (level == pml::pt || entry->large_page || !entry->is_present())
+    {
+      return entry;
+    }
+
+    table = subtable_of(entry);
+    --level;
   }
 }
 
 void ept_t::unmap_table(epte_t* table, pml level /* = pml::pml4 */) noexcept
 {
   //
-  // Table must be present and it cannot be large page.
+  // Table must be valid.  Note that the table can contain mix of large
+  // and non-large entries (e.g. after map_range()) - unmap_entry() takes
+  // care of both.
   //
-  hvpp_assert(table && table->is_present() && !table->large_page);
+  hvpp_assert(table);
 
   //
   // PTs already point to real physical addresses - we can't unmap them.
@@ -469,6 +2205,14 @@ void ept_t::unmap_entry(epte_t* entry, pml level) noexcept
 {
   hvpp_assert(entry);
 
+  //
+  // Remove large page from the reverse map (even if it has no access).
+  //
+  if (entry->large_page)
+  {
+    rmap_remove(entry);
+  }
+
   if (!entry->is_present())
   {
     //
@@ -489,39 +2233,183 @@ void ept_t::unmap_entry(epte_t* entry, pml level) noexcept
   if (!entry->large_page)
   {
     //
-    // Fetch subtable. Only non-large pages have subtables.
+    // Drop the subtable. Only non-large pages have subtables.
     //
-    auto subtable = entry->subtable();
+    hvpp_assert(level != pml::pt);
+    release_table(subtable_of(entry), level - 1);
+  }
 
-    //
-    // Unmap and/or deallocate the subtable based on current page map level.
-    //
-    switch (level)
-    {
-      case pml::pml4:
-      case pml::pdpt:
-        if (!subtable->large_page)
-        {
-          unmap_table(subtable, level - 1);
-        }
-        delete[] subtable;
-        break;
+  //
+  // Unmap entry and make it not present.
+  //
+  clear_entry(entry);
+  link_subtable(entry, nullptr);
+}
+
+//
+// EPT transaction.
+//
 
-        case pml::pd:
-          delete[] subtable;
-          break;
+ept_transaction_t::ept_transaction_t(ept_t& ept) noexcept
+  : ept_(ept)
+  , operation_count_(0)
+  , operation_count_total_(0)
+  , entry_count_(0)
+  , cycle_count_(0)
+  , pending_(false)
+  , failed_(false)
+{
 
-        case pml::pt:
-        default:
-          hvpp_assert(0);
-          break;
-        }
+}
+
+ept_transaction_t::~ept_transaction_t() noexcept
+{
+  commit();
+}
+
+void ept_transaction_t::map_range(pa_t guest_pa, pa_t host_pa, size_t size,
+                                  epte_t::access_type access /* = epte_t::access_type::read_write_execute */) noexcept
+{
+  enqueue({ operation_type::map_range, access, guest_pa, host_pa, size });
+}
+
+void ept_transaction_t::protect_range(pa_t guest_pa, size_t size,
+                                      epte_t::access_type access) noexcept
+{
+  enqueue({ operation_type::protect_range, access, guest_pa, pa_t{}, size });
+}
+
+void ept_transaction_t::split_1gb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept
+{
+  enqueue({ operation_type::split_1gb_to_2mb, epte_t::access_type{}, guest_pa, host_pa, ept_pdpt_t::size });
+}
+
+void ept_transaction_t::split_2mb_to_4kb(pa_t guest_pa, pa_t host_pa) noexcept
+{
+  enqueue({ operation_type::split_2mb_to_4kb, epte_t::access_type{}, guest_pa, host_pa, ept_pd_t::size });
+}
+
+void ept_transaction_t::join_2mb_to_1gb(pa_t guest_pa, pa_t host_pa) noexcept
+{
+  enqueue({ operation_type::join_2mb_to_1gb, epte_t::access_type{}, guest_pa, host_pa, ept_pdpt_t::size });
+}
+
+void ept_transaction_t::join_4kb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept
+{
+  enqueue({ operation_type::join_4kb_to_2mb, epte_t::access_type{}, guest_pa, host_pa, ept_pd_t::size });
+}
+
+void ept_transaction_t::commit() noexcept
+{
+  if (!pending_)
+  {
+    return;
   }
 
+  flush();
+
+  auto tsc_start = ia32_asm_read_tsc();
+  ept_.invalidate();
+  cycle_count_ += ia32_asm_read_tsc() - tsc_start;
+
+  pending_ = false;
+}
+
+void ept_transaction_t::enqueue(const operation_t& operation) noexcept
+{
+  pending_ = true;
+
   //
-  // Unmap entry and make it not present.
+  // Try to merge the operation with the previous one.  This is possible
+  // only for map/protect operations with the same access, which directly
+  // follow the previous range (both guest and host ranges, in case
+  // of map_range).
   //
-  entry->clear();
+  if (operation_count_ > 0)
+  {
+    auto& previous = operation_[operation_count_ - 1];
+
+    if (previous.type == operation.type &&
+        previous.access == operation.access &&
+        previous.guest_pa + previous.size == operation.guest_pa)
+    {
+      if (operation.type == operation_type::protect_range ||
+         (operation.type == operation_type::map_range &&
+          previous.host_pa + previous.size == operation.host_pa))
+      {
+        previous.size += operation.size;
+        return;
+      }
+    }
+  }
+
+  if (operation_count_ == max_operation_count)
+  {
+    flush();
+  }
+
+  operation_[operation_count_++] = operation;
+  operation_count_total_ += 1;
+}
+
+void ept_transaction_t::flush() noexcept
+{
+  auto tsc_start = ia32_asm_read_tsc();
+
+  for (size_t i = 0; i < operation_count_; ++i)
+  {
+    auto& operation = operation_[i];
+
+    size_t entry_count = 0;
+    bool succeeded = false;
+
+    switch (operation.type)
+    {
+      case operation_type::map_range:
+        succeeded = !ept_.map_range(operation.guest_pa, operation.host_pa, operation.size, operation.access, &entry_count);
+        break;
+
+      case operation_type::protect_range:
+        succeeded = !ept_.protect_range(operation.guest_pa, operation.size, operation.access, &entry_count);
+        break;
+
+      case operation_type::split_1gb_to_2mb:
+        succeeded = ept_.split_1gb_to_2mb(operation.guest_pa, operation.host_pa);
+        entry_count = ept_pd_t::count;
+        break;
+
+      case operation_type::split_2mb_to_4kb:
+        succeeded = ept_.split_2mb_to_4kb(operation.guest_pa, operation.host_pa);
+        entry_count = ept_pt_t::count;
+        break;
+
+      case operation_type::join_2mb_to_1gb:
+        succeeded = ept_.join_2mb_to_1gb(operation.guest_pa, operation.host_pa);
+        entry_count = 1;
+        break;
+
+      case operation_type::join_4kb_to_2mb:
+        succeeded = ept_.join_4kb_to_2mb(operation.guest_pa, operation.host_pa);
+        entry_count = 1;
+        break;
+    }
+
+    //
+    // Operations following a failed one are still flushed - they are
+    // independent of each other - but the whole transaction is reported
+    // as failed.
+    //
+    if (!succeeded)
+    {
+      failed_ = true;
+    }
+
+    entry_count_ += entry_count;
+  }
+
+  operation_count_ = 0;
+
+  cycle_count_ += ia32_asm_read_tsc() - tsc_start;
 }
 
 }
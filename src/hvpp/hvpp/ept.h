@@ -1,9 +1,14 @@
 #pragma once
+#include "ept_snapshot.h"
+#include "config.h"
+
 #include "ia32/ept.h"
 #include "ia32/memory.h"
 
 #include "lib/error.h"
 
+#include <atomic>
+
 namespace hvpp {
 
 using namespace ia32;
@@ -14,60 +19,578 @@ class ept_t
     auto initialize() noexcept -> error_code_t;
     void destroy() noexcept;
 
+    //
+    // Copy-on-write view.
+    //
+    // initialize_view() allocates the PML4 of the view, therefore it must
+    // be called outside of VMX-root mode.  attach(base) then makes it view
+    // which shares all tables of the base EPT and detach() drops all its
+    // tables again - neither of them allocates memory, so that views can
+    // be attached and detached in VMX-root mode.
+    //
+    // When the view is modified (by map_*(), map_range() or
+    // protect_range()), shared tables on the path to the modified entry
+    // are copied first, so that the base EPT (and other views) is never
+    // modified through the view.  The copies are taken from the table
+    // pool of the base EPT.  Unmodified subtrees stay shared, therefore
+    // modifications of the base EPT in these subtrees are visible in the
+    // view too.  Modifications of the base EPT made by map_*(),
+    // remap_4kb(), map_range() and protect_range() in subtrees which the
+    // view has already copied are applied to the view as well (they
+    // overwrite modifications of the same entries made in the view).
+    //
+    // Shared tables are reference-counted, therefore the base EPT can
+    // release its tables (e.g. by coalesce()) while it has views.  The
+    // base EPT must outlive its attached views.  Note that the
+    // accessed/dirty flags of shared entries are shared too.
+    //
+    auto initialize_view() noexcept -> error_code_t;
+    void attach(ept_t& base) noexcept;
+    void detach() noexcept;
+
+    bool   is_view() const noexcept { return base_ != nullptr; }
+    ept_t* base() const noexcept { return base_; }
+    size_t view_count() const noexcept { return view_count_; }
+
+    //
+    // map_identity() must be called outside of VMX-root mode - it refills
+    // the table pool as needed (see pool_refill()).
+    //
     void map_identity() noexcept;
 
+    //
+    // If "suppress_ve" is false and the "EPT-violation #VE" control is
+    // enabled, EPT violation caused by the mapped page is delivered to
+    // the guest as virtualization exception (#VE) instead of VM-exit
+    // (see vcpu_t::ve_register()).  Entries created by split or range
+    // operations inherit/keep the "suppress #VE" bit; new mappings
+    // suppress #VE by default.
+    //
+    // Entries which aren't mapped (including not yet used entries of new
+    // tables and entries removed by unmap()) have only this bit set, so
+    // that guest physical addresses which aren't mapped at all never
+    // raise #VE.
+    //
+    // Map and split operations take new tables from the table pool (see
+    // pool_refill()).  If the pool is exhausted, the operation fails -
+    // map_*() return nullptr, split_*()/join_*()/remap_4kb() return false
+    // and range operations return an error.  Failed operation may leave
+    // the EPT (or its views) partially updated, e.g. with some pages
+    // of the range already remapped.
+    //
     epte_t* map    (pa_t guest_pa, pa_t host_pa,
                     epte_t::access_type access = epte_t::access_type::read_write_execute,
-                    pml large = pml::pt) noexcept;
+                    pml large = pml::pt, bool suppress_ve = true) noexcept;
+
+    //
+    // Map page of the size described by "ept_table_t" (ept_pt_t,
+    // ept_pd_t or ept_pdpt_t).  The walk is unrolled at compile-time
+    // into straight-line code - map(), map_4kb(), map_2mb() and map_1gb()
+    // are thin wrappers around it.
+    //
+    template <typename ept_table_t>
+    epte_t* map    (pa_t guest_pa, pa_t host_pa,
+                    epte_t::access_type access = epte_t::access_type::read_write_execute,
+                    bool suppress_ve = true) noexcept;
 
     epte_t* map_4kb(pa_t guest_pa, pa_t host_pa,
-                    epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+                    epte_t::access_type access = epte_t::access_type::read_write_execute,
+                    bool suppress_ve = true) noexcept;
 
     epte_t* map_2mb(pa_t guest_pa, pa_t host_pa,
-                    epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+                    epte_t::access_type access = epte_t::access_type::read_write_execute,
+                    bool suppress_ve = true) noexcept;
 
     epte_t* map_1gb(pa_t guest_pa, pa_t host_pa,
-                    epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+                    epte_t::access_type access = epte_t::access_type::read_write_execute,
+                    bool suppress_ve = true) noexcept;
 
-    void split_1gb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept;
-    void split_2mb_to_4kb(pa_t guest_pa, pa_t host_pa) noexcept;
+    bool split_1gb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept;
+    bool split_2mb_to_4kb(pa_t guest_pa, pa_t host_pa) noexcept;
 
-    void join_2mb_to_1gb(pa_t guest_pa, pa_t host_pa) noexcept;
-    void join_4kb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept;
+    bool join_2mb_to_1gb(pa_t guest_pa, pa_t host_pa) noexcept;
+    bool join_4kb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept;
+
+    //
+    // Get EPT entry at desired level for provided guest physical address.
+    // If the address is mapped by a large page, the large entry is returned.
+    // Returns nullptr for unmapped (non-present) physical addresses.
+    //
+    // walk() is specialized at compile-time for the level described by
+    // "ept_table_t", ept_entry() dispatches to it.
+    //
+    template <typename ept_table_t = ept_pt_t>
+    epte_t* walk(pa_t guest_pa) noexcept;
+
+    epte_t* ept_entry(pa_t guest_pa, pml level = pml::pt) noexcept;
+
+    //
+    // Translate guest physical address into host physical address.
+    // Returns false if the address isn't mapped with read access (and
+    // with write access, if "write" is set).
+    //
+    bool    translate(pa_t guest_pa, bool write, pa_t& host_pa) noexcept;
+
+    //
+    // Remap 4kb page by the PTE previously returned by map_4kb() - without
+    // walking the EPT.  Memory type of the entry is preserved.  Reverse map
+    // is kept up-to-date.
+    //
+    bool remap_4kb(epte_t* pte, pa_t guest_pa, pa_t host_pa,
+                   epte_t::access_type access) noexcept;
+
+    //
+    // Range-based mapping.  Both methods walk the EPT hierarchy only once
+    // per range (descending again only when table boundary is crossed),
+    // split or join pages automatically and store number of touched
+    // EPT entries into "entry_count" (if provided).  Provided addresses
+    // and size must be 4kb aligned.
+    //
+    auto map_range    (pa_t guest_pa, pa_t host_pa, size_t size,
+                       epte_t::access_type access = epte_t::access_type::read_write_execute,
+                       size_t* entry_count = nullptr) noexcept -> error_code_t;
+
+    auto protect_range(pa_t guest_pa, size_t size,
+                       epte_t::access_type access,
+                       size_t* entry_count = nullptr) noexcept -> error_code_t;
+
+    //
+    // Join split 2MB regions back to 2MB pages.  Each 2MB region which
+    // has been split into 4kb pages (by split_2mb_to_4kb(), map_4kb(),
+    // map_range() or protect_range()) is tracked.  If all 512 PTEs of
+    // such region map contiguous host memory with identical access and
+    // memory type, the PT is released and the region is mapped by single
+    // 2MB page again.
+    //
+    // Regions whose PT is pinned (see pin()) are skipped.
+    //
+    // Returns number of joined regions.  Caller is responsible for the
+    // invalidation (if the returned value is non-zero).
+    //
+    // Note that any pointers to the PTEs of the joined regions become
+    // invalid.
+    //
+    size_t coalesce() noexcept;
+    size_t coalesce_count() const noexcept { return coalesce_count_; }
+
+    //
+    // Number of splits which haven't been tracked because the split list
+    // was full - such regions are never joined by coalesce().
+    //
+    size_t split_overflow_count() const noexcept { return split_overflow_count_; }
+
+    //
+    // Pin the PT which holds provided PTE (returned by map_4kb() or by
+    // walk() of a 4kb page), so that coalesce() doesn't release it while
+    // the caller keeps pointer to the PTE (e.g. ept_hook_manager).  Pins
+    // are counted - each pin() must be paired with unpin().  Note that
+    // pins don't prevent explicit remapping of the whole region (e.g. by
+    // map_2mb(), map_range() or join_4kb_to_2mb()) - such remapping
+    // releases the PT regardless of its pins, therefore the caller must
+    // not remap regions whose PTEs it still references.
+    //
+    // PTs which hold entries recorded in the reverse map are pinned by
+    // the reverse map itself.
+    //
+    void pin(epte_t* pte) noexcept;
+    void unpin(epte_t* pte) noexcept;
+
+    //
+    // Reverse map (host PFN -> EPT entries).  When enabled, every leaf
+    // entry (PTE or large PDE/PDPTE) which maps guest physical memory
+    // to different host physical memory (i.e. alias) is recorded in
+    // the hash table of rmap_enable() capacity.  Identity mappings are
+    // not recorded - they are found by walking the EPT at guest_pa ==
+    // host_pa.  The reverse map should be enabled before any alias is
+    // created, otherwise existing aliases are not known.
+    //
+    // revoke() removes all access to provided 4kb host page from every
+    // guest physical mapping of it (large pages are split, if needed),
+    // stores number of updated entries into "entry_count" (if provided).
+    // It fails if a large page can't be split - mappings which have
+    // already been revoked stay revoked.  Caller is responsible for the
+    // invalidation.
+    //
+    auto   rmap_enable(size_t capacity) noexcept -> error_code_t;
+    void   rmap_disable() noexcept;
+    size_t rmap_count() const noexcept { return rmap_count_; }
+    size_t rmap_overflow_count() const noexcept { return rmap_overflow_count_; }
+
+    auto   revoke(pa_t host_pa, size_t* entry_count = nullptr) noexcept -> error_code_t;
+
+    //
+    // Accessed/dirty flags.  ad_enable() sets the "enable accessed and
+    // dirty flags" bit in the EPT pointer (if supported by the CPU).
+    // Note that the EPT pointer in the VMCS must be updated afterwards
+    // (unless it's called before vcpu_t::setup_guest()).
+    //
+    // harvest() scans provided guest physical range and sets a bit for
+    // each accessed/dirty 4kb page (relative to guest_pa) in provided
+    // bitmaps (each of them can be nullptr).  Flags of the scanned entries
+    // are cleared atomically and mappings are invalidated once, if any
+    // flag has been cleared.  Returns number of cleared entries.
+    // Because flags of large pages can't be cleared partially, large page
+    // which partially overlaps the range is cleared as a whole.
+    //
+    // Must be called in VMX-root mode.
+    //
+    auto   ad_enable() noexcept -> error_code_t;
+    void   ad_disable() noexcept;
+    bool   ad_enabled() const noexcept { return !!eptptr_.enable_access_and_dirty_flags; }
+
+    size_t harvest(pa_t guest_pa, size_t size,
+                   void* accessed_bitmap, void* dirty_bitmap) noexcept;
+
+    //
+    // Atomically clear dirty flag of the entry which maps provided guest
+    // physical address.  Returns previous value of the flag.
+    //
+    bool   clear_dirty(pa_t guest_pa) noexcept;
+
+    //
+    // Harvest statistics - total size of scanned guest physical memory
+    // and TSC cycles spent by the scan (including the invalidation).
+    //
+    uint64_t harvest_bytes()  const noexcept { return harvest_bytes_; }
+    uint64_t harvest_cycles() const noexcept { return harvest_cycles_; }
+
+    //
+    // Table pool.  Tables needed by map/split operations are taken from
+    // per-EPT pool of pre-zeroed pages - the allocator is never called
+    // in VMX-root mode.  It takes a spinlock which doesn't raise IRQL,
+    // therefore VM-exit on the CPU which holds it (e.g. while the pool
+    // is refilled) would deadlock.  Tables released by unmap/join
+    // operations are zeroed and returned back to the pool - or, if the
+    // pool is full, to the overflow list.
+    //
+    // pool_refill() releases tables in the overflow list and fills the
+    // pool up to pool_capacity pages.  It is called by initialize() and
+    // periodically by the hypervisor (see hypervisor::start()) once
+    // pool_low() reports that the pool has fallen below
+    // pool_low_watermark (or that the overflow list isn't empty).  It
+    // must be called only outside of VMX-root mode (it allocates memory),
+    // but it can run concurrently with the VCPU which owns this EPT.
+    // If the pool is exhausted, the operation which needs the table fails
+    // (see map()) and pool_miss_count() is incremented.
+    //
+    static constexpr size_t pool_capacity = HVPP_EPT_POOL_CAPACITY;
+    static constexpr size_t pool_low_watermark = pool_capacity / 4;
+
+    void   pool_refill() noexcept;
+    bool   pool_low() const noexcept { return pool_depth_ < pool_low_watermark || pool_overflow_head_; }
+    size_t pool_depth() const noexcept { return pool_depth_; }
+    size_t pool_refill_count() const noexcept { return pool_refill_count_; }
+    size_t pool_miss_count() const noexcept { return pool_miss_count_; }
+
+    //
+    // Snapshot (see ept_snapshot.h).  snapshot() walks the EPT in guest
+    // physical address order and writes run-length encoded description
+    // of all leaf entries into provided buffer.  Records which don't fit
+    // into the buffer are dropped (header is written if it fits).  Returns
+    // number of bytes needed for the whole snapshot - if it's greater
+    // than provided size, the snapshot is truncated.  No memory is
+    // allocated, therefore it can be called in VMX-root mode.
+    //
+    // restore() maps all entries described by the snapshot.  It should
+    // be applied to freshly initialized EPT (without map_identity()).
+    // Caller is responsible for the invalidation.
+    //
+    size_t snapshot(void* buffer, size_t size) const noexcept;
+    auto   restore(const void* buffer, size_t size) noexcept -> error_code_t;
 
     ept_ptr_t ept_pointer() const noexcept;
 
+    //
+    // Invalidate mappings derived from this EPT.  Single-context INVEPT
+    // is used if supported by the CPU, all-contexts INVEPT otherwise
+    // (and also if this EPT has views, because they share its tables).
+    // Must be called in VMX-root mode.
+    //
+    void invalidate() noexcept;
+
   private:
     template <
       typename ept_table_from_t,
       typename ept_table_to_t
     >
-    void split(pa_t guest_pa, pa_t host_pa) noexcept;
+    bool split(pa_t guest_pa, pa_t host_pa) noexcept;
 
     template <
       typename ept_table_from_t,
       typename ept_table_to_t
     >
-    void join(pa_t guest_pa, pa_t host_pa) noexcept;
+    bool join(pa_t guest_pa, pa_t host_pa) noexcept;
 
-    epte_t* ept_entry(pa_t guest_pa, pml level = pml::pt) noexcept;
+    //
+    // Each EPT table is allocated together with its shadow page, which
+    // directly follows the table.  N-th item of the shadow page holds
+    // virtual address of the subtable referenced by N-th entry of the
+    // table (or nullptr).  This turns EPT walks into plain pointer
+    // chasing - epte_t::subtable() would translate the PFN into VA by
+    // MmGetVirtualForPhysical() instead.
+    //
+    // Subtables are page-aligned, therefore the low 12 bits of each item
+    // are free.  Bit 0 tags shared subtables (see below), bits 1-11 of
+    // the first items hold counters of the table itself (see
+    // table_counter()).  Items must be therefore set by link_subtable()
+    // and read by subtable_of() only.
+    //
+    static constexpr size_t table_size = 2 * page_size;
+
+    static uintptr_t& shadow(epte_t* entry) noexcept
+    { return *reinterpret_cast<uintptr_t*>(entry + 512); }
+
+    //
+    // Subtables shared with the base EPT (see attach()) have the lowest
+    // bit of the shadow item set - they must be copied before they are
+    // modified, unless all other references have been dropped meanwhile
+    // (see unshare_subtable()).
+    //
+    static constexpr uintptr_t shared_tag  = 1;
+    static constexpr uintptr_t shadow_mask = page_mask;
+
+    static bool is_shared(epte_t* entry) noexcept
+    { return !!(shadow(entry) & shared_tag); }
+
+    static epte_t* subtable_of(epte_t* entry) noexcept
+    {
+      return !entry->large_page
+        ? reinterpret_cast<epte_t*>(shadow(entry) & ~shadow_mask)
+        : nullptr;
+    }
+
+    static void link_subtable(epte_t* entry, epte_t* subtable, bool shared = false) noexcept
+    {
+      shadow(entry) = (shadow(entry) & (shadow_mask & ~shared_tag)) |
+                      reinterpret_cast<uintptr_t>(subtable) |
+                      (shared ? shared_tag : 0);
+    }
+
+    //
+    // Table which holds provided entry (tables are page-aligned).
+    //
+    static epte_t* table_of(epte_t* entry) noexcept
+    { return reinterpret_cast<epte_t*>(reinterpret_cast<uintptr_t>(entry) & ~uintptr_t(page_mask)); }
+
+    //
+    // Counters of the table.  Each counter is 22-bit - it is split into
+    // bits 1-11 of two consecutive shadow items.
+    //
+    static constexpr int pin_counter   = 0;   // see pin()
+    static constexpr int share_counter = 1;   // see share_table()
+
+    static uint32_t table_counter(epte_t* table, int counter) noexcept;
+    static void     table_counter(epte_t* table, int counter, uint32_t value) noexcept;
+
+    //
+    // Unmapped entries have only the "suppress #VE" bit set (see map()).
+    // Note that is_present() can't be used to tell whether the entry is
+    // mapped - entries with access_type::none are also "not present".
+    //
+    static void clear_entry(epte_t* entry) noexcept;
+    static void clear_table(epte_t* table) noexcept;
+    static bool is_unmapped(const epte_t* entry) noexcept;
+
+    auto    initialize_root() noexcept -> error_code_t;
+    void    share_table(epte_t* table, epte_t* source) noexcept;
+    epte_t* unshare_subtable(epte_t* entry) noexcept;
+
+    epte_t* allocate_table() noexcept;
+    void    free_table(epte_t* table) noexcept;
+    void    release_table(epte_t* table, pml level) noexcept;
 
     epte_t* map_subtable(epte_t* table) noexcept;
+    epte_t* split_entry(epte_t* entry, pa_t guest_pa, pml level) noexcept;
+    void    track_split(pa_t guest_pa) noexcept;
+
+    struct rmap_record_t;
+
+    rmap_record_t* rmap_find(pa_t host_pa, pml level) noexcept;
+    void    rmap_insert(epte_t* entry, pml level, pa_t guest_pa) noexcept;
+    void    rmap_remove(epte_t* entry) noexcept;
+    void    rmap_remove_table(epte_t* table, pml level) noexcept;
+
+    //
+    // Apply modification of the guest physical range, which has just
+    // been made in this EPT, to each attached view which doesn't share
+    // the modified entries (see attach()).  Returns false if "function"
+    // has failed for any view.
+    //
+    template <typename TFunction>
+    bool propagate(pa_t guest_pa, size_t size, TFunction&& function) noexcept
+    {
+      bool result = true;
+
+      for (auto view = first_view_; view; view = view->next_view_)
+      {
+        if (view->diverges(*this, guest_pa, size))
+        {
+          result = function(*view) && result;
+        }
+      }
+
+      return result;
+    }
 
-    epte_t* map_pml4(pa_t guest_pa, pa_t host_pa, epte_t* pml4,
-                     epte_t::access_type access, pml large) noexcept;
-    epte_t* map_pdpt(pa_t guest_pa, pa_t host_pa, epte_t* pdpt,
-                     epte_t::access_type access, pml large) noexcept;
-    epte_t* map_pd  (pa_t guest_pa, pa_t host_pa, epte_t* pd,
-                     epte_t::access_type access, pml large) noexcept;
-    epte_t* map_pt  (pa_t guest_pa, pa_t host_pa, epte_t* pt,
-                     epte_t::access_type access, pml large) noexcept;
+    bool    diverges(ept_t& base, pa_t guest_pa, size_t size) noexcept;
+    epte_t* path_end(pa_t guest_pa, pml& level) noexcept;
 
     void unmap_table(epte_t* table, pml level = pml::pml4) noexcept;
     void unmap_entry(epte_t* entry, pml level) noexcept;
 
     alignas(page_size) ept_ptr_t eptptr_;
                        epte_t*   epml4_;
+                       bool      pdpte_1gb_pages_;
+                       bool      invept_single_context_;
+
+    //
+    // Base EPT of this view and list of views attached to this EPT
+    // (see attach()).
+    //
+    ept_t*  base_;
+    ept_t*  first_view_;
+    ept_t*  next_view_;
+    size_t  view_count_;
+
+    //
+    // Guest physical addresses of split 2MB regions (see coalesce()).
+    // If this array gets full, further splits are not tracked (and
+    // therefore not coalesced) - they're counted in split_overflow_count_.
+    //
+    static constexpr size_t max_split_count = 256;
+
+    pa_t   split_pd_[max_split_count];
+    size_t split_pd_count_;
+    size_t split_overflow_count_;
+    size_t coalesce_count_;
+
+    //
+    // Free-list of the table pool.  The first 8 bytes of each free page
+    // hold pointer to the next free page, the rest of the page is zeroed.
+    // Pages are popped only by the owning VCPU, therefore the lock-free
+    // list isn't prone to the ABA problem.  The overflow list has the
+    // same layout - it's only pushed to by the owning VCPU and taken as
+    // a whole by pool_refill().
+    //
+    struct pool_entry_t
+    {
+      pool_entry_t* next;
+    };
+
+    //
+    // Reverse map - open addressing hash table (linear probing) keyed
+    // by host PFN.  Multiple records with the same key may exist.
+    //
+    struct rmap_record_t
+    {
+      uint64_t host_pfn;
+      pa_t     guest_pa;
+      epte_t*  entry;       // nullptr == empty slot
+      pml      level;
+    };
+
+    uint64_t       harvest_bytes_;
+    uint64_t       harvest_cycles_;
+
+    rmap_record_t* rmap_;
+    size_t         rmap_capacity_;
+    size_t         rmap_count_;
+    size_t         rmap_overflow_count_;
+
+    std::atomic<pool_entry_t*> pool_head_;
+    std::atomic<size_t>        pool_depth_;
+    std::atomic<pool_entry_t*> pool_overflow_head_;
+    size_t                     pool_refill_count_;
+    size_t                     pool_miss_count_;
+};
+
+//
+// EPT transaction.  Collects EPT modifications, applies them on
+// commit() and invalidates EPT mappings exactly once.  Contiguous
+// map/protect operations with the same access are merged, so that
+// e.g. protecting dozens of adjacent pages results in single
+// protect_range() walk.
+//
+// If the operation queue gets full, queued operations are applied
+// (without invalidation) and the queue is reused.  Uncommitted
+// transaction is committed in the destructor.
+//
+// Because commit() executes INVEPT, transaction must be committed
+// in VMX-root mode.
+//
+class ept_transaction_t
+{
+  public:
+    static constexpr size_t max_operation_count = 64;
+
+    ept_transaction_t(ept_t& ept) noexcept;
+    ~ept_transaction_t() noexcept;
+
+    ept_transaction_t(const ept_transaction_t& other) noexcept = delete;
+    ept_transaction_t& operator=(const ept_transaction_t& other) noexcept = delete;
+
+    void map_range    (pa_t guest_pa, pa_t host_pa, size_t size,
+                       epte_t::access_type access = epte_t::access_type::read_write_execute) noexcept;
+
+    void protect_range(pa_t guest_pa, size_t size,
+                       epte_t::access_type access) noexcept;
+
+    void split_1gb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept;
+    void split_2mb_to_4kb(pa_t guest_pa, pa_t host_pa) noexcept;
+
+    void join_2mb_to_1gb(pa_t guest_pa, pa_t host_pa) noexcept;
+    void join_4kb_to_2mb(pa_t guest_pa, pa_t host_pa) noexcept;
+
+    void commit() noexcept;
+
+    //
+    // True if any applied operation has failed (see ept_t::map()).
+    // Remaining operations are still applied.
+    //
+    bool failed() const noexcept { return failed_; }
+
+    //
+    // Statistics of this transaction:
+    //   - operation_count: number of queued operations (after merging)
+    //   - entry_count:     number of touched EPT entries
+    //   - cycle_count:     TSC cycles spent by applying the operations
+    //                      and by the invalidation
+    //
+    size_t   operation_count() const noexcept { return operation_count_total_; }
+    size_t   entry_count()     const noexcept { return entry_count_; }
+    uint64_t cycle_count()     const noexcept { return cycle_count_; }
+
+  private:
+    enum class operation_type : uint8_t
+    {
+      map_range,
+      protect_range,
+      split_1gb_to_2mb,
+      split_2mb_to_4kb,
+      join_2mb_to_1gb,
+      join_4kb_to_2mb,
+    };
+
+    struct operation_t
+    {
+      operation_type      type;
+      epte_t::access_type access;
+      pa_t                guest_pa;
+      pa_t                host_pa;
+      size_t              size;
+    };
+
+    void enqueue(const operation_t& operation) noexcept;
+    void flush() noexcept;
+
+    ept_t&      ept_;
+    operation_t operation_[max_operation_count];
+    size_t      operation_count_;
+    size_t      operation_count_total_;
+    size_t      entry_count_;
+    uint64_t    cycle_count_;
+    bool        pending_;
+    bool        failed_;
 };
 
 }
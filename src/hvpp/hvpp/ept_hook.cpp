@@ -0,0 +1,368 @@
+#include "ept_hook.h"
+
+#include "ia32/asm.h"
+
+#include "lib/assert.h"
+
+#include <algorithm>
+#include <cstring> // memset
+
+namespace hvpp {
+
+auto ept_hook_manager::initialize(ept_t* const* ept_list, size_t ept_count, size_t capacity) noexcept -> error_code_t
+{
+  hvpp_assert(ept_count > 0 && ept_count <= max_ept_count);
+
+  //
+  // Round the capacity up to the power of 2 and keep the load factor
+  // below 3/4.
+  //
+  size_t rounded_capacity = 1;
+
+  while (rounded_capacity / 4 * 3 < capacity)
+  {
+    rounded_capacity <<= 1;
+  }
+
+  record_ = new record_t[rounded_capacity];
+
+  if (!record_)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  memset(record_, 0, sizeof(record_t) * rounded_capacity);
+
+  for (size_t i = 0; i < ept_count; ++i)
+  {
+    ept_[i] = ept_list[i];
+  }
+
+  ept_count_ = ept_count;
+  capacity_ = rounded_capacity;
+  count_ = 0;
+
+  violation_count_ = 0;
+  violation_cycles_ = 0;
+  violation_cycles_max_ = 0;
+
+  return error_code_t{};
+}
+
+void ept_hook_manager::destroy() noexcept
+{
+  if (record_)
+  {
+    delete[] record_;
+    record_ = nullptr;
+  }
+
+  capacity_ = 0;
+  count_ = 0;
+}
+
+bool ept_hook_manager::install(pa_t page_read, pa_t page_exec) noexcept
+{
+  if (!install_hook(page_read, page_exec))
+  {
+    return false;
+  }
+
+  invalidate();
+  return true;
+}
+
+bool ept_hook_manager::remove(pa_t page_exec) noexcept
+{
+  if (!remove_hook(page_exec))
+  {
+    return false;
+  }
+
+  invalidate();
+  return true;
+}
+
+size_t ept_hook_manager::install(const hook_t* hooks, size_t count) noexcept
+{
+  size_t installed_count = 0;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (install_hook(hooks[i].page_read, hooks[i].page_exec))
+    {
+      ++installed_count;
+    }
+  }
+
+  if (installed_count)
+  {
+    invalidate();
+  }
+
+  return installed_count;
+}
+
+size_t ept_hook_manager::remove_all() noexcept
+{
+  size_t removed_count = 0;
+
+  for (size_t i = 0; i < capacity_; ++i)
+  {
+    auto& record = record_[i];
+
+    if (record.pte[0])
+    {
+      auto page_exec = pa_t::from_pfn(record.guest_pfn);
+
+      for (size_t j = 0; j < ept_count_; ++j)
+      {
+        ept_[j]->remap_4kb(record.pte[j], page_exec, page_exec,
+                           epte_t::access_type::read_write_execute);
+        ept_[j]->unpin(record.pte[j]);
+      }
+
+      record.pte[0] = nullptr;
+      ++removed_count;
+    }
+  }
+
+  count_ = 0;
+
+  if (removed_count)
+  {
+    invalidate();
+  }
+
+  return removed_count;
+}
+
+bool ept_hook_manager::handle_ept_violation(ept_t& ept, pa_t guest_pa, bool execute) noexcept
+{
+  auto tsc_start = ia32_asm_read_tsc();
+
+  auto record = find(guest_pa.pfn());
+
+  if (!record)
+  {
+    return false;
+  }
+
+  //
+  // Find the EPT which caused the violation.  Per-process views are
+  // flipped through their base EPT - the base either shares the PT
+  // with the view or it applies the change to the view's copy (see
+  // ept_t::attach()).
+  //
+  auto fault_ept = ept.is_view() ? ept.base() : &ept;
+
+  size_t index = 0;
+
+  while (index < ept_count_ && ept_[index] != fault_ept)
+  {
+    ++index;
+  }
+
+  if (index == ept_count_)
+  {
+    return false;
+  }
+
+  //
+  // If the change can't be propagated into an attached view (the EPT
+  // table pool is exhausted), the view faults again - by then, the pool
+  // should be refilled.
+  //
+  auto page_exec = pa_t::from_pfn(record->guest_pfn);
+
+  if (execute)
+  {
+    ept_[index]->remap_4kb(record->pte[index], page_exec, page_exec,
+                           epte_t::access_type::execute);
+  }
+  else
+  {
+    ept_[index]->remap_4kb(record->pte[index], page_exec, record->page_read,
+                           epte_t::access_type::read_write);
+  }
+
+  auto tsc_elapsed = ia32_asm_read_tsc() - tsc_start;
+
+  violation_count_ += 1;
+  violation_cycles_ += tsc_elapsed;
+  violation_cycles_max_ = std::max<uint64_t>(violation_cycles_max_, tsc_elapsed);
+
+  return true;
+}
+
+//
+// Private
+//
+
+bool ept_hook_manager::install_hook(pa_t page_read, pa_t page_exec) noexcept
+{
+  const auto guest_pfn = page_exec.pfn();
+
+  if (auto record = find(guest_pfn))
+  {
+    //
+    // The page is already hooked - just replace the "page_read".
+    // Note that the PTE might be currently mapped to the old page_read.
+    // The cached PTEs are always remapped - if the change can't be
+    // propagated into an attached view, the view is fixed up by the next
+    // EPT violation (see handle_ept_violation()).
+    //
+    record->page_read = page_read;
+
+    for (size_t i = 0; i < ept_count_; ++i)
+    {
+      ept_[i]->remap_4kb(record->pte[i], page_exec, page_exec,
+                         epte_t::access_type::execute);
+    }
+
+    return true;
+  }
+
+  if (count_ >= capacity_ / 4 * 3)
+  {
+    return false;
+  }
+
+  //
+  // Split the large page where the hooked page resides (if needed) and
+  // set the execute-only access on the hooked page in each EPT.
+  // map_4kb() is used to obtain the PTE pointer, which is cached in
+  // the record - the PT is pinned, so that EPT coalescing doesn't
+  // release it.  If the EPT table pool is exhausted, already hooked
+  // EPTs are restored and the hook isn't installed.
+  //
+  page_exec = page_exec & ept_pt_t::mask;
+
+  auto index = hash(guest_pfn);
+
+  while (record_[index].pte[0])
+  {
+    index = (index + 1) & (capacity_ - 1);
+  }
+
+  auto& record = record_[index];
+
+  record.guest_pfn = guest_pfn;
+  record.page_read = page_read;
+
+  for (size_t i = 0; i < ept_count_; ++i)
+  {
+    record.pte[i] = !ept_[i]->protect_range(page_exec, page_size, epte_t::access_type::execute)
+      ? ept_[i]->map_4kb(page_exec, page_exec, epte_t::access_type::execute)
+      : nullptr;
+
+    if (!record.pte[i])
+    {
+      ept_[i]->protect_range(page_exec, page_size, epte_t::access_type::read_write_execute);
+
+      while (i--)
+      {
+        ept_[i]->remap_4kb(record.pte[i], page_exec, page_exec,
+                           epte_t::access_type::read_write_execute);
+        ept_[i]->unpin(record.pte[i]);
+      }
+
+      record.pte[0] = nullptr;
+      return false;
+    }
+
+    ept_[i]->pin(record.pte[i]);
+  }
+
+  ++count_;
+
+  return true;
+}
+
+bool ept_hook_manager::remove_hook(pa_t page_exec) noexcept
+{
+  auto record = find(page_exec.pfn());
+
+  if (!record)
+  {
+    return false;
+  }
+
+  page_exec = page_exec & ept_pt_t::mask;
+
+  for (size_t i = 0; i < ept_count_; ++i)
+  {
+    ept_[i]->remap_4kb(record->pte[i], page_exec, page_exec,
+                       epte_t::access_type::read_write_execute);
+    ept_[i]->unpin(record->pte[i]);
+  }
+
+  erase(record);
+  return true;
+}
+
+void ept_hook_manager::invalidate() noexcept
+{
+  for (size_t i = 0; i < ept_count_; ++i)
+  {
+    ept_[i]->invalidate();
+  }
+}
+
+size_t ept_hook_manager::hash(uint64_t guest_pfn) const noexcept
+{
+  return static_cast<size_t>((guest_pfn * 0x9e3779b97f4a7c15ull) & (capacity_ - 1));
+}
+
+auto ept_hook_manager::find(uint64_t guest_pfn) noexcept -> record_t*
+{
+  if (!count_)
+  {
+    return nullptr;
+  }
+
+  for (auto index = hash(guest_pfn);
+       record_[index].pte[0];
+       index = (index + 1) & (capacity_ - 1))
+  {
+    if (record_[index].guest_pfn == guest_pfn)
+    {
+      return &record_[index];
+    }
+  }
+
+  return nullptr;
+}
+
+void ept_hook_manager::erase(record_t* record) noexcept
+{
+  //
+  // Backward-shift deletion - see ept_t::rmap_remove().
+  //
+  const auto mask = capacity_ - 1;
+  auto hole  = static_cast<size_t>(record - record_);
+  auto index = hole;
+
+  for (;;)
+  {
+    index = (index + 1) & mask;
+
+    if (!record_[index].pte[0])
+    {
+      break;
+    }
+
+    auto home = hash(record_[index].guest_pfn);
+
+    if (((index - home) & mask) >= ((index - hole) & mask))
+    {
+      record_[hole] = record_[index];
+      hole = index;
+    }
+  }
+
+  record_[hole].pte[0] = nullptr;
+  --count_;
+}
+
+}
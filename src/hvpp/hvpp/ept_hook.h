@@ -0,0 +1,98 @@
+#pragma once
+#include "ept.h"
+
+#include "lib/error.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+//
+// Registry of "hidden" EPT hooks of the EPTs of single VCPU.
+//
+// Each hook is keyed by the guest PFN of the hooked page ("page_exec").
+// The page is mapped as execute-only in every EPT of the registry.
+// When the guest reads from or writes to it, the EPT violation handler
+// maps the page to "page_read" with read-write access.  When the guest
+// executes it again, the page is mapped back to "page_exec" with
+// execute-only access.  Only the EPT which caused the EPT violation is
+// flipped - the other EPTs are flipped when the guest touches the page
+// through them.  Per-process views (see ept_t::is_view()) are flipped
+// through their base EPT.
+//
+// Records are stored in open addressing hash table (linear probing)
+// and each of them caches pointers to the PTEs of the hooked page (one
+// per EPT), so that the EPT violation is handled without any EPT walk.
+//
+// Because the EPTs belong to one VCPU, the registry is accessed only
+// by that VCPU (in VMX-root mode) and no locking is needed.  Note that
+// install() and remove() invalidate EPT mappings, bulk variants
+// invalidate them just once.
+//
+class ept_hook_manager
+{
+  public:
+    struct hook_t
+    {
+      pa_t page_read;
+      pa_t page_exec;
+    };
+
+    static constexpr size_t max_ept_count = 4;
+
+    auto initialize(ept_t* const* ept_list, size_t ept_count, size_t capacity) noexcept -> error_code_t;
+    void destroy() noexcept;
+
+    bool   install(pa_t page_read, pa_t page_exec) noexcept;
+    bool   remove(pa_t page_exec) noexcept;
+
+    size_t install(const hook_t* hooks, size_t count) noexcept;
+    size_t remove_all() noexcept;
+
+    size_t count() const noexcept { return count_; }
+
+    //
+    // Returns false if guest_pa doesn't belong to any hooked page or if
+    // the EPT which caused the violation isn't managed by this registry.
+    //
+    bool   handle_ept_violation(ept_t& ept, pa_t guest_pa, bool execute) noexcept;
+
+    //
+    // Statistics of handle_ept_violation() (only hooked pages are
+    // accounted) - number of handled violations and TSC cycles spent
+    // in total and in the slowest one.
+    //
+    uint64_t violation_count()      const noexcept { return violation_count_; }
+    uint64_t violation_cycles()     const noexcept { return violation_cycles_; }
+    uint64_t violation_cycles_max() const noexcept { return violation_cycles_max_; }
+
+  private:
+    struct record_t
+    {
+      uint64_t guest_pfn;
+      pa_t     page_read;
+      epte_t*  pte[max_ept_count];  // pte[0] == nullptr == empty slot
+    };
+
+    bool      install_hook(pa_t page_read, pa_t page_exec) noexcept;
+    bool      remove_hook(pa_t page_exec) noexcept;
+    void      invalidate() noexcept;
+
+    size_t    hash(uint64_t guest_pfn) const noexcept;
+    record_t* find(uint64_t guest_pfn) noexcept;
+    void      erase(record_t* record) noexcept;
+
+    ept_t*    ept_[max_ept_count] = {};
+    size_t    ept_count_ = 0;
+    record_t* record_   = nullptr;
+    size_t    capacity_ = 0;
+    size_t    count_    = 0;
+
+    uint64_t  violation_count_;
+    uint64_t  violation_cycles_;
+    uint64_t  violation_cycles_max_;
+};
+
+}
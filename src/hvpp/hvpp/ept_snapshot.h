@@ -0,0 +1,167 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+//
+// EPT snapshot format.
+//
+// This header doesn't depend on any other hvpp header, so that it can be
+// included by user-mode tools (e.g. hvppctrl) which parse snapshots.
+//
+// Snapshot consists of a header followed by records.  Each record
+// describes run of leaf EPT entries (PTEs, large PDEs or large PDPTEs)
+// which have the same page size, access, memory type and flags and
+// which map contiguous guest physical range to contiguous host physical
+// range.  Records are sorted by guest physical address and they don't
+// overlap.  Guest physical ranges without leaf entries are not
+// described.
+//
+// See ept_t::snapshot() and ept_t::restore().
+//
+
+namespace hvpp {
+
+struct ept_snapshot_header_t
+{
+  static constexpr uint32_t magic_value   = 0x53505445; // 'ETPS'
+  static constexpr uint16_t version_value = 1;
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+  uint64_t record_count;
+  uint64_t ept_pointer;
+};
+
+struct ept_snapshot_record_t
+{
+  enum : uint8_t
+  {
+    flag_suppress_ve = 0x01,
+    flag_accessed    = 0x02,
+    flag_dirty       = 0x04,
+  };
+
+  uint64_t guest_pa;
+  uint64_t host_pa;
+  uint32_t page_count;
+  uint8_t  level;       // 0 = 4kb, 1 = 2MB, 2 = 1GB (see ia32::pml)
+  uint8_t  access;      // see epte_t::access_type
+  uint8_t  memory_type;
+  uint8_t  flags;
+
+  uint64_t page_size() const noexcept
+  { return 4096ull << (9 * level); }
+
+  uint64_t size() const noexcept
+  { return page_size() * page_count; }
+
+  uint64_t guest_pa_end() const noexcept
+  { return guest_pa + size(); }
+
+  //
+  // Returns true if both records describe the same translation
+  // (ignoring accessed/dirty flags) at provided guest physical address.
+  //
+  bool same_translation(const ept_snapshot_record_t& other, uint64_t at) const noexcept
+  {
+    return level       == other.level       &&
+           access      == other.access      &&
+           memory_type == other.memory_type &&
+           (flags & flag_suppress_ve) == (other.flags & flag_suppress_ve) &&
+           host_pa + (at - guest_pa) == other.host_pa + (at - other.guest_pa);
+  }
+};
+
+static_assert(sizeof(ept_snapshot_record_t) == 24);
+
+//
+// Returns pointer to the first record of the snapshot, or nullptr if the
+// snapshot isn't valid (or if it's truncated).
+//
+inline const ept_snapshot_record_t* ept_snapshot_records(const void* buffer, size_t size) noexcept
+{
+  auto header = reinterpret_cast<const ept_snapshot_header_t*>(buffer);
+
+  if (size < sizeof(*header)                                          ||
+      header->magic       != ept_snapshot_header_t::magic_value       ||
+      header->version     != ept_snapshot_header_t::version_value     ||
+      header->record_size != sizeof(ept_snapshot_record_t)            ||
+      header->record_count > (size - sizeof(*header)) / sizeof(ept_snapshot_record_t))
+  {
+    return nullptr;
+  }
+
+  return reinterpret_cast<const ept_snapshot_record_t*>(header + 1);
+}
+
+//
+// Compare two snapshots.  For each guest physical range which is
+// translated differently, callback(guest_pa, size, record1, record2) is
+// called - record1/record2 is the record of the first/second snapshot
+// which covers the range (or nullptr if the range isn't mapped in that
+// snapshot).  Adjacent differing ranges covered by the same pair of
+// records are reported once.  Returns number of reported ranges, or -1
+// if any of the snapshots isn't valid.
+//
+template <typename TCallback>
+inline int64_t ept_snapshot_diff(const void* buffer1, size_t size1,
+                                 const void* buffer2, size_t size2,
+                                 TCallback callback) noexcept
+{
+  auto it1 = ept_snapshot_records(buffer1, size1);
+  auto it2 = ept_snapshot_records(buffer2, size2);
+
+  if (!it1 || !it2)
+  {
+    return -1;
+  }
+
+  const auto end1 = it1 + reinterpret_cast<const ept_snapshot_header_t*>(buffer1)->record_count;
+  const auto end2 = it2 + reinterpret_cast<const ept_snapshot_header_t*>(buffer2)->record_count;
+
+  int64_t diff_count = 0;
+  uint64_t at = 0;
+
+  while (it1 != end1 || it2 != end2)
+  {
+    //
+    // Skip records which end before the current position.
+    //
+    if (it1 != end1 && it1->guest_pa_end() <= at) { ++it1; continue; }
+    if (it2 != end2 && it2->guest_pa_end() <= at) { ++it2; continue; }
+
+    //
+    // Find the next boundary - start or end of the current records.
+    //
+    const auto start1 = it1 != end1 ? it1->guest_pa : ~0ull;
+    const auto start2 = it2 != end2 ? it2->guest_pa : ~0ull;
+
+    if (at < start1 && at < start2)
+    {
+      at = start1 < start2 ? start1 : start2;
+      continue;
+    }
+
+    const auto r1 = at >= start1 ? it1 : nullptr;
+    const auto r2 = at >= start2 ? it2 : nullptr;
+
+    auto next = ~0ull;
+    if (r1)        { next = next < r1->guest_pa_end() ? next : r1->guest_pa_end(); }
+    else if (it1 != end1) { next = next < start1 ? next : start1; }
+    if (r2)        { next = next < r2->guest_pa_end() ? next : r2->guest_pa_end(); }
+    else if (it2 != end2) { next = next < start2 ? next : start2; }
+
+    if (!r1 || !r2 || !r1->same_translation(*r2, at))
+    {
+      callback(at, next - at, r1, r2);
+      ++diff_count;
+    }
+
+    at = next;
+  }
+
+  return diff_count;
+}
+
+}
@@ -0,0 +1,234 @@
+#include "ept_view_cache.h"
+
+#include "lib/assert.h"
+
+#include <cstring> // memset
+
+namespace hvpp {
+
+auto ept_view_cache::initialize(size_t capacity) noexcept -> error_code_t
+{
+  //
+  // Round the capacity of the hash table up to the power of 2 and keep
+  // the load factor below 3/4.
+  //
+  size_t rounded_capacity = 4;
+
+  while (rounded_capacity / 4 * 3 < capacity)
+  {
+    rounded_capacity <<= 1;
+  }
+
+  record_ = new record_t[rounded_capacity];
+  free_ = new ept_t*[capacity];
+
+  if (!record_ || !free_)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  memset(record_, 0, sizeof(record_t) * rounded_capacity);
+
+  capacity_ = rounded_capacity;
+  count_ = 0;
+
+  switch_count_ = 0;
+  switch_hits_ = 0;
+  switch_cycles_ = 0;
+
+  //
+  // Allocate all views.
+  //
+  for (size_t i = 0; i < capacity; ++i)
+  {
+    auto ept = new ept_t;
+
+    if (!ept)
+    {
+      return make_error_code_t(std::errc::not_enough_memory);
+    }
+
+    if (auto err = ept->initialize_view())
+    {
+      delete ept;
+      return err;
+    }
+
+    free_[free_count_++] = ept;
+  }
+
+  return error_code_t{};
+}
+
+void ept_view_cache::destroy() noexcept
+{
+  release_all();
+
+  if (free_)
+  {
+    while (free_count_)
+    {
+      auto ept = free_[--free_count_];
+
+      ept->destroy();
+      delete ept;
+    }
+
+    delete[] free_;
+    free_ = nullptr;
+  }
+
+  if (record_)
+  {
+    delete[] record_;
+    record_ = nullptr;
+  }
+
+  base_ = nullptr;
+  capacity_ = 0;
+  count_ = 0;
+}
+
+ept_t* ept_view_cache::acquire(cr3_t cr3) noexcept
+{
+  const auto cr3_pfn = static_cast<uint64_t>(cr3.page_frame_number);
+
+  if (auto record = lookup(cr3_pfn))
+  {
+    record->ref_count += 1;
+    return record->ept;
+  }
+
+  if (!base_ || !free_count_)
+  {
+    return nullptr;
+  }
+
+  auto ept = free_[--free_count_];
+  ept->attach(*base_);
+
+  auto index = hash(cr3_pfn);
+
+  while (record_[index].ept)
+  {
+    index = (index + 1) & (capacity_ - 1);
+  }
+
+  record_[index] = { cr3_pfn, ept, 1 };
+  ++count_;
+
+  return ept;
+}
+
+bool ept_view_cache::release(cr3_t cr3) noexcept
+{
+  auto record = lookup(static_cast<uint64_t>(cr3.page_frame_number));
+
+  if (!record)
+  {
+    return false;
+  }
+
+  if (--record->ref_count == 0)
+  {
+    auto ept = record->ept;
+    erase(record);
+
+    ept->detach();
+    free_[free_count_++] = ept;
+  }
+
+  return true;
+}
+
+void ept_view_cache::release_all() noexcept
+{
+  if (!record_)
+  {
+    return;
+  }
+
+  for (size_t i = 0; i < capacity_; ++i)
+  {
+    if (auto ept = record_[i].ept)
+    {
+      ept->detach();
+      free_[free_count_++] = ept;
+
+      record_[i].ept = nullptr;
+    }
+  }
+
+  count_ = 0;
+}
+
+ept_t* ept_view_cache::find(cr3_t cr3) noexcept
+{
+  auto record = lookup(static_cast<uint64_t>(cr3.page_frame_number));
+
+  return record
+    ? record->ept
+    : nullptr;
+}
+
+//
+// Private
+//
+
+size_t ept_view_cache::hash(uint64_t cr3_pfn) const noexcept
+{
+  return static_cast<size_t>((cr3_pfn * 0x9e3779b97f4a7c15ull) & (capacity_ - 1));
+}
+
+auto ept_view_cache::lookup(uint64_t cr3_pfn) noexcept -> record_t*
+{
+  if (!count_)
+  {
+    return nullptr;
+  }
+
+  for (auto index = hash(cr3_pfn);
+       record_[index].ept;
+       index = (index + 1) & (capacity_ - 1))
+  {
+    if (record_[index].cr3_pfn == cr3_pfn)
+    {
+      return &record_[index];
+    }
+  }
+
+  return nullptr;
+}
+
+void ept_view_cache::erase(record_t* record) noexcept
+{
+  //
+  // Backward-shift deletion - see ept_t::rmap_remove().
+  //
+  const auto mask = capacity_ - 1;
+  auto hole  = static_cast<size_t>(record - record_);
+  auto index = hole;
+
+  for (;;)
+  {
+    index = (index + 1) & mask;
+
+    if (!record_[index].ept)
+    {
+      break;
+    }
+
+    auto home = hash(record_[index].cr3_pfn);
+
+    if (((index - home) & mask) >= ((index - hole) & mask))
+    {
+      record_[hole] = record_[index];
+      hole = index;
+    }
+  }
+
+  record_[hole].ept = nullptr;
+  --count_;
+}
+
+}
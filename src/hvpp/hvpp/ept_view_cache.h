@@ -0,0 +1,95 @@
+#pragma once
+#include "ept.h"
+
+#include "ia32/arch.h"
+
+#include "lib/error.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+//
+// Cache of per-address-space EPT views of single EPT.
+//
+// Each view is copy-on-write view of the base EPT (see ept_t::attach()) keyed
+// by the PFN of the guest CR3 (PCID bits are ignored), so that different guest
+// processes can see different EPT permissions.  Views are stored in open
+// addressing hash table (linear probing) and they are reference-counted - view
+// is attached by the first acquire() and detached by the last release().
+//
+// All views are allocated by initialize() (outside of VMX-root mode) and kept
+// in the free-list, so that acquire() and release() never allocate memory.
+// bind() sets the base EPT - it must be called before the first acquire().
+// release_all() detaches all views - it must be called before the base EPT is
+// destroyed.
+//
+// find() doesn't change the reference count - it is meant to be called on each
+// CR3 load.  The time spent by find() and by loading of the EPT pointer is
+// accounted by the caller via account_switch().
+//
+// Because each EPT belongs to one VCPU, the cache is accessed only by the VCPU
+// which owns the base EPT and no locking is needed.
+//
+class ept_view_cache
+{
+  public:
+    auto initialize(size_t capacity) noexcept -> error_code_t;
+    void destroy() noexcept;
+
+    void bind(ept_t& base) noexcept { base_ = &base; }
+
+    ept_t* acquire(cr3_t cr3) noexcept;
+    bool   release(cr3_t cr3) noexcept;
+    void   release_all() noexcept;
+    ept_t* find(cr3_t cr3) noexcept;
+
+    ept_t& base() noexcept { return *base_; }
+    size_t count() const noexcept { return count_; }
+
+    //
+    // Statistics of CR3 loads - number of loads, number of loads which
+    // switched to a view and TSC cycles added to the CR3-load handling.
+    //
+    void account_switch(bool hit, uint64_t cycles) noexcept
+    {
+      switch_count_  += 1;
+      switch_hits_   += hit;
+      switch_cycles_ += cycles;
+    }
+
+    uint64_t switch_count()  const noexcept { return switch_count_; }
+    uint64_t switch_hits()   const noexcept { return switch_hits_; }
+    uint64_t switch_cycles() const noexcept { return switch_cycles_; }
+
+  private:
+    struct record_t
+    {
+      uint64_t cr3_pfn;
+      ept_t*   ept;         // nullptr == empty slot
+      uint32_t ref_count;
+    };
+
+    size_t    hash(uint64_t cr3_pfn) const noexcept;
+    record_t* lookup(uint64_t cr3_pfn) noexcept;
+    void      erase(record_t* record) noexcept;
+
+    ept_t*    base_     = nullptr;
+    record_t* record_   = nullptr;
+    size_t    capacity_ = 0;
+    size_t    count_    = 0;
+
+    //
+    // Views which aren't attached.
+    //
+    ept_t**   free_       = nullptr;
+    size_t    free_count_ = 0;
+
+    uint64_t  switch_count_;
+    uint64_t  switch_hits_;
+    uint64_t  switch_cycles_;
+};
+
+}
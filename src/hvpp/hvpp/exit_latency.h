@@ -0,0 +1,341 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+//
+// VM-exit latency histograms.
+//
+// This header doesn't depend on any other hvpp header, so that it can be
+// included by user-mode tools (e.g. hvppctrl) which read the histograms.
+//
+// Latency of a VM-exit is the number of TSC cycles from the beginning
+// of vcpu_t::entry_host_() to the end of vcpu_t::entry_host() (i.e. just
+// before the guest registers are restored and VMRESUME is executed).
+//
+// See vcpu_t::exit_latency().
+//
+
+namespace hvpp {
+
+//
+// Log-linear histogram.
+//
+// Values are grouped by their highest set bit and each such group is
+// split into sub_bucket_count linear buckets.  Values lower than
+// sub_bucket_count have their own bucket.  Therefore the relative error
+// of a value read from the histogram is at most 1 / sub_bucket_count.
+// Values greater than 2^max_value_bits fall into the last bucket (the
+// exact maximum is kept separately).
+//
+// The histogram is plain data - it can be copied as is and histograms
+// of multiple CPUs can be combined by merge().  Buckets are 64-bit, so
+// that neither a busy exit reason nor merged histograms of many CPUs
+// can wrap them around (e.g. CPUID or EPT violations of a single CPU
+// easily exceed 2^32 exits in a long run).
+//
+struct latency_histogram_t
+{
+  static constexpr uint32_t sub_bucket_bits  = 4;
+  static constexpr uint32_t sub_bucket_count = 1 << sub_bucket_bits;
+  static constexpr uint32_t max_value_bits   = 36;
+  static constexpr uint32_t bucket_count     = (max_value_bits - sub_bucket_bits + 1) * sub_bucket_count;
+
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[bucket_count];
+
+  static uint32_t bucket_index(uint64_t value) noexcept
+  {
+    if (value < sub_bucket_count)
+    {
+      return static_cast<uint32_t>(value);
+    }
+
+    //
+    // Index of the highest set bit.
+    //
+    uint32_t msb = 0;
+    uint64_t v = value;
+    if (v >> 32) { v >>= 32; msb += 32; }
+    if (v >> 16) { v >>= 16; msb += 16; }
+    if (v >>  8) { v >>=  8; msb +=  8; }
+    if (v >>  4) { v >>=  4; msb +=  4; }
+    if (v >>  2) { v >>=  2; msb +=  2; }
+    if (v >>  1) {           msb +=  1; }
+
+    auto shift = msb - sub_bucket_bits;
+    auto index = (shift + 1) * sub_bucket_count +
+                 static_cast<uint32_t>((value >> shift) & (sub_bucket_count - 1));
+
+    return index < bucket_count ? index : bucket_count - 1;
+  }
+
+  //
+  // Highest value which falls into the bucket.
+  //
+  static uint64_t bucket_value(uint32_t index) noexcept
+  {
+    if (index < sub_bucket_count)
+    {
+      return index;
+    }
+
+    auto shift = index / sub_bucket_count - 1;
+    return (static_cast<uint64_t>(sub_bucket_count + index % sub_bucket_count + 1) << shift) - 1;
+  }
+
+  void record(uint64_t value) noexcept
+  {
+    buckets[bucket_index(value)] += 1;
+    count += 1;
+
+    if (value > max)
+    {
+      max = value;
+    }
+  }
+
+  void merge(const latency_histogram_t& other) noexcept
+  {
+    for (uint32_t i = 0; i < bucket_count; ++i)
+    {
+      buckets[i] += other.buckets[i];
+    }
+
+    count += other.count;
+
+    if (other.max > max)
+    {
+      max = other.max;
+    }
+  }
+
+  //
+  // Returns (upper bound of) the value below which falls
+  // numerator/denominator of recorded values - e.g. value_at(999, 1000)
+  // is the 99.9th percentile.
+  //
+  uint64_t value_at(uint64_t numerator, uint64_t denominator) const noexcept
+  {
+    if (!count)
+    {
+      return 0;
+    }
+
+    auto threshold = (count * numerator + denominator - 1) / denominator;
+    uint64_t accumulated = 0;
+
+    for (uint32_t i = 0; i < bucket_count; ++i)
+    {
+      accumulated += buckets[i];
+
+      if (accumulated >= threshold)
+      {
+        auto value = bucket_value(i);
+        return value < max ? value : max;
+      }
+    }
+
+    return max;
+  }
+};
+
+//
+// Latency histograms of single CPU.
+//
+// by_exit_reason contains histogram for each exit reason.
+//
+// by_sub_reason contains histograms for CPUID leaves (eax), MSRs (ecx)
+// and I/O ports.  It is an open-addressing hash table - slots are
+// assigned in order in which the sub-reasons occur.  If the table is
+// full, latencies of new sub-reasons are recorded only in by_exit_reason
+// and sub_reason_overflow_count is incremented.
+//
+// The histograms are protected by seqlock (see vmexit_stats_storage_t),
+// so that they can be copied consistently while the owning VCPU keeps
+// updating them.
+//
+struct exit_latency_t
+{
+  static constexpr uint32_t exit_reason_count   = 65;
+  static constexpr uint32_t sub_reason_capacity = 128;
+
+  //
+  // Sequence counter (seqlock) - odd while the update is in progress.
+  //
+  uint64_t            sequence;
+
+  //
+  // Key of the sub-reason: exit_reason + 1 in the upper 32 bits (so that
+  // 0 marks free slot), CPUID leaf / MSR number / I/O port in the lower
+  // 32 bits.  Port of the IN instruction has additionally set bit 16.
+  //
+  struct sub_reason_t
+  {
+    uint64_t            key;
+    latency_histogram_t histogram;
+
+    uint32_t exit_reason() const noexcept
+    { return static_cast<uint32_t>(key >> 32) - 1; }
+
+    uint32_t value() const noexcept
+    { return static_cast<uint32_t>(key); }
+  };
+
+  static uint64_t sub_reason_key(uint32_t exit_reason, uint32_t value) noexcept
+  { return (static_cast<uint64_t>(exit_reason) + 1) << 32 | value; }
+
+  latency_histogram_t by_exit_reason[exit_reason_count];
+  sub_reason_t        by_sub_reason[sub_reason_capacity];
+  uint64_t            sub_reason_overflow_count;
+
+  //
+  // Writer side of the seqlock - must be called by the owning VCPU
+  // around each update.  x86 doesn't reorder stores with other stores,
+  // therefore only the compiler has to be prevented from reordering.
+  //
+  void write_begin() noexcept
+  {
+    *static_cast<volatile uint64_t*>(&sequence) = sequence + 1;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  }
+
+  void write_end() noexcept
+  {
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    *static_cast<volatile uint64_t*>(&sequence) = sequence + 1;
+  }
+
+  //
+  // Reader side of the seqlock - read_begin() waits until no update is
+  // in progress and returns the sequence counter, read_retry() returns
+  // true if the histograms have been updated since read_begin() (and
+  // the copy has to be taken again).  x86 doesn't reorder loads with
+  // other loads, therefore only the compiler has to be prevented from
+  // reordering.
+  //
+  uint64_t read_begin() const noexcept
+  {
+    for (;;)
+    {
+      auto sequence_begin = *static_cast<const volatile uint64_t*>(&sequence);
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+
+      if (!(sequence_begin & 1))
+      {
+        return sequence_begin;
+      }
+    }
+  }
+
+  bool read_retry(uint64_t sequence_begin) const noexcept
+  {
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    return *static_cast<const volatile uint64_t*>(&sequence) != sequence_begin;
+  }
+
+  //
+  // Clear the histograms.  The sequence counter isn't touched.
+  //
+  void reset() noexcept
+  {
+    write_begin();
+    memset(by_exit_reason, 0, sizeof(*this) - offsetof(exit_latency_t, by_exit_reason));
+    write_end();
+  }
+
+  void record(uint32_t exit_reason, uint64_t key, uint64_t value) noexcept
+  {
+    if (exit_reason >= exit_reason_count)
+    {
+      return;
+    }
+
+    write_begin();
+
+    by_exit_reason[exit_reason].record(value);
+
+    if (key)
+    {
+      if (auto sub_reason = sub_reason_find(key, true))
+      {
+        sub_reason->histogram.record(value);
+      }
+      else
+      {
+        sub_reason_overflow_count += 1;
+      }
+    }
+
+    write_end();
+  }
+
+  void merge(const exit_latency_t& other) noexcept
+  {
+    for (uint32_t i = 0; i < exit_reason_count; ++i)
+    {
+      by_exit_reason[i].merge(other.by_exit_reason[i]);
+    }
+
+    for (auto& other_sub_reason : other.by_sub_reason)
+    {
+      if (!other_sub_reason.key)
+      {
+        continue;
+      }
+
+      if (auto sub_reason = sub_reason_find(other_sub_reason.key, true))
+      {
+        sub_reason->histogram.merge(other_sub_reason.histogram);
+      }
+      else
+      {
+        sub_reason_overflow_count += other_sub_reason.histogram.count;
+      }
+    }
+
+    sub_reason_overflow_count += other.sub_reason_overflow_count;
+  }
+
+  //
+  // Finds slot of the sub-reason.  If the sub-reason isn't in the table
+  // and insert is true, free slot is assigned to it.  Returns nullptr
+  // if the sub-reason hasn't been found and it couldn't be inserted.
+  //
+  sub_reason_t* sub_reason_find(uint64_t key, bool insert) noexcept
+  {
+    static_assert((sub_reason_capacity & (sub_reason_capacity - 1)) == 0,
+                  "sub_reason_capacity must be power of 2");
+
+    constexpr auto mask = sub_reason_capacity - 1;
+
+    auto index = static_cast<uint32_t>((key * 0x9e3779b97f4a7c15) >> 32) & mask;
+
+    for (uint32_t i = 0; i < sub_reason_capacity; ++i, index = (index + 1) & mask)
+    {
+      auto& sub_reason = by_sub_reason[index];
+
+      if (sub_reason.key == key)
+      {
+        return &sub_reason;
+      }
+
+      if (!sub_reason.key)
+      {
+        if (!insert)
+        {
+          return nullptr;
+        }
+
+        sub_reason.key = key;
+        return &sub_reason;
+      }
+    }
+
+    return nullptr;
+  }
+};
+
+}
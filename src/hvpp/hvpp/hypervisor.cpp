@@ -27,6 +27,10 @@ auto hypervisor::initialize() noexcept -> error_code_t
   handler_ = nullptr;
   check_passed_ = false;
 
+#ifdef HVPP_EPT_COALESCE_INTERVAL
+  coalesce_tick_ = 0;
+#endif
+
   if (!vcpu_list_)
   {
     return make_error_code_t(std::errc::not_enough_memory);
@@ -44,6 +48,21 @@ void hypervisor::destroy() noexcept
 {
   if (vcpu_list_)
   {
+    //
+    // Print statistics collected by the VCPUs.
+    //
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      hvpp_info("cpu %u:", i);
+      vcpu_list_[i].dump();
+    }
+
+    vcpu_t::xstate_dump(vcpu_list_, mp::cpu_count());
+
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+    vcpu_t::exit_latency_dump(vcpu_list_, mp::cpu_count());
+#endif
+
     delete[] vcpu_list_;
     vcpu_list_ = nullptr;
     check_passed_ = false;
@@ -61,10 +80,26 @@ void hypervisor::start(vmexit_handler* handler) noexcept
 #else
   mp::ipi_call(this, &hypervisor::start_ipi_callback);
 #endif
+
+  //
+  // EPT table pools are consumed by VM-exit handlers, but they can be
+  // refilled only outside of VMX-root mode.  Failure isn't fatal - EPT
+  // operations just fail once the pools are exhausted.
+  //
+  auto err = refill_worker_.start([](void* context) noexcept {
+    reinterpret_cast<hypervisor*>(context)->refill_callback();
+  }, this, HVPP_EPT_POOL_REFILL_PERIOD);
+
+  if (err)
+  {
+    hvpp_warn("EPT table pools won't be refilled");
+  }
 }
 
 void hypervisor::stop() noexcept
 {
+  refill_worker_.stop();
+
 #ifdef HVPP_SINGLE_VCPU
   single_cpu_call(stop_ipi_callback);
 #else
@@ -148,4 +183,45 @@ void hypervisor::stop_ipi_callback() noexcept
   vcpu_list_[idx].destroy();
 }
 
+void hypervisor::refill_callback() noexcept
+{
+#ifdef HVPP_SINGLE_VCPU
+  const uint32_t vcpu_count = 1;
+#else
+  const uint32_t vcpu_count = mp::cpu_count();
+#endif
+
+  for (uint32_t idx = 0; idx < vcpu_count; ++idx)
+  {
+    for (uint16_t view = 0; view < vcpu_t::ept_view_count; ++view)
+    {
+      auto& ept = vcpu_list_[idx].ept(view);
+
+      //
+      // Attached views take tables from the pool of their base EPT.
+      //
+      if (!ept.is_view() && ept.pool_low())
+      {
+        ept.pool_refill();
+      }
+    }
+  }
+
+#ifdef HVPP_EPT_COALESCE_INTERVAL
+  //
+  // Split 2MB regions can be joined only by the owning VCPU (in VMX-root
+  // mode) - just request it, each VCPU joins them on its next VM-exit.
+  //
+  if (++coalesce_tick_ * HVPP_EPT_POOL_REFILL_PERIOD >= HVPP_EPT_COALESCE_INTERVAL)
+  {
+    coalesce_tick_ = 0;
+
+    for (uint32_t idx = 0; idx < vcpu_count; ++idx)
+    {
+      vcpu_list_[idx].ept_coalesce_request();
+    }
+  }
+#endif
+}
+
 }
@@ -3,6 +3,7 @@
 #include "vmexit.h"
 
 #include "lib/error.h"
+#include "lib/worker.h"
 
 namespace hvpp {
 
@@ -24,9 +25,16 @@ class hypervisor
     void stop_ipi_callback() noexcept;
     void check_ipi_callback() noexcept;
 
+    void refill_callback() noexcept;
+
     vcpu_t* vcpu_list_;
     vmexit_handler* handler_;
+    worker refill_worker_;
     bool check_passed_;
+
+#ifdef HVPP_EPT_COALESCE_INTERVAL
+    uint32_t coalesce_tick_;
+#endif
 };
 
 }
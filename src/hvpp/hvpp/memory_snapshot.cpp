@@ -0,0 +1,419 @@
+#include "memory_snapshot.h"
+
+#include "ia32/asm.h"
+
+#include "lib/assert.h"
+
+#include <cstring> // memcpy
+
+namespace hvpp {
+
+auto memory_snapshot::initialize(ept_t* const* ept_list, size_t ept_count, size_t capacity) noexcept -> error_code_t
+{
+  hvpp_assert(ept_count > 0 && ept_count <= max_ept_count);
+
+  pool_   = new uint8_t[capacity * page_size];
+  dirty_  = new dirty_t[capacity];
+  access_ = new uint8_t[max_page_count * max_ept_count];
+
+  if (!pool_ || !dirty_ || !access_)
+  {
+    destroy();
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  for (size_t i = 0; i < ept_count; ++i)
+  {
+    ept_[i] = ept_list[i];
+  }
+
+  ept_count_ = ept_count;
+  capacity_ = capacity;
+  range_count_ = 0;
+  page_count_ = 0;
+  dirty_count_ = 0;
+  lost_count_ = 0;
+
+  dirtied_count_ = 0;
+  overflow_count_ = 0;
+  reset_count_ = 0;
+  reset_cycles_ = 0;
+
+  return error_code_t{};
+}
+
+void memory_snapshot::destroy() noexcept
+{
+  if (pool_)
+  {
+    delete[] pool_;
+    pool_ = nullptr;
+  }
+
+  if (dirty_)
+  {
+    delete[] dirty_;
+    dirty_ = nullptr;
+  }
+
+  if (access_)
+  {
+    delete[] access_;
+    access_ = nullptr;
+  }
+
+  capacity_ = 0;
+  range_count_ = 0;
+  page_count_ = 0;
+  dirty_count_ = 0;
+  lost_count_ = 0;
+}
+
+size_t memory_snapshot::protect(const range_t* ranges, size_t count) noexcept
+{
+  const auto first_new_page = page_count_;
+
+  size_t protected_count = 0;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    const auto guest_pa   = ranges[i].guest_pa & ept_pt_t::mask;
+    const auto size       = ranges[i].size;
+    const auto page_count = size / page_size;
+
+    hvpp_assert(byte_offset(size) == 0);
+
+    if (page_count_ + page_count > max_page_count)
+    {
+      continue;
+    }
+
+    if (range_count_ &&
+        range_[range_count_ - 1].guest_pa + range_[range_count_ - 1].size == guest_pa)
+    {
+      range_[range_count_ - 1].size += size;
+    }
+    else if (range_count_ < max_range_count)
+    {
+      range_[range_count_++] = { guest_pa, size, page_count_ };
+    }
+    else
+    {
+      continue;
+    }
+
+    //
+    // Save the original access.  Pages which aren't writable aren't
+    // protected - writes to them aren't ours to handle.
+    //
+    for (size_t page = 0; page < page_count; ++page)
+    {
+      for (size_t j = 0; j < ept_count_; ++j)
+      {
+        auto pte = ept_[j]->walk(guest_pa + page * page_size);
+
+        access(page_count_ + page, j) = pte && pte->write_access
+          ? static_cast<uint8_t>(pte->access)
+          : unprotected;
+      }
+    }
+
+    page_count_ += page_count;
+    ++protected_count;
+  }
+
+  for (size_t j = 0; j < ept_count_; ++j)
+  {
+    //
+    // The transaction merges write-protection of adjacent pages with
+    // the same access and invalidates EPT mappings once, when it goes
+    // out of scope.
+    //
+    // If the EPT table pool is exhausted, some pages stay writable and
+    // their writes aren't tracked - they are accounted as lost, so that
+    // reset() fails until the snapshot is released.
+    //
+    ept_transaction_t transaction(*ept_[j]);
+
+    for (size_t i = 0; i < range_count_; ++i)
+    {
+      for (size_t offset = 0; offset < range_[i].size; offset += page_size)
+      {
+        const auto page = range_[i].first_page + offset / page_size;
+
+        if (page >= first_new_page && access(page, j) != unprotected)
+        {
+          transaction.protect_range(range_[i].guest_pa + offset, page_size,
+                                    write_protected(access(page, j)));
+        }
+      }
+    }
+
+    transaction.commit();
+
+    if (transaction.failed())
+    {
+      ++lost_count_;
+    }
+  }
+
+  return protected_count;
+}
+
+auto memory_snapshot::reset(size_t& reset_count) noexcept -> error_code_t
+{
+  auto tsc_start = ia32_asm_read_tsc();
+
+  reset_count = dirty_count_;
+
+  for (size_t i = 0; i < dirty_count_; ++i)
+  {
+    memcpy(pa_t::from_pfn(dirty_[i].host_pfn).va(),
+           pool_ + i * page_size,
+           page_size);
+  }
+
+  for (size_t j = 0; j < ept_count_; ++j)
+  {
+    //
+    // The transaction merges write-protection of adjacent pages and
+    // invalidates EPT mappings once, when it goes out of scope.
+    //
+    ept_transaction_t transaction(*ept_[j]);
+
+    for (size_t i = 0; i < dirty_count_; ++i)
+    {
+      if (auto pte = dirty_[i].pte[j])
+      {
+        transaction.protect_range(pa_t::from_pfn(dirty_[i].guest_pfn), page_size,
+                                  write_protected(access(dirty_[i].page, j)));
+
+        ept_[j]->unpin(pte);
+      }
+    }
+
+    transaction.commit();
+
+    if (transaction.failed())
+    {
+      ++lost_count_;
+    }
+  }
+
+  dirty_count_ = 0;
+
+  reset_count_ += 1;
+  reset_cycles_ += ia32_asm_read_tsc() - tsc_start;
+
+  //
+  // Pages which haven't fit into the shadow pool keep their write
+  // access and their content can't be rolled back.
+  //
+  return lost_count_
+    ? make_error_code_t(std::errc::no_buffer_space)
+    : error_code_t{};
+}
+
+auto memory_snapshot::release() noexcept -> error_code_t
+{
+  bool failed = false;
+
+  for (size_t j = 0; j < ept_count_; ++j)
+  {
+    ept_transaction_t transaction(*ept_[j]);
+
+    for (size_t i = 0; i < dirty_count_; ++i)
+    {
+      if (auto pte = dirty_[i].pte[j])
+      {
+        ept_[j]->unpin(pte);
+      }
+    }
+
+    for (size_t i = 0; i < range_count_; ++i)
+    {
+      for (size_t offset = 0; offset < range_[i].size; offset += page_size)
+      {
+        const auto page = range_[i].first_page + offset / page_size;
+
+        if (access(page, j) != unprotected)
+        {
+          transaction.protect_range(range_[i].guest_pa + offset, page_size,
+                                    static_cast<epte_t::access_type>(access(page, j)));
+        }
+      }
+    }
+
+    transaction.commit();
+    failed = failed || transaction.failed();
+  }
+
+  dirty_count_ = 0;
+
+  //
+  // If the original access couldn't be restored everywhere, the ranges
+  // are kept - remaining write-protected pages get their access back
+  // on the first write (see handle_ept_violation()) or by another
+  // release().
+  //
+  if (failed)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  range_count_ = 0;
+  page_count_ = 0;
+  lost_count_ = 0;
+
+  return {};
+}
+
+bool memory_snapshot::handle_ept_violation(ept_t& ept, pa_t guest_pa, bool write) noexcept
+{
+  if (!write)
+  {
+    return false;
+  }
+
+  guest_pa = guest_pa & ept_pt_t::mask;
+
+  const auto page = find(guest_pa);
+
+  if (page == max_page_count)
+  {
+    return false;
+  }
+
+  //
+  // Only pages which have been writable are write-protected by the
+  // snapshot - other write violations belong to someone else.
+  //
+  size_t protected_ept_count = 0;
+
+  for (size_t j = 0; j < ept_count_; ++j)
+  {
+    protected_ept_count += access(page, j) != unprotected;
+  }
+
+  if (!protected_ept_count)
+  {
+    return false;
+  }
+
+  //
+  // The original access is restored in all EPTs at once, but only the
+  // EPT which caused the violation has its mappings invalidated by it.
+  // Other EPTs might still use cached read-only mapping - the page has
+  // been already saved in such case.
+  //
+  if (auto fault_pte = ept.walk(guest_pa); fault_pte && fault_pte->write_access)
+  {
+    return true;
+  }
+
+  //
+  // Restore the original access first - protect_range() splits the
+  // large page (if the page is mapped by one), so that the PTE of the
+  // page can be fetched.  The guest doesn't run in the meantime,
+  // therefore the page is still intact when it's copied.
+  //
+  // Note that no invalidation is needed - the EPT violation itself
+  // invalidates mappings of the faulting guest physical address and
+  // stale read-only mappings in other EPTs are dismissed above.
+  //
+  // Large pages are split (keeping the write-protection) in all EPTs
+  // first.  If the EPT table pool is exhausted, the violation is
+  // dismissed without saving the page and with no EPT made writable -
+  // the guest faults again, by then the pool should be refilled.
+  //
+  epte_t* pte[max_ept_count] = {};
+  uint64_t host_pfn = 0;
+
+  for (size_t j = 0; j < ept_count_; ++j)
+  {
+    if (access(page, j) != unprotected &&
+        ept_[j]->protect_range(guest_pa, page_size, write_protected(access(page, j))))
+    {
+      return true;
+    }
+  }
+
+  for (size_t j = 0; j < ept_count_; ++j)
+  {
+    if (access(page, j) == unprotected)
+    {
+      continue;
+    }
+
+    if (ept_[j]->protect_range(guest_pa, page_size, static_cast<epte_t::access_type>(access(page, j))))
+    {
+      while (j--)
+      {
+        if (access(page, j) != unprotected)
+        {
+          ept_[j]->protect_range(guest_pa, page_size, write_protected(access(page, j)));
+        }
+      }
+
+      return true;
+    }
+
+    pte[j] = ept_[j]->walk(guest_pa);
+    hvpp_assert(pte[j] && !pte[j]->large_page);
+
+    host_pfn = pte[j]->page_frame_number;
+  }
+
+  if (dirty_count_ < capacity_)
+  {
+    auto& dirty = dirty_[dirty_count_];
+
+    dirty.guest_pfn = guest_pa.pfn();
+    dirty.host_pfn  = host_pfn;
+    dirty.page      = page;
+
+    for (size_t j = 0; j < ept_count_; ++j)
+    {
+      dirty.pte[j] = pte[j];
+
+      if (pte[j])
+      {
+        ept_[j]->pin(pte[j]);
+      }
+    }
+
+    memcpy(pool_ + dirty_count_ * page_size,
+           pa_t::from_pfn(dirty.host_pfn).va(),
+           page_size);
+
+    ++dirty_count_;
+    ++dirtied_count_;
+  }
+  else
+  {
+    ++lost_count_;
+    ++overflow_count_;
+  }
+
+  return true;
+}
+
+//
+// Private
+//
+
+size_t memory_snapshot::find(pa_t guest_pa) const noexcept
+{
+  for (size_t i = 0; i < range_count_; ++i)
+  {
+    if (range_[i].guest_pa <= guest_pa &&
+        guest_pa < range_[i].guest_pa + range_[i].size)
+    {
+      return range_[i].first_page + (guest_pa - range_[i].guest_pa).value() / page_size;
+    }
+  }
+
+  return max_page_count;
+}
+
+}
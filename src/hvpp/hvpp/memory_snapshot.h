@@ -0,0 +1,169 @@
+#pragma once
+#include "ept.h"
+
+#include "lib/error.h"
+
+#include <cstdint>
+
+namespace hvpp {
+
+using namespace ia32;
+
+//
+// Guest physical memory snapshot of the EPTs of single VCPU.
+//
+// protect() write-protects provided guest physical ranges - their
+// content at that moment is the snapshot.  Original access of each
+// protected page is saved (per EPT) and only the write access is
+// removed.  When the guest writes to a protected page for the first
+// time, handle_ept_violation() copies the page into the shadow pool
+// and restores the original access of it.  reset() copies only these
+// dirtied pages back, write-protects them again and invalidates EPT
+// mappings just once.  release() restores the original access of all
+// protected pages.  Pages which aren't mapped or which aren't writable
+// at the time of protect() are left intact.
+//
+// The shadow pool holds "capacity" pages and it is allocated by
+// initialize() - i.e. outside of VMX-root mode.  If the pool is
+// exhausted, further dirtied pages aren't saved (they just get the
+// write access back) and overflow_count() is incremented.  reset()
+// can't roll them back - it fails until the snapshot is released.
+//
+// The ranges are protected in every EPT of the snapshot, so that the
+// guest can't bypass the snapshot by switching EPT views.  Because
+// the EPTs belong to one VCPU, only writes performed by that VCPU are
+// tracked - writes performed by other VCPUs must be caught by their
+// own snapshots (see vmexit_custom_handler).  Like ept_hook_manager,
+// the snapshot is accessed only by the VCPU which owns the EPTs and
+// no locking is needed.
+//
+class memory_snapshot
+{
+  public:
+    struct range_t
+    {
+      pa_t   guest_pa;
+      size_t size;
+    };
+
+    static constexpr size_t max_range_count = 64;
+    static constexpr size_t max_page_count = 16384;
+    static constexpr size_t max_ept_count = 4;
+
+    auto initialize(ept_t* const* ept_list, size_t ept_count, size_t capacity) noexcept -> error_code_t;
+    void destroy() noexcept;
+
+    //
+    // Returns number of protected ranges - ranges which don't fit into
+    // the range table (or which would exceed max_page_count protected
+    // pages) are ignored.  Adjacent ranges are merged.
+    //
+    size_t protect(const range_t* ranges, size_t count) noexcept;
+
+    //
+    // Sets "reset_count" to the number of restored pages.  Returns error
+    // if any page of the snapshot has been dirtied without being saved
+    // (see overflow_count()) - other pages are restored anyway.
+    //
+    auto   reset(size_t& reset_count) noexcept -> error_code_t;
+
+    //
+    // Returns error if the original access couldn't be restored in all
+    // protected pages (the EPT table pool has been exhausted) - the
+    // snapshot then keeps its ranges and release() can be retried.
+    //
+    auto   release() noexcept -> error_code_t;
+
+    size_t range_count() const noexcept { return range_count_; }
+    size_t dirty_count() const noexcept { return dirty_count_; }
+
+    //
+    // Number of pages whose writes aren't tracked (see reset()) - either
+    // they didn't fit into the shadow pool or they couldn't be
+    // write-protected.
+    //
+    size_t lost_count()  const noexcept { return lost_count_; }
+
+    //
+    // Returns false if guest_pa doesn't belong to any protected range,
+    // if the page hasn't been write-protected by the snapshot (or if the
+    // access isn't write).  "ept" is the EPT which caused
+    // the violation - if the page is already writable in it (i.e. the
+    // page has been saved meanwhile through another EPT), the violation
+    // is just dismissed.
+    //
+    bool   handle_ept_violation(ept_t& ept, pa_t guest_pa, bool write) noexcept;
+
+    //
+    // Statistics - total number of dirtied (saved) pages, number of
+    // dirtied pages which didn't fit into the shadow pool, number of
+    // resets and TSC cycles spent by them (including the invalidation).
+    //
+    uint64_t dirtied_count()  const noexcept { return dirtied_count_; }
+    uint64_t overflow_count() const noexcept { return overflow_count_; }
+    uint64_t reset_count()    const noexcept { return reset_count_; }
+    uint64_t reset_cycles()   const noexcept { return reset_cycles_; }
+
+  private:
+    //
+    // Protected pages of each range have consecutive indices into the
+    // table of original access (starting at "first_page").
+    //
+    struct protected_range_t
+    {
+      pa_t   guest_pa;
+      size_t size;
+      size_t first_page;
+    };
+
+    //
+    // PT of each dirtied page is pinned until the page is reset (see
+    // ept_t::pin()).
+    //
+    struct dirty_t
+    {
+      uint64_t guest_pfn;
+      uint64_t host_pfn;
+      size_t   page;
+      epte_t*  pte[max_ept_count];
+    };
+
+    //
+    // Original access of each protected page in each EPT.  Pages which
+    // aren't write-protected by the snapshot (see protect()) are marked
+    // by "unprotected".
+    //
+    static constexpr uint8_t unprotected = 0xff;
+
+    uint8_t&  access(size_t page, size_t ept_index) noexcept
+    { return access_[page * max_ept_count + ept_index]; }
+
+    static epte_t::access_type write_protected(uint8_t access) noexcept
+    { return static_cast<epte_t::access_type>(access & ~uint8_t(epte_t::access_type::write)); }
+
+    //
+    // Returns index of the protected page (or max_page_count if guest_pa
+    // doesn't belong to any protected range).
+    //
+    size_t    find(pa_t guest_pa) const noexcept;
+
+    ept_t*    ept_[max_ept_count] = {};
+    size_t    ept_count_ = 0;
+    uint8_t*  pool_     = nullptr;  // capacity_ pages
+    dirty_t*  dirty_    = nullptr;  // capacity_ records
+    uint8_t*  access_   = nullptr;  // max_page_count * max_ept_count items
+    size_t    capacity_ = 0;
+
+    protected_range_t range_[max_range_count];
+    size_t    range_count_ = 0;
+    size_t    page_count_  = 0;
+    size_t    dirty_count_ = 0;
+    size_t    lost_count_  = 0;
+
+    uint64_t  dirtied_count_;
+    uint64_t  overflow_count_;
+    uint64_t  reset_count_;
+    uint64_t  reset_cycles_;
+};
+
+}
@@ -36,14 +36,14 @@ INCLUDE ia32/common.inc
 ;
 ; Externally used symbols.
 ;
-    ; "public:  __int64 __cdecl ia32::context_t::capture(void)"
-    EXTERN ?capture@context_t@ia32@@QEAAHXZ           : PROC
-
     ; "public:  void    __cdecl ia32::context_t::restore(void)"
     EXTERN ?restore@context_t@ia32@@QEAAXXZ           : PROC
 
-    ; "private: void    __cdecl hvpp::vcpu_t::entry_host(void)"
-    EXTERN ?entry_host@vcpu_t@hvpp@@AEAAXXZ           : PROC
+    ; "private: bool    __cdecl hvpp::vcpu_t::entry_host(unsigned __int64)"
+    EXTERN ?entry_host@vcpu_t@hvpp@@AEAA_N_K@Z        : PROC
+
+    ; "private: void    __cdecl hvpp::vcpu_t::error(void)"
+    EXTERN ?error@vcpu_t@hvpp@@AEAAXXZ                : PROC
 
     ; "private: void    __cdecl hvpp::vcpu_t::entry_guest(void)"
     EXTERN ?entry_guest@vcpu_t@hvpp@@AEAAXXZ          : PROC
@@ -91,45 +91,97 @@ INCLUDE ia32/common.inc
 ;
 ; Routine description:
 ;
-;   This method captures current CPU context and calls vcpu_t::entry_host()
-;   method.
+;   This method saves general purpose registers of the guest into the
+;   vcpu.exit_context_ and calls vcpu_t::entry_host() method with the
+;   current TSC.  Guest RSP, RIP and RFLAGS are read from the VMCS by
+;   vcpu_t::entry_host().
+;
+;   If vcpu_t::entry_host() returns true, registers are restored and
+;   VMRESUME is executed right here.  Otherwise (VMX operation has been
+;   terminated), the whole exit_context_ is restored by
+;   context_t::restore().
 ;
 ;--
 
     ?entry_host_@vcpu_t@hvpp@@CAXXZ PROC
-        push    rcx
-
 ;
-; RCX = &vcpu.exit_context_
+; RSP = &vcpu.guest_context_ (host RSP in the VMCS, see VCPU_OFFSET)
 ;
-        lea     rcx, qword ptr [rsp + 8 + VCPU_EXIT_CONTEXT_OFFSET]
-        call    ?capture@context_t@ia32@@QEAAHXZ
+        mov     context_t.$rax[rsp + VCPU_EXIT_CONTEXT_OFFSET], rax
+        mov     context_t.$rcx[rsp + VCPU_EXIT_CONTEXT_OFFSET], rcx
+        mov     context_t.$rdx[rsp + VCPU_EXIT_CONTEXT_OFFSET], rdx
+        mov     context_t.$rbx[rsp + VCPU_EXIT_CONTEXT_OFFSET], rbx
+        mov     context_t.$rbp[rsp + VCPU_EXIT_CONTEXT_OFFSET], rbp
+        mov     context_t.$rsi[rsp + VCPU_EXIT_CONTEXT_OFFSET], rsi
+        mov     context_t.$rdi[rsp + VCPU_EXIT_CONTEXT_OFFSET], rdi
+        mov     context_t.$r8 [rsp + VCPU_EXIT_CONTEXT_OFFSET], r8
+        mov     context_t.$r9 [rsp + VCPU_EXIT_CONTEXT_OFFSET], r9
+        mov     context_t.$r10[rsp + VCPU_EXIT_CONTEXT_OFFSET], r10
+        mov     context_t.$r11[rsp + VCPU_EXIT_CONTEXT_OFFSET], r11
+        mov     context_t.$r12[rsp + VCPU_EXIT_CONTEXT_OFFSET], r12
+        mov     context_t.$r13[rsp + VCPU_EXIT_CONTEXT_OFFSET], r13
+        mov     context_t.$r14[rsp + VCPU_EXIT_CONTEXT_OFFSET], r14
+        mov     context_t.$r15[rsp + VCPU_EXIT_CONTEXT_OFFSET], r15
 
 ;
-; RBX = &vcpu.exit_context_
-; RCX = original value of RCX
-; RSP = original value of RSP
+; RDX = TSC at the beginning of the VM-exit (see vcpu_t::exit_latency())
 ;
-        mov     rbx, rcx
-        pop     rcx
-
-        mov     context_t.$rcx[rbx], rcx
-        mov     context_t.$rsp[rbx], rsp
+        rdtsc
+        shl     rdx, 32
+        or      rdx, rax
 
 ;
+; RBX = &vcpu.exit_context_
 ; RCX = &vcpu
 ;
+        lea     rbx, qword ptr [rsp + VCPU_EXIT_CONTEXT_OFFSET]
         lea     rcx, qword ptr [rsp + VCPU_OFFSET]
 
 ;
 ; Create shadow space
 ;
         sub     rsp, SHADOW_SPACE
-        call    ?entry_host@vcpu_t@hvpp@@AEAAXXZ
+        call    ?entry_host@vcpu_t@hvpp@@AEAA_N_K@Z
 
 ;
-; Restore CPU context
 ; Note that RBX is preserved, because it is non-volatile register
+;
+        test    al, al
+        jz      restore_context
+
+;
+; Restore general purpose registers and resume the guest.  RBX is
+; restored last, as it holds the context pointer.
+;
+        mov     rax, context_t.$rax[rbx]
+        mov     rcx, context_t.$rcx[rbx]
+        mov     rdx, context_t.$rdx[rbx]
+        mov     rbp, context_t.$rbp[rbx]
+        mov     rsi, context_t.$rsi[rbx]
+        mov     rdi, context_t.$rdi[rbx]
+        mov     r8 , context_t.$r8 [rbx]
+        mov     r9 , context_t.$r9 [rbx]
+        mov     r10, context_t.$r10[rbx]
+        mov     r11, context_t.$r11[rbx]
+        mov     r12, context_t.$r12[rbx]
+        mov     r13, context_t.$r13[rbx]
+        mov     r14, context_t.$r14[rbx]
+        mov     r15, context_t.$r15[rbx]
+        mov     rbx, context_t.$rbx[rbx]
+        vmresume
+
+;
+; VMRESUME failed - vcpu_t::error() reports the error and terminates
+; VMX operation.  Shadow space is still reserved.
+;
+        lea     rcx, qword ptr [rsp + SHADOW_SPACE + VCPU_OFFSET]
+        call    ?error@vcpu_t@hvpp@@AEAAXXZ
+
+        lea     rbx, qword ptr [rsp + SHADOW_SPACE + VCPU_EXIT_CONTEXT_OFFSET]
+
+restore_context:
+;
+; Restore CPU context
 ;
         mov     rcx, rbx
         jmp     ?restore@context_t@ia32@@QEAAXXZ
@@ -1,10 +1,14 @@
 #include "vcpu.h"
 #include "vmexit.h"
 
+#include "ia32/cpuid/cpuid_eax_01.h"
+#include "ia32/cpuid/cpuid_eax_0d.h"
 #include "lib/assert.h"
+#include "lib/bitmap.h"
 #include "lib/log.h"
+#include "lib/mm.h"
 
-#include <iterator> // std::end()
+#include <iterator> // std::end(), std::size()
 
 #include "vcpu.inl"
 
@@ -50,15 +54,41 @@ auto vcpu_t::initialize(vmexit_handler* handler) noexcept -> error_code_t
   //
   memset(&vmxon_, 0, sizeof(vmxon_));
   memset(&vmcs_, 0, sizeof(vmcs_));
+  memset(&eptp_list_, 0, sizeof(eptp_list_));
+  memset(&ve_info_, 0, sizeof(ve_info_));
 
   //
-  // Initialize EPT.
+  // Initialize EPT views.  Only the first view has its own table pool,
+  // other views take tables from it - they're attached to the first
+  // view in setup(), once it's mapped.
   //
-  if (auto err = ept_.initialize())
+  if (auto err = ept_[0].initialize())
   {
     return err;
   }
 
+  for (uint16_t index = 1; index < ept_view_count; ++index)
+  {
+    if (auto err = ept_[index].initialize_view())
+    {
+      return err;
+    }
+  }
+
+  //
+  // The first view is active by default.  EPTP switching is enabled
+  // in setup_guest() (if supported).
+  //
+  ept_index_ = 0;
+  ept_loaded_ = nullptr;
+  ept_vmfunc_enabled_ = false;
+  ept_switch_count_ = 0;
+
+  //
+  // #VE is enabled in setup_guest() (if supported).
+  //
+  ve_enabled_ = false;
+
   //
   // This is not really needed.
   // MSR bitmaps and I/O bitmaps are actually copied here from
@@ -75,6 +105,113 @@ auto vcpu_t::initialize(vmexit_handler* handler) noexcept -> error_code_t
   //
   suppress_rip_adjust_ = false;
 
+#ifdef HVPP_EPT_COALESCE_INTERVAL
+  ept_coalesce_requested_ = false;
+#endif
+
+  //
+  // PML is enabled in setup_guest() (if requested and supported).
+  //
+  pml_enabled_ = false;
+  pml_ring_head_ = 0;
+  pml_ring_count_ = 0;
+  pml_drain_count_ = 0;
+  pml_overflow_count_ = 0;
+
+  //
+  // The VMCS cache is invalidated on each VM-exit in entry_host().
+  //
+  vmcs_cache_valid_ = 0;
+  vmcs_cache_dirty_ = 0;
+  vmread_count_ = 0;
+  vmread_hit_count_ = 0;
+  vmwrite_count_ = 0;
+  vmwrite_request_count_ = 0;
+  exit_count_ = 0;
+
+  //
+  // Select instruction for saving extended processor state.  XSAVE
+  // family can be used only if the OS enabled it (CR4.OSXSAVE).  The
+  // XSAVE area is sized for all supported state components - the guest
+  // is free to change XCR0 by XSETBV.
+  //
+  xsave_area_ = nullptr;
+  xsave_area_size_ = 0;
+  xstate_mode_ = vcpu_xstate_mode::fxsave;
+  xstate_exit_mode_ = vcpu_xstate_mode::fxsave;
+  xstate_saved_ = false;
+  xstate_reason_ = 0;
+  xstate_tsc_ = 0;
+
+#ifdef HVPP_ENABLE_XSAVE
+  {
+    cpuid_eax_01 cpuid_info;
+    ia32_asm_cpuid(cpuid_info.cpu_info, 1);
+
+    if (cpuid_info.feature_information_ecx.xsave_xrstor_instruction &&
+        read<cr4_t>().os_xsave)
+    {
+      cpuid_eax_0d xsave_info;
+      cpuid_eax_0d_ecx_01 xsave_features;
+      ia32_asm_cpuid_ex(xsave_info.cpu_info, 0x0d, 0);
+      ia32_asm_cpuid_ex(xsave_features.cpu_info, 0x0d, 1);
+
+      //
+      // Allocations are page-aligned, which satisfies 64-byte alignment
+      // required by XSAVE instructions.
+      //
+      xsave_area_size_ = xsave_info.xsave_area_size_supported;
+      xsave_area_ = new uint8_t[xsave_area_size_];
+
+      if (!xsave_area_)
+      {
+        return make_error_code_t(std::errc::not_enough_memory);
+      }
+
+      //
+      // XSAVE header (XSTATE_BV and XCOMP_BV) must be zeroed, otherwise
+      // XRSTOR might raise #GP.
+      //
+      memset(xsave_area_, 0, xsave_area_size_);
+
+      xstate_mode_ = xsave_features.extended_state_features.xsavec_and_compaction ? vcpu_xstate_mode::xsavec
+                   : xsave_features.extended_state_features.xsaveopt              ? vcpu_xstate_mode::xsaveopt
+                   :                                                                vcpu_xstate_mode::xsave;
+    }
+  }
+#endif
+
+  for (uint32_t i = 0; i < exit_reason_count; ++i)
+  {
+    xstate_save_[i] = true;
+    xstate_cycles_[i] = 0;
+    xstate_count_[i] = 0;
+    xstate_skip_count_[i] = 0;
+  }
+
+  //
+  // Fast handlers are registered by the exit handler (usually in its
+  // setup() method).
+  //
+  for (auto& fast_handler : fast_handlers_)
+  {
+    fast_handler = nullptr;
+  }
+
+  fast_path_enabled_ = true;
+
+  for (auto& fast_path_count : fast_path_count_)
+  {
+    fast_path_count = 0;
+  }
+
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+  exit_latency_reason_ = 0;
+  exit_latency_key_ = 0;
+  exit_latency_.sequence = 0;
+  exit_latency_reset();
+#endif
+
   //
   // Assertions.
   //
@@ -109,12 +246,168 @@ void vcpu_t::destroy() noexcept
   //
   state_ = vcpu_state::terminating;
   handler_->invoke_termination();
+  handler_->teardown(*this);
+
+  //
+  // Deallocate EPT views - in reverse order, so that the views are
+  // detached (by ept_t::destroy()) before the first view is destroyed.
+  //
+  for (uint16_t index = ept_view_count; index-- > 0; )
+  {
+    ept_[index].destroy();
+  }
+
+  delete[] xsave_area_;
+  xsave_area_ = nullptr;
+}
+
+void vcpu_t::dump() const noexcept
+{
+  //
+  // VMCS cache (see vmread_count()).  VMWRITEs per exit are printed both
+  // with and without the deferring.
+  //
+  if (exit_count_)
+  {
+    hvpp_info("  VM-exits: %llu, VMREADs: %llu (%llu.%02llu per exit), cached reads: %llu",
+              exit_count_, vmread_count_,
+              vmread_count_ / exit_count_,
+              vmread_count_ * 100 / exit_count_ % 100,
+              vmread_hit_count_);
+
+    hvpp_info("  VMWRITEs per exit: %llu.%02llu (without deferring: %llu.%02llu)",
+              vmwrite_count_ / exit_count_,
+              vmwrite_count_ * 100 / exit_count_ % 100,
+              vmwrite_request_count_ / exit_count_,
+              vmwrite_request_count_ * 100 / exit_count_ % 100);
+  }
+
+  //
+  // VM-exits handled by the fast path (see fast_handler()) - these
+  // aren't seen by the exit handler.
+  //
+  for (uint32_t reason = 0; reason < exit_reason_count; ++reason)
+  {
+    if (fast_path_count_[reason])
+    {
+      hvpp_info("  fast path: %-30s %llu",
+                vmx::exit_reason_to_string(static_cast<vmx::exit_reason>(reason)),
+                fast_path_count_[reason]);
+    }
+  }
 
   //
-  // Deallocate EPT.
+  // Aliases which didn't fit into the reverse map can't be found by
+  // ept_t::revoke().  Split 2MB regions which didn't fit into the split
+  // list are never coalesced.
   //
-  ept_.destroy();
+  for (uint16_t index = 0; index < ept_view_count; ++index)
+  {
+    if (auto overflow_count = ept_[index].rmap_overflow_count())
+    {
+      hvpp_info("  EPT view %u: reverse map overflows: %llu",
+                index, overflow_count);
+    }
+
+    if (auto overflow_count = ept_[index].split_overflow_count())
+    {
+      hvpp_info("  EPT view %u: untracked splits: %llu",
+                index, overflow_count);
+    }
+  }
+}
+
+void vcpu_t::xstate_dump(const vcpu_t* vcpu_list, uint32_t vcpu_count) noexcept
+{
+  static constexpr const char* xstate_mode_names[] = {
+    "fxsave", "xsave", "xsaveopt", "xsavec"
+  };
+
+  hvpp_info("Extended state: %s",
+            xstate_mode_names[static_cast<int>(vcpu_list[0].xstate_mode_)]);
+
+  for (uint32_t reason = 0; reason < exit_reason_count; ++reason)
+  {
+    uint64_t cycles = 0;
+    uint64_t count = 0;
+    uint64_t skip_count = 0;
+
+    for (uint32_t i = 0; i < vcpu_count; ++i)
+    {
+      cycles     += vcpu_list[i].xstate_cycles_[reason];
+      count      += vcpu_list[i].xstate_count_[reason];
+      skip_count += vcpu_list[i].xstate_skip_count_[reason];
+    }
+
+    if (count || skip_count)
+    {
+      hvpp_info("  %-30s saved: %10llu (%6llu cycles avg), skipped: %10llu",
+                vmx::exit_reason_to_string(static_cast<vmx::exit_reason>(reason)),
+                count, count ? cycles / count : 0, skip_count);
+    }
+  }
+}
+
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+void vcpu_t::exit_latency_dump(const vcpu_t* vcpu_list, uint32_t vcpu_count) noexcept
+{
+  auto merged = new exit_latency_t;
+
+  if (!merged)
+  {
+    return;
+  }
+
+  memset(merged, 0, sizeof(*merged));
+
+  for (uint32_t i = 0; i < vcpu_count; ++i)
+  {
+    merged->merge(vcpu_list[i].exit_latency_);
+  }
+
+  hvpp_info("VM-exit latency (cycles):");
+
+  for (uint32_t reason = 0; reason < exit_latency_t::exit_reason_count; ++reason)
+  {
+    auto& histogram = merged->by_exit_reason[reason];
+
+    if (histogram.count)
+    {
+      hvpp_info("  %-30s count: %10llu p50: %8llu p99: %8llu p99.9: %8llu max: %10llu",
+                vmx::exit_reason_to_string(static_cast<vmx::exit_reason>(reason)),
+                histogram.count,
+                histogram.value_at(50, 100),
+                histogram.value_at(99, 100),
+                histogram.value_at(999, 1000),
+                histogram.max);
+    }
+  }
+
+  for (auto& sub_reason : merged->by_sub_reason)
+  {
+    if (sub_reason.key)
+    {
+      auto& histogram = sub_reason.histogram;
+
+      hvpp_info("  %-19s 0x%08x count: %10llu p50: %8llu p99: %8llu p99.9: %8llu max: %10llu",
+                vmx::exit_reason_to_string(static_cast<vmx::exit_reason>(sub_reason.exit_reason())),
+                sub_reason.value(),
+                histogram.count,
+                histogram.value_at(50, 100),
+                histogram.value_at(99, 100),
+                histogram.value_at(999, 1000),
+                histogram.max);
+    }
+  }
+
+  if (merged->sub_reason_overflow_count)
+  {
+    hvpp_info("  (%llu VM-exits with untracked sub-reason)", merged->sub_reason_overflow_count);
+  }
+
+  delete merged;
 }
+#endif
 
 void vcpu_t::launch() noexcept
 {
@@ -256,7 +549,12 @@ void vcpu_t::setup() noexcept
   // This function should NOT return - the next instruction after vmlaunch
   // should be at vcpu_t::entry_guest_ (vcpu.asm).
   //
-  ept_.map_identity();
+  ept_[0].map_identity();
+
+  for (uint16_t index = 1; index < ept_view_count; ++index)
+  {
+    ept_[index].attach(ept_[0]);
+  }
 
   load_vmxon();
   load_vmcs();
@@ -266,6 +564,12 @@ void vcpu_t::setup() noexcept
 
   handler_->setup(*this);
 
+  //
+  // Write guest-state fields deferred by setup_guest() and by the
+  // handler.
+  //
+  vmcs_cache_flush();
+
   vmx::vmlaunch();
 
   //
@@ -446,10 +750,25 @@ void vcpu_t::setup_guest() noexcept
   //
   vcpu_id(1);
 
+#ifdef HVPP_ENABLE_PML
+  //
+  // Page-Modification Logging is built on top of the EPT dirty flags -
+  // the CPU logs guest physical address each time it sets the dirty
+  // flag in the EPT entry.  Therefore, accessed/dirty flags must be
+  // enabled in the EPT pointer first.
+  //
+  pml_enabled_ = true;
+
+  for (auto& ept : ept_)
+  {
+    pml_enabled_ = pml_enabled_ && !ept.ad_enable();
+  }
+#endif
+
   //
   // Set EPT pointer.
   //
-  ept_pointer(ept_.ept_pointer());
+  ept_pointer(ept_[ept_index_].ept_pointer());
 
   //
   // VMCS link pointer points to the shadow VMCS if VMCS shadowing is
@@ -486,8 +805,69 @@ void vcpu_t::setup_guest() noexcept
   procbased_ctls2.enable_rdtscp = true;
   procbased_ctls2.enable_xsaves = true;
   procbased_ctls2.enable_invpcid = true;
+  procbased_ctls2.enable_pml = pml_enabled_;
+  procbased_ctls2.enable_vm_functions = true;
+  procbased_ctls2.ept_violation_ve = true;
   processor_based_controls2(procbased_ctls2);
 
+  //
+  // Enable conversion of EPT violations to virtualization exceptions.
+  // The delivery is disarmed until the guest registers its own
+  // information area (see ve_register()).  Also, when this control is
+  // enabled, VMFUNC keeps the EPTP index in the VMCS up-to-date.
+  //
+  ve_enabled_ = !!processor_based_controls2().ept_violation_ve;
+
+  if (ve_enabled_)
+  {
+    ve_unregister();
+    eptp_index(ept_index_);
+  }
+
+  //
+  // Enable EPTP switching (VM function 0), so that the guest can switch
+  // EPT views by the VMFUNC instruction without VM-exit.  The "enable VM
+  // functions" control might have been masked out by vmx::adjust() and
+  // even if VM functions are supported, EPTP switching doesn't need to be.
+  //
+  // If VM functions are supported but EPTP switching isn't, VMFUNC causes
+  // VM-exit and the switch is emulated by the exit handler (see
+  // vmexit_passthrough_handler::handle_execute_vmfunc()).  If VM functions
+  // aren't supported at all, VMFUNC raises #UD in the guest and views can
+  // be switched only by the hypervisor (ept_index()).
+  //
+  vmx::vmfunc_controls_t vmfunc_ctls{};
+
+  if (processor_based_controls2().enable_vm_functions)
+  {
+    ept_vmfunc_enabled_ = !!msr::read<msr::vmx_vmfunc_t>().eptp_switching;
+
+    if (ept_vmfunc_enabled_)
+    {
+      ept_view_update();
+      eptp_list_address(pa_t::from_va(&eptp_list_));
+      vmfunc_ctls.eptp_switching = true;
+    }
+
+    vmfunc_controls(vmfunc_ctls);
+  }
+
+  if (pml_enabled_)
+  {
+    //
+    // The control might have been masked out by vmx::adjust() if the
+    // CPU doesn't support PML.
+    //
+    pml_enabled_ = !!processor_based_controls2().enable_pml;
+
+    if (pml_enabled_)
+    {
+      memset(&pml_, 0, sizeof(pml_));
+      pml_address(pa_t::from_va(&pml_));
+      guest_pml_index(vmx::pml_t::count - 1);
+    }
+  }
+
   //
   // By default we want each VM-entry and VM-exit in 64bit mode.
   //
@@ -519,13 +899,360 @@ void vcpu_t::setup_guest() noexcept
   guest_rip(reinterpret_cast<uint64_t>(&vcpu_t::entry_guest_));
 }
 
-void vcpu_t::entry_host() noexcept
+void vcpu_t::pml_drain() noexcept
+{
+  if (!pml_enabled_)
+  {
+    return;
+  }
+
+  //
+  // The CPU decrements PML index after each logged write.  If the log
+  // is full, the index underflows (i.e. it's out of 0-511 range).
+  //
+  auto pml_index = guest_pml_index();
+  auto first = pml_index < vmx::pml_t::count
+    ? pml_index + 1
+    : 0;
+
+  for (auto i = first; i < vmx::pml_t::count; ++i)
+  {
+    if (pml_ring_count_ == pml_ring_size)
+    {
+      //
+      // Consumer doesn't keep up - drop the address.
+      //
+      ++pml_overflow_count_;
+      continue;
+    }
+
+    pml_ring_[(pml_ring_head_ + pml_ring_count_++) % pml_ring_size] = pml_.entries[i];
+  }
+
+  guest_pml_index(vmx::pml_t::count - 1);
+  ++pml_drain_count_;
+}
+
+size_t vcpu_t::pml_harvest(pa_t guest_pa, size_t size, void* dirty_bitmap) noexcept
 {
+  pml_drain();
+
+  const auto page_count = static_cast<int>(size >> page_shift);
+  const auto guest_pa_end = guest_pa + size;
+
+  bitmap dirty(dirty_bitmap, page_count);
+
+  size_t entry_count = 0;
+
+  for (auto remaining = pml_ring_count_; remaining > 0; --remaining)
+  {
+    //
+    // Pop the address from the ring.
+    //
+    auto address = pa_t(pml_ring_[pml_ring_head_]);
+    pml_ring_head_ = (pml_ring_head_ + 1) % pml_ring_size;
+    --pml_ring_count_;
+
+    if (address < guest_pa || !(address < guest_pa_end))
+    {
+      //
+      // Not in the range - push it back.
+      //
+      pml_ring_[(pml_ring_head_ + pml_ring_count_++) % pml_ring_size] = address.value();
+      continue;
+    }
+
+    dirty.set(static_cast<int>((address - guest_pa).value() >> page_shift));
+
+    //
+    // Each view has its own dirty flags - clear them in all of them.
+    //
+    for (auto& ept : ept_)
+    {
+      ept.clear_dirty(address);
+    }
+
+    ++entry_count;
+  }
+
+  //
+  // Cleared dirty flags aren't visible to the CPU until the cached
+  // mappings are invalidated.
+  //
+  if (entry_count)
+  {
+    for (auto& ept : ept_)
+    {
+      ept.invalidate();
+    }
+  }
+
+  return entry_count;
+}
+
+void vcpu_t::xstate_save(vmx::exit_reason reason, bool enable) noexcept
+{
+  hvpp_assert(static_cast<uint32_t>(reason) < exit_reason_count);
+
+  xstate_save_[static_cast<uint32_t>(reason)] = enable;
+}
+
+bool vcpu_t::xstate_save(vmx::exit_reason reason) const noexcept
+{
+  hvpp_assert(static_cast<uint32_t>(reason) < exit_reason_count);
+
+  return xstate_save_[static_cast<uint32_t>(reason)];
+}
+
+uint64_t vcpu_t::xstate_cycles(vmx::exit_reason reason) const noexcept
+{
+  hvpp_assert(static_cast<uint32_t>(reason) < exit_reason_count);
+
+  return xstate_cycles_[static_cast<uint32_t>(reason)];
+}
+
+uint64_t vcpu_t::xstate_count(vmx::exit_reason reason) const noexcept
+{
+  hvpp_assert(static_cast<uint32_t>(reason) < exit_reason_count);
+
+  return xstate_count_[static_cast<uint32_t>(reason)];
+}
+
+uint64_t vcpu_t::xstate_skip_count(vmx::exit_reason reason) const noexcept
+{
+  hvpp_assert(static_cast<uint32_t>(reason) < exit_reason_count);
+
+  return xstate_skip_count_[static_cast<uint32_t>(reason)];
+}
+
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+void vcpu_t::exit_latency_reset() noexcept
+{
+  exit_latency_.reset();
+}
+#endif
+
+void vcpu_t::fast_handler(vmx::exit_reason reason, vmexit_fast_handler_t handler) noexcept
+{
+  hvpp_assert(static_cast<uint32_t>(reason) < exit_reason_count);
+
+  fast_handlers_[static_cast<uint32_t>(reason)] = handler;
+}
+
+uint64_t vcpu_t::fast_path_count(vmx::exit_reason reason) const noexcept
+{
+  return static_cast<uint32_t>(reason) < exit_reason_count
+    ? fast_path_count_[static_cast<uint32_t>(reason)]
+    : 0;
+}
+
+auto vcpu_t::ept_index() const noexcept -> uint16_t
+{
+  if (!ept_vmfunc_enabled_)
+  {
+    return ept_index_;
+  }
+
+  if (ve_enabled_)
+  {
+    //
+    // EPTP index is updated by VMFUNC when the "EPT-violation #VE"
+    // control is enabled.
+    //
+    return eptp_index();
+  }
+
+  //
+  // The guest might have switched the view by VMFUNC - find the view
+  // by the EPT pointer currently set in the VMCS.
+  //
+  const auto eptptr = ept_pointer();
+
+  for (uint16_t index = 0; index < ept_view_count; ++index)
+  {
+    if (eptp_list_.entries[index].flags == eptptr.flags)
+    {
+      return index;
+    }
+  }
+
+  return ept_index_;
+}
+
+void vcpu_t::ept_index(uint16_t index) noexcept
+{
+  hvpp_assert(index < ept_view_count);
+
+  //
+  // Cached guest-physical mappings are associated with the EP4TA (see
+  // vmexit_custom_handler::handle_ept_violation()), therefore there is
+  // no need for INVEPT after the EPT pointer is changed.
+  //
+  ept_pointer(ept_[index].ept_pointer());
+  ept_index_ = index;
+  ept_loaded_ = nullptr;
+
+  if (ve_enabled_)
+  {
+    eptp_index(index);
+  }
+
+  ++ept_switch_count_;
+}
+
+void vcpu_t::ept_load(ept_t* ept) noexcept
+{
+  ept_pointer(ept
+    ? ept->ept_pointer()
+    : ept_[ept_index_].ept_pointer());
+
+  ept_loaded_ = ept;
+}
+
+ept_t& vcpu_t::ept_current() noexcept
+{
+  //
+  // The guest might have switched to one of the views by VMFUNC since
+  // the EPT has been loaded.
+  //
+  if (ept_loaded_ && ept_pointer().flags == ept_loaded_->ept_pointer().flags)
+  {
+    return *ept_loaded_;
+  }
+
+  return ept();
+}
+
+bool vcpu_t::ve_register(pa_t ve_info_pa) noexcept
+{
+  hvpp_assert(ve_enabled_);
+
+  if (byte_offset(ve_info_pa.value()) != 0)
+  {
+    return false;
+  }
+
+  //
+  // The information area is accessed by the CPU by its host physical
+  // address (not translated by EPT) - the CPU writes it regardless
+  // of the EPT access.  Therefore the page must be writable by the
+  // guest in every EPT it can run with, otherwise the guest could use
+  // the #VE delivery to write into pages it can't write directly
+  // (e.g. pages write-protected by the memory snapshot or hypervisor
+  // memory mapped into some view).
+  //
+  pa_t host_pa;
+
+  if (!ept_current().translate(ve_info_pa, true, host_pa))
+  {
+    return false;
+  }
+
+  for (auto& ept : ept_)
+  {
+    pa_t view_host_pa;
+
+    if (!ept.translate(ve_info_pa, true, view_host_pa) || view_host_pa != host_pa)
+    {
+      return false;
+    }
+  }
+
+  if (memory_manager::contains(host_pa.va()))
+  {
+    return false;
+  }
+
+  ve_info_address(host_pa);
+  return true;
+}
+
+void vcpu_t::ve_unregister() noexcept
+{
+  hvpp_assert(ve_enabled_);
+
+  //
+  // Keep the "busy" field of the per-VCPU area set - no #VE is ever
+  // delivered through it.
+  //
+  ve_info_.busy = vmx::ve_info_t::busy_value;
+  ve_info_address(pa_t::from_va(&ve_info_));
+}
+
+void vcpu_t::ept_view_update() noexcept
+{
+  //
+  // Find the active view while the EPTP list still holds old pointers.
+  //
+  const auto active_index = ept_index();
+
+  //
+  // Entries of the EPTP list beyond the last view are left zeroed
+  // (i.e. invalid) - VMFUNC selecting them causes VM-exit.
+  //
+  memset(&eptp_list_, 0, sizeof(eptp_list_));
+
+  for (uint16_t index = 0; index < ept_view_count; ++index)
+  {
+    eptp_list_.entries[index] = ept_[index].ept_pointer();
+  }
+
+  ept_index_ = active_index;
+  ept_pointer(ept_[active_index].ept_pointer());
+}
+
+bool vcpu_t::entry_host(uint64_t exit_tsc) noexcept
+{
+  //
+  // Invalidate the VMCS cache - VM-exit information fields and guest
+  // state of this VM-exit are read lazily.  Deferred writes have been
+  // flushed before the previous VM-entry.
+  //
+  hvpp_assert(vmcs_cache_dirty_ == 0);
+
+  vmcs_cache_valid_ = 0;
+  ++exit_count_;
+
   //
   // Reset RIP-adjust flag.
   //
   suppress_rip_adjust_ = false;
 
+  //
+  // Fast path - see fast_handler().  Nothing but the fast handler and
+  // the RIP update runs here - the extended processor state hasn't been
+  // saved yet, therefore neither latency histograms nor the VMCS cache
+  // flush (whose loops might get vectorized by the compiler) can be
+  // used.  Fast handlers must not write any VMCS field.
+  //
+  if (fast_path_enabled_)
+  {
+    const auto reason = static_cast<uint32_t>(exit_reason());
+
+    if (reason < exit_reason_count &&
+        fast_handlers_[reason] &&
+        fast_handlers_[reason](*this))
+    {
+      hvpp_assert(state_ != vcpu_state::terminated);
+      hvpp_assert(vmcs_cache_dirty_ == 0);
+
+      ++fast_path_count_[reason];
+
+      if (!suppress_rip_adjust_)
+      {
+        vmx::vmwrite(vmx::vmcs_t::field::guest_rip, guest_rip() + exit_instruction_length());
+      }
+
+      return true;
+    }
+  }
+
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+  exit_latency_begin();
+#else
+  (void)(exit_tsc);
+#endif
+
   //
   // Execute "fxsave" instruction.  This causes to save x87 state and SSE
   // state.  It includes x87 registers (st0-st7 / mm0-mm7), XMM registers
@@ -542,15 +1269,16 @@ void vcpu_t::entry_host() noexcept
   // most likely relies on them.  Therefore, at the end of this function,
   // we restore them back.
   //
-  // Note that there exists newer pair of instructions "xsave" and "xrstor"
-  // which is also capable (among other things) of saving/restoring AVX state.
-  // But as long as we're not compiled with AVX support, fxsave/fxrstor should
-  // be enough.
+  // If HVPP_ENABLE_XSAVE is defined, newer "xsavec"/"xsaveopt"/"xsave"
+  // instructions are used instead (if supported).  Besides AVX state, they
+  // can skip components which are in their initial configuration (xsavec,
+  // xsaveopt) or which haven't been modified since the last xrstor
+  // (xsaveopt).
   //
-  ia32_asm_fx_save(&fxsave_area_);
-
-  auto saved_rsp    = exit_context_.rsp;
-  auto saved_rflags = exit_context_.rflags;
+  // The save (and restore) is skipped entirely for exit reasons disabled
+  // by xstate_save().
+  //
+  xstate_save_area();
 
   {
     exit_context_.rsp    = guest_rsp();
@@ -577,19 +1305,165 @@ void vcpu_t::entry_host() noexcept
       {
         exit_context_.rip += exit_instruction_length();
       }
+
+#ifdef HVPP_EPT_COALESCE_INTERVAL
+      //
+      // Join split 2MB EPT regions which again map contiguous memory
+      // with identical attributes, once requested by the hypervisor
+      // (see hypervisor::refill_callback()).  Doing this in batches
+      // keeps the check out of the hot path and requires just single
+      // INVEPT for all joined regions.
+      //
+      if (ept_coalesce_requested_.load(std::memory_order_relaxed) &&
+          ept_coalesce_requested_.exchange(false))
+      {
+        for (auto& ept : ept_)
+        {
+          if (ept.coalesce())
+          {
+            ept.invalidate();
+          }
+        }
+      }
+#endif
     }
 
+    //
+    // RSP and RFLAGS are usually unchanged - the VMCS cache drops such
+    // writes.  All deferred writes are flushed right before VMRESUME.
+    //
     guest_rsp(exit_context_.rsp);
     guest_rip(exit_context_.rip);
     guest_rflags(exit_context_.rflags);
-  }
 
-  exit_context_.rflags = saved_rflags;
-  exit_context_.rsp    = saved_rsp;
-  exit_context_.rip    = reinterpret_cast<uint64_t>(&vmx::vmresume);
+    vmcs_cache_flush();
+  }
 
 exit:
-  ia32_asm_fx_restore(&fxsave_area_);
+  xstate_restore_area();
+
+  //
+  // General purpose registers are restored from exit_context_ by the
+  // entry_host_() stub (see vcpu.asm), which executes VMRESUME if we
+  // return true.  Otherwise the whole exit_context_ (including RSP, RIP
+  // and RFLAGS of the guest) is restored by context_t::restore().
+  //
+  if (state_ == vcpu_state::terminated)
+  {
+    return false;
+  }
+
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+  exit_latency_end(exit_tsc);
+#endif
+
+  return true;
+}
+
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+void vcpu_t::exit_latency_begin() noexcept
+{
+  exit_latency_reason_ = static_cast<uint32_t>(exit_reason());
+
+  //
+  // Sub-reason has to be determined now - the handler overwrites
+  // registers of the exit context.
+  //
+  switch (static_cast<vmx::exit_reason>(exit_latency_reason_))
+  {
+    case vmx::exit_reason::execute_cpuid:
+    case vmx::exit_reason::execute_rdmsr:
+    case vmx::exit_reason::execute_wrmsr:
+      exit_latency_key_ = exit_latency_t::sub_reason_key(
+        exit_latency_reason_,
+        static_cast<vmx::exit_reason>(exit_latency_reason_) == vmx::exit_reason::execute_cpuid
+          ? exit_context_.eax
+          : exit_context_.ecx);
+      break;
+
+    case vmx::exit_reason::execute_io_instruction:
+      {
+        auto exit_qualification = this->exit_qualification().io_instruction;
+
+        exit_latency_key_ = exit_latency_t::sub_reason_key(
+          exit_latency_reason_,
+          static_cast<uint32_t>(exit_qualification.port_number) |
+          (exit_qualification.access_type == vmx::exit_qualification_io_instruction_t::access_in
+            ? 0x10000
+            : 0));
+      }
+      break;
+
+    default:
+      exit_latency_key_ = 0;
+      break;
+  }
+}
+
+void vcpu_t::exit_latency_end(uint64_t exit_tsc) noexcept
+{
+  exit_latency_.record(exit_latency_reason_,
+                       exit_latency_key_,
+                       ia32_asm_read_tsc() - exit_tsc);
+}
+#endif
+
+void vcpu_t::xstate_save_area() noexcept
+{
+  xstate_reason_ = static_cast<uint32_t>(exit_reason());
+  xstate_saved_  = xstate_reason_ >= exit_reason_count ||
+                   xstate_save_[xstate_reason_];
+
+  if (!xstate_saved_)
+  {
+    ++xstate_skip_count_[xstate_reason_];
+    return;
+  }
+
+  //
+  // XSETBV handler changes XCR0 between the save and the restore, which
+  // would make the XSAVE area incompatible with XRSTOR.  x87 and SSE
+  // state is always enabled in XCR0, therefore FXSAVE is used instead.
+  //
+  xstate_exit_mode_ = xstate_reason_ == static_cast<uint32_t>(vmx::exit_reason::execute_xsetbv)
+    ? vcpu_xstate_mode::fxsave
+    : xstate_mode_;
+
+  const auto tsc = ia32_asm_read_tsc();
+
+  switch (xstate_exit_mode_)
+  {
+    case vcpu_xstate_mode::xsavec:   ia32_asm_xsave_c(xsave_area_, ~0ull); break;
+    case vcpu_xstate_mode::xsaveopt: ia32_asm_xsave_opt(xsave_area_, ~0ull); break;
+    case vcpu_xstate_mode::xsave:    ia32_asm_xsave(xsave_area_, ~0ull); break;
+    default:                    ia32_asm_fx_save(&fxsave_area_); break;
+  }
+
+  xstate_tsc_ = ia32_asm_read_tsc() - tsc;
+}
+
+void vcpu_t::xstate_restore_area() noexcept
+{
+  if (!xstate_saved_)
+  {
+    return;
+  }
+
+  const auto tsc = ia32_asm_read_tsc();
+
+  switch (xstate_exit_mode_)
+  {
+    case vcpu_xstate_mode::xsavec:
+    case vcpu_xstate_mode::xsaveopt:
+    case vcpu_xstate_mode::xsave:    ia32_asm_xrstor(xsave_area_, ~0ull); break;
+    default:                    ia32_asm_fx_restore(&fxsave_area_); break;
+  }
+
+  if (xstate_reason_ < exit_reason_count)
+  {
+    xstate_cycles_[xstate_reason_] += xstate_tsc_ + ia32_asm_read_tsc() - tsc;
+    xstate_count_[xstate_reason_] += 1;
+  }
 }
 
 void vcpu_t::entry_guest() noexcept
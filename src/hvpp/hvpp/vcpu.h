@@ -1,5 +1,7 @@
 #pragma once
+#include "config.h"
 #include "ept.h"
+#include "exit_latency.h"
 
 #include "ia32/arch.h"
 #include "ia32/exception.h"
@@ -7,6 +9,7 @@
 
 #include "lib/error.h"
 
+#include <atomic>
 #include <cstdint>
 
 namespace hvpp {
@@ -14,6 +17,7 @@ namespace hvpp {
 using namespace ia32;
 
 class vmexit_handler;
+class vcpu_t;
 
 static constexpr int vcpu_stack_size = 0x8000;
 
@@ -104,23 +108,245 @@ enum class vcpu_state
   terminated,
 };
 
+//
+// Instruction used for saving extended processor state (see
+// vcpu_t::xstate_mode()).
+//
+enum class vcpu_xstate_mode
+{
+  fxsave,
+  xsave,
+  xsaveopt,
+  xsavec,
+};
+
+//
+// Fast VM-exit handler (see vcpu_t::fast_handler()).
+//
+using vmexit_fast_handler_t = bool (*)(vcpu_t& vp) noexcept;
+
 class vcpu_t
 {
   public:
     auto initialize(vmexit_handler* handler = nullptr) noexcept -> error_code_t;
     void destroy() noexcept;
 
+    //
+    // Print statistics of this VCPU - VMCS cache, fast path and overflows
+    // of the EPT reverse maps.  xstate_dump() and exit_latency_dump()
+    // print cost of saving extended processor state and VM-exit latencies
+    // merged from all provided VCPUs.
+    //
+    void dump() const noexcept;
+    static void xstate_dump(const vcpu_t* vcpu_list, uint32_t vcpu_count) noexcept;
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+    static void exit_latency_dump(const vcpu_t* vcpu_list, uint32_t vcpu_count) noexcept;
+#endif
+
     void launch() noexcept;
     void terminate() noexcept;
 
     auto exit_handler() const noexcept -> vmexit_handler*;
     void exit_handler(vmexit_handler* handler) noexcept;
 
-    ept_t& ept() noexcept { return ept_; }
+    //
+    // EPT views.
+    //
+    // Each VCPU has ept_view_count EPTs ("views").  The first view is
+    // identity-mapped and owns all tables, other views are copy-on-write
+    // views attached to it (see ept_t::attach()) - they share its tables
+    // until they're modified.  Views can be modified independently (e.g.
+    // one view can map hooked page as execute-only while another one
+    // maps it as read-write), but modifications of the first view are
+    // applied to the other views as well - modify the first view first.
+    // ept() returns the active view.
+    //
+    // ept_index(index) makes provided view active by rewriting EPT
+    // pointer in the VMCS (must be called in VMX-root mode).  If the CPU
+    // supports EPTP switching (VM function 0), EPT pointers of all views
+    // are also put into the EPTP list and the guest can switch between
+    // them by the VMFUNC instruction without causing VM-exit.  Therefore
+    // ept_index() reads the active view back from the VMCS in such case.
+    //
+    // Note that if EPT pointer of any view changes (e.g. by ept_t::ad_enable()),
+    // ept_view_update() must be called.
+    //
+    static constexpr uint16_t ept_view_count = 2;
+
+    ept_t& ept() noexcept { return ept_[ept_index()]; }
+    ept_t& ept(uint16_t index) noexcept { return ept_[index]; }
+
+    auto ept_index() const noexcept -> uint16_t;
+    void ept_index(uint16_t index) noexcept;
+    void ept_view_update() noexcept;
+
+    //
+    // Load EPT pointer of provided EPT, which isn't one of the views (e.g.
+    // per-address-space EPT, see ept_view_cache).  ept() still returns the
+    // active view.  ept_load(nullptr) loads the active view back.
+    //
+    // ept_current() returns the EPT which is currently in use by the
+    // guest - i.e. the EPT loaded by ept_load() (as long as it hasn't
+    // been replaced by ept_index() or by VMFUNC) or the active view.
+    //
+    void ept_load(ept_t* ept) noexcept;
+    ept_t& ept_current() noexcept;
+
+    bool ept_vmfunc_enabled() const noexcept { return ept_vmfunc_enabled_; }
+    uint64_t ept_switch_count() const noexcept { return ept_switch_count_; }
+
+#ifdef HVPP_EPT_COALESCE_INTERVAL
+    //
+    // Request join of split 2MB regions in all views (see
+    // ept_t::coalesce()).  Can be called from any CPU, the VCPU performs
+    // the join on its next VM-exit.
+    //
+    void ept_coalesce_request() noexcept { ept_coalesce_requested_ = true; }
+#endif
+
+    //
+    // Virtualization exceptions (#VE).
+    //
+    // If supported, the "EPT-violation #VE" control is enabled in
+    // setup_guest(), but the delivery of #VE is disarmed - the per-VCPU
+    // information area has its "busy" field set, therefore all EPT
+    // violations still cause VM-exits.
+    //
+    // ve_register() replaces the information area by guest-provided page
+    // (4kb aligned guest physical address), which is owned by the guest
+    // #VE handler from now on.  The page must be mapped writable (to the
+    // same host page) in the current EPT and in every EPT view and it
+    // must not belong to the hypervisor - otherwise false is returned.  EPT violations caused by entries mapped with
+    // suppress_ve == false are then delivered to the guest as long as
+    // the "busy" field of that page is 0.  ve_unregister() switches back
+    // to the per-VCPU area.  Both methods must be called in VMX-root mode.
+    //
+    bool ve_enabled() const noexcept { return ve_enabled_; }
+    bool ve_register(pa_t ve_info_pa) noexcept;
+    void ve_unregister() noexcept;
 
     context_t& exit_context() { return exit_context_; }
     void suppress_rip_adjust() noexcept { suppress_rip_adjust_ = true; }
 
+    //
+    // Page-Modification Logging (see HVPP_ENABLE_PML).
+    //
+    // pml_drain() moves logged guest physical addresses from the PML
+    // page into the dirty ring of this VCPU and resets the PML index.
+    // It's called on "page-modification log full" VM-exit (by the
+    // passthrough handler) and by pml_harvest().
+    //
+    // pml_harvest() drains the log and consumes all logged addresses
+    // which belong to provided guest physical range - for each such
+    // address, bit (relative to guest_pa) in dirty_bitmap is set and
+    // the EPT dirty flag is cleared, so that next write to the page
+    // is logged again.  Duplicates are naturally merged in the bitmap.
+    // Addresses outside of the range are kept in the ring.  Returns
+    // number of consumed log entries.
+    //
+    // Both methods must be called in VMX-root mode.
+    //
+    static constexpr uint32_t pml_ring_size = 4096;
+
+    bool   pml_enabled() const noexcept { return pml_enabled_; }
+    void   pml_drain() noexcept;
+    size_t pml_harvest(pa_t guest_pa, size_t size, void* dirty_bitmap) noexcept;
+
+    uint64_t pml_drain_count() const noexcept { return pml_drain_count_; }
+    uint64_t pml_overflow_count() const noexcept { return pml_overflow_count_; }
+
+    //
+    // VM-exit information fields (exit reason, qualification, ...) and
+    // hot guest-state fields (guest CR0/CR3/CR4, CR0/CR4 read shadows and
+    // guest RSP/RIP/RFLAGS) are cached for the duration of single VM-exit
+    // - each of them is read by VMREAD at most once per exit, no matter
+    // how many handlers ask for it.  The cache is invalidated at the
+    // beginning of each VM-exit (see entry_host()).
+    //
+    // Writes to the cached guest-state fields are deferred - repeated
+    // writes to the same field collapse and writes of unchanged values
+    // are dropped.  Dirty fields are written by VMWRITE just before
+    // VM-entry.
+    //
+    // vmread_count() is the number of VMREADs of the cached fields,
+    // vmread_hit_count() is the number of reads served from the cache.
+    // vmwrite_count() is the number of VMWRITEs of the cached fields,
+    // vmwrite_request_count() is the number of calls of their setters
+    // (i.e. number of VMWRITEs without the deferring).
+    //
+    uint64_t exit_count() const noexcept { return exit_count_; }
+    uint64_t vmread_count() const noexcept { return vmread_count_; }
+    uint64_t vmread_hit_count() const noexcept { return vmread_hit_count_; }
+    uint64_t vmwrite_count() const noexcept { return vmwrite_count_; }
+    uint64_t vmwrite_request_count() const noexcept { return vmwrite_request_count_; }
+
+    //
+    // Number of basic exit reasons (see vmx::exit_reason).
+    //
+    static constexpr uint32_t exit_reason_count = 65;
+
+    //
+    // Extended processor state (x87, SSE, AVX, ...) is saved at the
+    // beginning of each VM-exit and restored before VM-entry (see
+    // entry_host()).  If HVPP_ENABLE_XSAVE is defined and the CPU
+    // supports it, XSAVEC, XSAVEOPT or XSAVE (in this order of
+    // preference) is used instead of FXSAVE.
+    //
+    // xstate_save(reason, false) skips the save & restore completely
+    // for VM-exits with provided exit reason.  Use it only for exit
+    // reasons whose handlers are known not to touch x87/SSE/AVX
+    // registers (keep in mind that the compiler might generate SSE
+    // instructions e.g. for memcpy/memset).
+    //
+    // xstate_cycles() is the number of TSC cycles spent by save &
+    // restore for provided exit reason, xstate_count() is the number of
+    // saves and xstate_skip_count() is the number of skipped saves.
+    //
+    auto     xstate_mode() const noexcept { return xstate_mode_; }
+    void     xstate_save(vmx::exit_reason reason, bool enable) noexcept;
+    bool     xstate_save(vmx::exit_reason reason) const noexcept;
+    uint64_t xstate_cycles(vmx::exit_reason reason) const noexcept;
+    uint64_t xstate_count(vmx::exit_reason reason) const noexcept;
+    uint64_t xstate_skip_count(vmx::exit_reason reason) const noexcept;
+
+    //
+    // Fast path of the VM-exit handling.  Fast handler registered for
+    // an exit reason is called at the very beginning of entry_host() -
+    // before the extended processor state is saved and without invoking
+    // the exit handler (vmexit_handler::handle()).  Therefore:
+    //   - fast handlers must not touch x87/SSE/AVX registers (nor call
+    //     anything which might, e.g. memcpy/memset)
+    //   - only general purpose registers of exit_context() are valid
+    //     (use guest_rsp(), guest_rip() and guest_rflags() instead)
+    //   - fast handlers must not write any VMCS field
+    //   - fast handlers must not call terminate()
+    //
+    // If the fast handler returns true, guest RIP is advanced (unless
+    // suppress_rip_adjust() has been called) and the guest is resumed
+    // right away.  If it returns false, the VM-exit continues through
+    // the regular path.
+    //
+    // VM-exits handled by the fast path aren't seen by the exit handler
+    // (therefore neither by vmexit_stats_handler) and they aren't
+    // recorded in the latency histograms.  fast_path_count() is the
+    // number of VM-exits of provided exit reason handled by the fast
+    // path.
+    //
+    void     fast_handler(vmx::exit_reason reason, vmexit_fast_handler_t handler) noexcept;
+    void     fast_path_enable(bool enable) noexcept { fast_path_enabled_ = enable; }
+    bool     fast_path_enabled() const noexcept { return fast_path_enabled_; }
+    uint64_t fast_path_count(vmx::exit_reason reason) const noexcept;
+
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+    //
+    // Histograms of VM-exit latencies by exit reason and sub-reason
+    // (see exit_latency.h).  They are updated at the end of each VM-exit
+    // - readers on other CPUs must use the seqlock of exit_latency_t.
+    //
+    auto exit_latency() const noexcept -> const exit_latency_t& { return exit_latency_; }
+    void exit_latency_reset() noexcept;
+#endif
+
     //
     // VMCS manipulation. Implementation is in vcpu.inl.
     //
@@ -145,6 +371,15 @@ class vcpu_t
     void ept_pointer(ept_ptr_t ept_pointer) noexcept;
     auto vmcs_link_pointer() const noexcept -> pa_t;     // technically, this is guest state
     void vmcs_link_pointer(pa_t link_pointer) noexcept;
+    void pml_address(pa_t pml_address) noexcept;
+    auto vmfunc_controls() const noexcept -> vmx::vmfunc_controls_t;
+    void vmfunc_controls(vmx::vmfunc_controls_t controls) noexcept;
+    void eptp_list_address(pa_t eptp_list_address) noexcept;
+    auto eptp_index() const noexcept -> uint16_t;
+    void eptp_index(uint16_t eptp_index) noexcept;
+    void ve_info_address(pa_t ve_info_address) noexcept;
+    auto guest_pml_index() const noexcept -> uint16_t;   // technically, this is guest state
+    void guest_pml_index(uint16_t pml_index) noexcept;
 
   public:
     auto pin_based_controls() const noexcept -> msr::vmx_pinbased_ctls_t;
@@ -323,12 +558,53 @@ class vcpu_t
     void setup_host() noexcept;
     void setup_guest() noexcept;
 
-    void entry_host() noexcept;
+    bool entry_host(uint64_t exit_tsc) noexcept;
     void entry_guest() noexcept;
 
     static void entry_host_() noexcept;
     static void entry_guest_() noexcept;
 
+    //
+    // Items of the VMCS cache (see vmcs_cache_field_table in vcpu.inl).
+    //
+    enum class vmcs_cache_field : uint32_t
+    {
+      exit_reason,
+      exit_qualification,
+      exit_instruction_info,
+      exit_instruction_length,
+      exit_interruption_info,
+      exit_interruption_error_code,
+      exit_guest_physical_address,
+      exit_guest_linear_address,
+      guest_cr0,
+      guest_cr3,
+      guest_cr4,
+      cr0_shadow,
+      cr4_shadow,
+      guest_rsp,
+      guest_rip,
+      guest_rflags,
+
+      count
+    };
+
+    template <typename T>
+    T    vmcs_cache_read(vmcs_cache_field index) const noexcept;
+
+    template <typename T>
+    void vmcs_cache_write(vmcs_cache_field index, T value) noexcept;
+
+    void vmcs_cache_flush() noexcept;
+
+    void xstate_save_area() noexcept;
+    void xstate_restore_area() noexcept;
+
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+    void exit_latency_begin() noexcept;
+    void exit_latency_end(uint64_t exit_tsc) noexcept;
+#endif
+
     //
     // If you reorder following three members (stack, guest context and exit
     // context), you have to edit offsets in vcpu.asm.
@@ -345,16 +621,79 @@ class vcpu_t
     vmx::vmcs_t        vmcs_;
     vmx::msr_bitmap_t  msr_bitmap_;
     vmx::io_bitmap_t   io_bitmap_;
+    vmx::pml_t         pml_;
+    vmx::eptp_list_t   eptp_list_;
+    vmx::ve_info_t     ve_info_;
 
     //
     // FXSAVE area - to keep SSE registers sane between VM-exits.
+    // XSAVE area is used instead (if allocated, see xstate_mode()).
     //
     fxsave_area_t      fxsave_area_;
+    uint8_t*           xsave_area_;
+    uint32_t           xsave_area_size_;
+    vcpu_xstate_mode   xstate_mode_;
+    vcpu_xstate_mode   xstate_exit_mode_;
+    bool               xstate_saved_;
+    uint32_t           xstate_reason_;
+    uint64_t           xstate_tsc_;
+    bool               xstate_save_[exit_reason_count];
+    uint64_t           xstate_cycles_[exit_reason_count];
+    uint64_t           xstate_count_[exit_reason_count];
+    uint64_t           xstate_skip_count_[exit_reason_count];
+
+    vmexit_fast_handler_t fast_handlers_[exit_reason_count];
+    bool               fast_path_enabled_;
+    uint64_t           fast_path_count_[exit_reason_count];
+
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+    //
+    // Exit reason and sub-reason key of the current VM-exit (determined
+    // before the handler modifies the exit context).
+    //
+    uint32_t           exit_latency_reason_;
+    uint64_t           exit_latency_key_;
+    exit_latency_t     exit_latency_;
+#endif
 
     vmexit_handler*    handler_;
     vcpu_state         state_;
-    ept_t              ept_;
+    ept_t              ept_[ept_view_count];
+    uint16_t           ept_index_;
+    ept_t*             ept_loaded_;
+    bool               ept_vmfunc_enabled_;
+    uint64_t           ept_switch_count_;
+    bool               ve_enabled_;
     bool               suppress_rip_adjust_;
+
+#ifdef HVPP_EPT_COALESCE_INTERVAL
+    std::atomic<bool>  ept_coalesce_requested_;
+#endif
+
+    //
+    // Ring of dirty guest physical addresses drained from the PML.
+    //
+    bool               pml_enabled_;
+    uint32_t           pml_ring_head_;
+    uint32_t           pml_ring_count_;
+    uint64_t           pml_drain_count_;
+    uint64_t           pml_overflow_count_;
+    uint64_t           pml_ring_[pml_ring_size];
+
+    //
+    // Per-exit VMCS cache.  N-th bit of vmcs_cache_valid_ is set if N-th
+    // item of vmcs_cache_ holds value of the field (see vmcs_cache_field),
+    // N-th bit of vmcs_cache_dirty_ is set if the value hasn't been
+    // written to the VMCS yet.
+    //
+    mutable uint64_t   vmcs_cache_[static_cast<uint32_t>(vmcs_cache_field::count)];
+    mutable uint32_t   vmcs_cache_valid_;
+    uint32_t           vmcs_cache_dirty_;
+    mutable uint64_t   vmread_count_;
+    mutable uint64_t   vmread_hit_count_;
+    uint64_t           vmwrite_count_;
+    uint64_t           vmwrite_request_count_;
+    uint64_t           exit_count_;
 };
 
 }
@@ -1,5 +1,94 @@
 namespace hvpp {
 
+//
+// VMCS cache
+//
+
+//
+// VMCS field of each item of the VMCS cache (indexed by
+// vcpu_t::vmcs_cache_field).
+//
+static constexpr vmx::vmcs_t::field vmcs_cache_field_table[] = {
+  vmx::vmcs_t::field::vmexit_reason,
+  vmx::vmcs_t::field::vmexit_qualification,
+  vmx::vmcs_t::field::vmexit_instruction_info,
+  vmx::vmcs_t::field::vmexit_instruction_length,
+  vmx::vmcs_t::field::vmexit_interruption_info,
+  vmx::vmcs_t::field::vmexit_interruption_error_code,
+  vmx::vmcs_t::field::vmexit_guest_physical_address,
+  vmx::vmcs_t::field::vmexit_guest_linear_address,
+  vmx::vmcs_t::field::guest_cr0,
+  vmx::vmcs_t::field::guest_cr3,
+  vmx::vmcs_t::field::guest_cr4,
+  vmx::vmcs_t::field::ctrl_cr0_read_shadow,
+  vmx::vmcs_t::field::ctrl_cr4_read_shadow,
+  vmx::vmcs_t::field::guest_rsp,
+  vmx::vmcs_t::field::guest_rip,
+  vmx::vmcs_t::field::guest_rflags,
+};
+
+template <typename T>
+T vcpu_t::vmcs_cache_read(vmcs_cache_field index) const noexcept
+{
+  static_assert(std::size(vmcs_cache_field_table) == static_cast<uint32_t>(vmcs_cache_field::count));
+
+  const auto i = static_cast<uint32_t>(index);
+
+  vmx::detail::u64_t<T> u{};
+
+  if (vmcs_cache_valid_ & (1u << i))
+  {
+    u.as_uint64_t = vmcs_cache_[i];
+    ++vmread_hit_count_;
+  }
+  else
+  {
+    vmx::vmread(vmcs_cache_field_table[i], u.as_uint64_t);
+    vmcs_cache_[i] = u.as_uint64_t;
+    vmcs_cache_valid_ |= 1u << i;
+    ++vmread_count_;
+  }
+
+  return u.as_value;
+}
+
+template <typename T>
+void vcpu_t::vmcs_cache_write(vmcs_cache_field index, T value) noexcept
+{
+  const auto i = static_cast<uint32_t>(index);
+
+  vmx::detail::u64_t<T> u{};
+  u.as_value = value;
+
+  ++vmwrite_request_count_;
+
+  //
+  // Drop writes of values which are already in the VMCS (or which are
+  // already pending).
+  //
+  if ((vmcs_cache_valid_ & (1u << i)) && vmcs_cache_[i] == u.as_uint64_t)
+  {
+    return;
+  }
+
+  vmcs_cache_[i] = u.as_uint64_t;
+  vmcs_cache_valid_ |= 1u << i;
+  vmcs_cache_dirty_ |= 1u << i;
+}
+
+void vcpu_t::vmcs_cache_flush() noexcept
+{
+  for (uint32_t i = 0; vmcs_cache_dirty_; ++i)
+  {
+    if (vmcs_cache_dirty_ & (1u << i))
+    {
+      vmx::vmwrite(vmcs_cache_field_table[i], vmcs_cache_[i]);
+      vmcs_cache_dirty_ &= ~(1u << i);
+      ++vmwrite_count_;
+    }
+  }
+}
+
 auto vcpu_t::exit_interrupt_info() const noexcept -> interrupt_info_t
 {
   interrupt_info_t result;
@@ -178,6 +267,57 @@ void vcpu_t::vmcs_link_pointer(pa_t link_pointer) noexcept
   vmx::vmwrite(vmx::vmcs_t::field::guest_vmcs_link_pointer, link_pointer);
 }
 
+void vcpu_t::pml_address(pa_t pml_address) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_pml_address, pml_address);
+}
+
+auto vcpu_t::vmfunc_controls() const noexcept -> vmx::vmfunc_controls_t
+{
+  vmx::vmfunc_controls_t result;
+  vmx::vmread(vmx::vmcs_t::field::ctrl_vmfunc_controls, result);
+  return result;
+}
+
+void vcpu_t::vmfunc_controls(vmx::vmfunc_controls_t controls) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_vmfunc_controls, controls);
+}
+
+void vcpu_t::eptp_list_address(pa_t eptp_list_address) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_ept_pointer_list_address, eptp_list_address);
+}
+
+auto vcpu_t::eptp_index() const noexcept -> uint16_t
+{
+  uint16_t result;
+  vmx::vmread(vmx::vmcs_t::field::ctrl_eptp_index, result);
+  return result;
+}
+
+void vcpu_t::eptp_index(uint16_t eptp_index) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_eptp_index, eptp_index);
+}
+
+void vcpu_t::ve_info_address(pa_t ve_info_address) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::ctrl_virtualization_exception_info_address, ve_info_address);
+}
+
+auto vcpu_t::guest_pml_index() const noexcept -> uint16_t
+{
+  uint16_t result;
+  vmx::vmread(vmx::vmcs_t::field::guest_pml_index, result);
+  return result;
+}
+
+void vcpu_t::guest_pml_index(uint16_t pml_index) noexcept
+{
+  vmx::vmwrite(vmx::vmcs_t::field::guest_pml_index, pml_index);
+}
+
 auto vcpu_t::pin_based_controls() const noexcept -> msr::vmx_pinbased_ctls_t
 {
   msr::vmx_pinbased_ctls_t result;
@@ -315,14 +455,12 @@ void vcpu_t::cr0_guest_host_mask(cr0_t cr0) noexcept
 
 auto vcpu_t::cr0_shadow() const noexcept -> cr0_t
 {
-  cr0_t cr0;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_cr0_read_shadow, cr0);
-  return cr0;
+  return vmcs_cache_read<cr0_t>(vmcs_cache_field::cr0_shadow);
 }
 
 void vcpu_t::cr0_shadow(cr0_t cr0) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_cr0_read_shadow, cr0);
+  vmcs_cache_write(vmcs_cache_field::cr0_shadow, cr0);
 }
 
 auto vcpu_t::cr4_guest_host_mask() const noexcept -> cr4_t
@@ -339,14 +477,12 @@ void vcpu_t::cr4_guest_host_mask(cr4_t cr4) noexcept
 
 auto vcpu_t::cr4_shadow() const noexcept -> cr4_t
 {
-  cr4_t cr4;
-  vmx::vmread(vmx::vmcs_t::field::ctrl_cr4_read_shadow, cr4);
-  return cr4;
+  return vmcs_cache_read<cr4_t>(vmcs_cache_field::cr4_shadow);
 }
 
 void vcpu_t::cr4_shadow(cr4_t cr4) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::ctrl_cr4_read_shadow, cr4);
+  vmcs_cache_write(vmcs_cache_field::cr4_shadow, cr4);
 }
 
 auto vcpu_t::entry_instruction_length() const noexcept -> uint32_t
@@ -398,58 +534,42 @@ auto vcpu_t::exit_instruction_error() const noexcept -> vmx::instruction_error
 
 auto vcpu_t::exit_instruction_info() const noexcept -> vmx::instruction_info_t
 {
-  vmx::instruction_info_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_instruction_info, result);
-  return result;
+  return vmcs_cache_read<vmx::instruction_info_t>(vmcs_cache_field::exit_instruction_info);
 }
 
 auto vcpu_t::exit_instruction_length() const noexcept -> uint32_t
 {
-  uint32_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_instruction_length, result);
-  return result;
+  return vmcs_cache_read<uint32_t>(vmcs_cache_field::exit_instruction_length);
 }
 
 auto vcpu_t::exit_interruption_info() const noexcept -> vmx::interrupt_info_t
 {
-  vmx::interrupt_info_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_interruption_info, result);
-  return result;
+  return vmcs_cache_read<vmx::interrupt_info_t>(vmcs_cache_field::exit_interruption_info);
 }
 
 auto vcpu_t::exit_interruption_error_code() const noexcept -> exception_error_code_t
 {
-  exception_error_code_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_interruption_error_code, result);
-  return result;
+  return vmcs_cache_read<exception_error_code_t>(vmcs_cache_field::exit_interruption_error_code);
 }
 
 auto vcpu_t::exit_reason() const noexcept -> vmx::exit_reason
 {
-  vmx::exit_reason result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_reason, result);
-  return result;
+  return vmcs_cache_read<vmx::exit_reason>(vmcs_cache_field::exit_reason);
 }
 
 auto vcpu_t::exit_qualification() const noexcept -> vmx::exit_qualification_t
 {
-  vmx::exit_qualification_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_qualification, result);
-  return result;
+  return vmcs_cache_read<vmx::exit_qualification_t>(vmcs_cache_field::exit_qualification);
 }
 
 auto vcpu_t::exit_guest_physical_address() const noexcept -> pa_t
 {
-  pa_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_guest_physical_address, result);
-  return result;
+  return vmcs_cache_read<pa_t>(vmcs_cache_field::exit_guest_physical_address);
 }
 
 auto vcpu_t::exit_guest_linear_address() const noexcept -> la_t
 {
-  la_t result;
-  vmx::vmread(vmx::vmcs_t::field::vmexit_guest_linear_address, result);
-  return result;
+  return vmcs_cache_read<la_t>(vmcs_cache_field::exit_guest_linear_address);
 }
 
 //
@@ -458,38 +578,32 @@ auto vcpu_t::exit_guest_linear_address() const noexcept -> la_t
 
 auto vcpu_t::guest_cr0() const noexcept -> cr0_t
 {
-  cr0_t cr0;
-  vmx::vmread(vmx::vmcs_t::field::guest_cr0, cr0);
-  return cr0;
+  return vmcs_cache_read<cr0_t>(vmcs_cache_field::guest_cr0);
 }
 
 void vcpu_t::guest_cr0(cr0_t cr0) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_cr0, cr0);
+  vmcs_cache_write(vmcs_cache_field::guest_cr0, cr0);
 }
 
 auto vcpu_t::guest_cr3() const noexcept -> cr3_t
 {
-  cr3_t cr3;
-  vmx::vmread(vmx::vmcs_t::field::guest_cr3, cr3);
-  return cr3;
+  return vmcs_cache_read<cr3_t>(vmcs_cache_field::guest_cr3);
 }
 
 void vcpu_t::guest_cr3(cr3_t cr3) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_cr3, cr3);
+  vmcs_cache_write(vmcs_cache_field::guest_cr3, cr3);
 }
 
 auto vcpu_t::guest_cr4() const noexcept -> cr4_t
 {
-  cr4_t cr4;
-  vmx::vmread(vmx::vmcs_t::field::guest_cr4, cr4);
-  return cr4;
+  return vmcs_cache_read<cr4_t>(vmcs_cache_field::guest_cr4);
 }
 
 void vcpu_t::guest_cr4(cr4_t cr4) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_cr4, cr4);
+  vmcs_cache_write(vmcs_cache_field::guest_cr4, cr4);
 }
 
 auto vcpu_t::guest_dr7() const noexcept -> dr7_t
@@ -519,38 +633,32 @@ void vcpu_t::guest_debugctl(msr::debugctl_t debugctl) noexcept
 
 auto vcpu_t::guest_rsp() const noexcept -> uint64_t
 {
-  uint64_t rsp;
-  vmx::vmread(vmx::vmcs_t::field::guest_rsp, rsp);
-  return rsp;
+  return vmcs_cache_read<uint64_t>(vmcs_cache_field::guest_rsp);
 }
 
 void vcpu_t::guest_rsp(uint64_t rsp) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_rsp, rsp);
+  vmcs_cache_write(vmcs_cache_field::guest_rsp, rsp);
 }
 
 auto vcpu_t::guest_rip() const noexcept -> uint64_t
 {
-  uint64_t rip;
-  vmx::vmread(vmx::vmcs_t::field::guest_rip, rip);
-  return rip;
+  return vmcs_cache_read<uint64_t>(vmcs_cache_field::guest_rip);
 }
 
 void vcpu_t::guest_rip(uint64_t rip) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_rip, rip);
+  vmcs_cache_write(vmcs_cache_field::guest_rip, rip);
 }
 
 auto vcpu_t::guest_rflags() const noexcept -> rflags_t
 {
-  rflags_t rflags;
-  vmx::vmread(vmx::vmcs_t::field::guest_rflags, rflags);
-  return rflags;
+  return vmcs_cache_read<rflags_t>(vmcs_cache_field::guest_rflags);
 }
 
 void vcpu_t::guest_rflags(rflags_t rflags) noexcept
 {
-  vmx::vmwrite(vmx::vmcs_t::field::guest_rflags, rflags);
+  vmcs_cache_write(vmcs_cache_field::guest_rflags, rflags);
 }
 
 auto vcpu_t::guest_gdtr() const noexcept -> gdtr_t
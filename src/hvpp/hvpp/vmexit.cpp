@@ -164,6 +164,11 @@ void vmexit_handler::invoke_termination() noexcept
 
 }
 
+void vmexit_handler::teardown(vcpu_t& vp) noexcept
+{
+  (void)vp;
+}
+
 //
 // "Do-nothing" handlers for all VM-exits.
 // VMX-instruction related VM-exits (VMREAD, VMWRITE, INVEPT, ...)
@@ -158,10 +158,24 @@ class vmexit_handler
     //
     virtual void invoke_termination() noexcept;
 
-  protected:
+    //
+    // This method is called from vcpu_t::destroy() method after
+    // invoke_termination(), before the VCPU releases its EPTs.
+    // Use this method for releasing per-VCPU resources which
+    // reference them (e.g. EPT views attached to them).
+    //
+    // Note that this method is not called in VMX-root mode.
+    //
+    virtual void teardown(vcpu_t& vp) noexcept;
+
     //
     // Separate handlers for each VM-exit reason.
     //
+    // These methods are public, so that vmexit_compositor_handler can
+    // detect which of them are overridden by its children and call them
+    // directly (see vmexit_reason_traits).  Derived handlers should keep
+    // their overrides public too.
+    //
     virtual void handle_exception_or_nmi(vcpu_t& vp) noexcept;
     virtual void handle_external_interrupt(vcpu_t& vp) noexcept;
     virtual void handle_triple_fault(vcpu_t& vp) noexcept;
@@ -947,6 +947,21 @@ inject_general_protection:
   vp.suppress_rip_adjust();
 }
 
+void vmexit_passthrough_handler::handle_page_modification_log_full(vcpu_t& vp) noexcept
+{
+  //
+  // Move logged addresses into the dirty ring of the VCPU and reset
+  // the PML index.
+  //
+  vp.pml_drain();
+
+  //
+  // The write which caused this VM-exit hasn't been performed yet
+  // (the VM-exit is fault-like) - execute the instruction again.
+  //
+  vp.suppress_rip_adjust();
+}
+
 void vmexit_passthrough_handler::handle_execute_vmclear(vcpu_t& vp) noexcept
 { handle_vm_fallback(vp); }
 
@@ -981,7 +996,23 @@ void vmexit_passthrough_handler::handle_execute_invvpid(vcpu_t& vp) noexcept
 { handle_vm_fallback(vp); }
 
 void vmexit_passthrough_handler::handle_execute_vmfunc(vcpu_t& vp) noexcept
-{ handle_vm_fallback(vp); }
+{
+  //
+  // VMFUNC causes VM-exit if the requested VM function isn't enabled or
+  // if the EPTP list entry selected by ECX isn't valid.  Emulate EPTP
+  // switching (VM function 0) between existing EPT views - this way the
+  // guest can use VMFUNC even if the CPU doesn't support EPTP switching
+  // (each switch costs VM-exit, though).
+  //
+  if (vp.exit_context().eax == 0 &&
+      vp.exit_context().ecx < vcpu_t::ept_view_count)
+  {
+    vp.ept_index(static_cast<uint16_t>(vp.exit_context().ecx));
+    return;
+  }
+
+  handle_vm_fallback(vp);
+}
 
 void vmexit_passthrough_handler::handle_vm_fallback(vcpu_t& vp) noexcept
 {
@@ -17,7 +17,6 @@ class vmexit_passthrough_handler
     void setup(vcpu_t& vp) noexcept override;
     void invoke_termination() noexcept override;
 
-  protected:
     void handle_exception_or_nmi(vcpu_t& vp) noexcept override;
     void handle_triple_fault(vcpu_t& vp) noexcept override;
     void handle_execute_cpuid(vcpu_t& vp) noexcept override;
@@ -37,6 +36,7 @@ class vmexit_passthrough_handler
     void handle_execute_wbinvd(vcpu_t& vp) noexcept override;
     void handle_execute_xsetbv(vcpu_t& vp) noexcept override;
     void handle_execute_invpcid(vcpu_t& vp) noexcept override;
+    void handle_page_modification_log_full(vcpu_t& vp) noexcept override;
 
     //
     // VM-instructions.
@@ -66,6 +66,10 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
   auto  exit_reason = vp.exit_reason();
   auto& stats       = storage_[mp::cpu_index()];
 
+  //
+  // Statistics might be read concurrently (see vmexit_stats_storage_t::snapshot()).
+  //
+  stats.write_begin();
   stats.vmexit[static_cast<int>(exit_reason)] += 1;
 
   switch (exit_reason)
@@ -85,19 +89,7 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
       break;
 
     case vmx::exit_reason::execute_cpuid:
-      if (vp.exit_context().eax < (0x0000'0000u + vmexit_stats_storage_t::cpuid_0_max))
-      {
-        stats.cpuid_0[vp.exit_context().eax] += 1;
-      }
-      else if (vp.exit_context().eax >= 0x8000'0000u &&
-               vp.exit_context().eax < (0x8000'0000u + vmexit_stats_storage_t::cpuid_8_max))
-      {
-        stats.cpuid_8[vp.exit_context().eax - 0x8000'0000u] += 1;
-      }
-      else
-      {
-        stats.cpuid_other += 1;
-      }
+      stats.cpuid.add(vp.exit_context().eax);
 
       hvpp_trace_if_enabled("exit_reason::execute_cpuid: 0x%08x", vp.exit_context().eax);
       break;
@@ -176,7 +168,7 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
       switch (vp.exit_qualification().io_instruction.access_type)
       {
         case vmx::exit_qualification_io_instruction_t::access_out:
-          stats.io_out[vp.exit_qualification().io_instruction.port_number] += 1;
+          stats.io_out.add(vp.exit_qualification().io_instruction.port_number);
 
           hvpp_trace_if_enabled(
             "exit_reason::execute_io_instruction: out 0x%04x",
@@ -184,7 +176,7 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
           break;
 
         case vmx::exit_qualification_io_instruction_t::access_in:
-          stats.io_in[vp.exit_qualification().io_instruction.port_number] += 1;
+          stats.io_in.add(vp.exit_qualification().io_instruction.port_number);
 
           hvpp_trace_if_enabled(
             "exit_reason::execute_io_instruction: in 0x%04x",
@@ -194,36 +186,12 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
       break;
 
     case vmx::exit_reason::execute_rdmsr:
-      if (vp.exit_context().ecx <= 0x0000'1fffu)
-      {
-        stats.rdmsr_0[vp.exit_context().ecx] += 1;
-      }
-      else if (vp.exit_context().ecx >= 0xc000'0000u &&
-               vp.exit_context().ecx <= 0xc000'1fffu)
-      {
-        stats.rdmsr_c[vp.exit_context().ecx - 0xc000'0000u] += 1;
-      }
-      else
-      {
-        stats.rdmsr_other += 1;
-      }
+      stats.rdmsr.add(vp.exit_context().ecx);
       hvpp_trace_if_enabled("exit_reason::execute_rdmsr: 0x%08x", vp.exit_context().ecx);
       break;
 
     case vmx::exit_reason::execute_wrmsr:
-      if (vp.exit_context().ecx <= 0x0000'1fffu)
-      {
-        stats.wrmsr_0[vp.exit_context().ecx] += 1;
-      }
-      else if (vp.exit_context().ecx >= 0xc000'0000u &&
-               vp.exit_context().ecx <= 0xc000'1fffu)
-      {
-        stats.wrmsr_c[vp.exit_context().ecx - 0xc000'0000u] += 1;
-      }
-      else
-      {
-        stats.wrmsr_other += 1;
-      }
+      stats.wrmsr.add(vp.exit_context().ecx);
 
       hvpp_trace_if_enabled("exit_reason::execute_wrmsr: 0x%08x", vp.exit_context().ecx);
       break;
@@ -268,6 +236,8 @@ void vmexit_stats_handler::handle(vcpu_t& vp) noexcept
       hvpp_trace_if_enabled("exit_reason::execute_invpcid");
       break;
   }
+
+  stats.write_end();
 }
 
 void vmexit_stats_handler::dump() noexcept
@@ -284,7 +254,7 @@ void vmexit_stats_handler::dump() noexcept
   //
   for (uint32_t i = 0; i < mp::cpu_count(); ++i)
   {
-    storage_merge(storage_merged_, storage_[i]);
+    storage_merged_.merge(storage_[i]);
   }
 
   //
@@ -294,37 +264,49 @@ void vmexit_stats_handler::dump() noexcept
   storage_dump(storage_merged_);
 }
 
-void vmexit_stats_handler::storage_merge(vmexit_stats_storage_t& lhs, const vmexit_stats_storage_t& rhs) const noexcept
+namespace {
+
+//
+// Dump used slots of the table, ordered by their keys.
+//
+template <uint32_t CAPACITY>
+void storage_dump_table(const vmexit_stats_table_t<CAPACITY>& table, const char* format) noexcept
 {
-#define STORAGE_MERGE_IMPL(name)                      \
-  for (uint32_t i = 0; i < std::size(lhs.name); ++i)  \
-  {                                                   \
-    lhs.name[i] += rhs.name[i];                       \
+  //
+  // Tables are small - instead of sorting them, just repeatedly pick
+  // the lowest key greater than the previously printed one.
+  //
+  uint64_t previous_key = 0;
+
+  for (;;)
+  {
+    uint32_t index = CAPACITY;
+
+    for (uint32_t i = 0; i < CAPACITY; ++i)
+    {
+      if (table.is_used(i) &&
+          (table.key[i] > previous_key) &&
+          (index == CAPACITY || table.key[i] < table.key[index]))
+      {
+        index = i;
+      }
+    }
+
+    if (index == CAPACITY)
+    {
+      break;
+    }
+
+    hvpp_info(format, table.key_at(index), table.count[index]);
+    previous_key = table.key[index];
+  }
+
+  if (table.other > 0)
+  {
+    hvpp_info("    (OTHER): %llu", table.other);
   }
+}
 
-  STORAGE_MERGE_IMPL(vmexit);
-  STORAGE_MERGE_IMPL(expt_vector);
-  STORAGE_MERGE_IMPL(cpuid_0);
-  STORAGE_MERGE_IMPL(cpuid_8);
-  lhs.cpuid_other += rhs.cpuid_other;
-  STORAGE_MERGE_IMPL(mov_from_cr);
-  STORAGE_MERGE_IMPL(mov_to_cr);
-  lhs.clts += rhs.clts;
-  lhs.lmsw += rhs.lmsw;
-  STORAGE_MERGE_IMPL(mov_from_dr);
-  STORAGE_MERGE_IMPL(mov_to_dr);
-  STORAGE_MERGE_IMPL(gdtr_idtr);
-  STORAGE_MERGE_IMPL(ldtr_tr);
-  STORAGE_MERGE_IMPL(io_in);
-  STORAGE_MERGE_IMPL(io_out);
-  STORAGE_MERGE_IMPL(rdmsr_0);
-  STORAGE_MERGE_IMPL(rdmsr_c);
-  lhs.rdmsr_other += rhs.rdmsr_other;
-  STORAGE_MERGE_IMPL(wrmsr_0);
-  STORAGE_MERGE_IMPL(wrmsr_c);
-  lhs.wrmsr_other += rhs.wrmsr_other;
-
-#undef STORAGE_MERGE_IMPL
 }
 
 void vmexit_stats_handler::storage_dump(const vmexit_stats_storage_t& storage_to_dump) const noexcept
@@ -336,7 +318,7 @@ void vmexit_stats_handler::storage_dump(const vmexit_stats_storage_t& storage_to
   {
     if (stats.vmexit[exit_reason_index] > 0)
     {
-      hvpp_info("  %s: %u",
+      hvpp_info("  %s: %llu",
         vmx::exit_reason_to_string(static_cast<vmx::exit_reason>(exit_reason_index)),
         stats.vmexit[exit_reason_index]);
 
@@ -349,32 +331,13 @@ void vmexit_stats_handler::storage_dump(const vmexit_stats_storage_t& storage_to
             (void)(expt_vector_string);
             if (stats.expt_vector[i] > 0)
             {
-              hvpp_info("    %s: %u", expt_vector_string, stats.expt_vector[i]);
+              hvpp_info("    %s: %llu", expt_vector_string, stats.expt_vector[i]);
             }
           }
           break;
 
         case vmx::exit_reason::execute_cpuid:
-          for (uint32_t i = 0; i < std::size(stats.cpuid_0); ++i)
-          {
-            if (stats.cpuid_0[i] > 0)
-            {
-              hvpp_info("    0x%08x: %u", i, stats.cpuid_0[i]);
-            }
-          }
-
-          for (uint32_t i = 0; i < std::size(stats.cpuid_8); ++i)
-          {
-            if (stats.cpuid_8[i] > 0)
-            {
-              hvpp_info("    0x%08x: %u", i + 0x8000'0000u, stats.cpuid_8[i]);
-            }
-          }
-
-          if (stats.cpuid_other > 0)
-          {
-            hvpp_info("    0x(OTHER): %u", stats.cpuid_other);
-          }
+          storage_dump_table(stats.cpuid, "    0x%08x: %llu");
           break;
 
         case vmx::exit_reason::mov_cr:
@@ -382,7 +345,7 @@ void vmexit_stats_handler::storage_dump(const vmexit_stats_storage_t& storage_to
           {
             if (stats.mov_from_cr[i] > 0)
             {
-              hvpp_info("    mov_from_cr[%i]: %u", i, stats.mov_from_cr[i]);
+              hvpp_info("    mov_from_cr[%i]: %llu", i, stats.mov_from_cr[i]);
             }
           }
 
@@ -390,18 +353,18 @@ void vmexit_stats_handler::storage_dump(const vmexit_stats_storage_t& storage_to
           {
             if (stats.mov_to_cr[i] > 0)
             {
-              hvpp_info("    mov_to_cr[%i]: %u", i, stats.mov_to_cr[i]);
+              hvpp_info("    mov_to_cr[%i]: %llu", i, stats.mov_to_cr[i]);
             }
           }
 
-          if (stats.lmsw > 0)
+          if (stats.clts > 0)
           {
-            hvpp_info("    clts: %u", stats.clts);
+            hvpp_info("    clts: %llu", stats.clts);
           }
 
           if (stats.lmsw > 0)
           {
-            hvpp_info("    lmsw: %u", stats.lmsw);
+            hvpp_info("    lmsw: %llu", stats.lmsw);
           }
           break;
 
@@ -410,7 +373,7 @@ void vmexit_stats_handler::storage_dump(const vmexit_stats_storage_t& storage_to
           {
             if (stats.mov_from_dr[i] > 0)
             {
-              hvpp_info("    mov_from_dr[%i]: %u", i, stats.mov_from_dr[i]);
+              hvpp_info("    mov_from_dr[%i]: %llu", i, stats.mov_from_dr[i]);
             }
           }
 
@@ -418,7 +381,7 @@ void vmexit_stats_handler::storage_dump(const vmexit_stats_storage_t& storage_to
           {
             if (stats.mov_to_dr[i] > 0)
             {
-              hvpp_info("    mov_to_dr[%i]: %u", i, stats.mov_to_dr[i]);
+              hvpp_info("    mov_to_dr[%i]: %llu", i, stats.mov_to_dr[i]);
             }
           }
           break;
@@ -428,7 +391,7 @@ void vmexit_stats_handler::storage_dump(const vmexit_stats_storage_t& storage_to
           {
             if (stats.gdtr_idtr[i] > 0)
             {
-              hvpp_info("    %s: %u", vmx::instruction_info_gdtr_idtr_to_string(i), stats.gdtr_idtr[i]);
+              hvpp_info("    %s: %llu", vmx::instruction_info_gdtr_idtr_to_string(i), stats.gdtr_idtr[i]);
             }
           }
           break;
@@ -438,73 +401,22 @@ void vmexit_stats_handler::storage_dump(const vmexit_stats_storage_t& storage_to
           {
             if (stats.ldtr_tr[i] > 0)
             {
-              hvpp_info("    %s: %u", vmx::instruction_info_ldtr_tr_to_string(i), stats.ldtr_tr[i]);
+              hvpp_info("    %s: %llu", vmx::instruction_info_ldtr_tr_to_string(i), stats.ldtr_tr[i]);
             }
           }
           break;
 
         case vmx::exit_reason::execute_io_instruction:
-          for (uint32_t i = 0; i < std::size(stats.io_in); ++i)
-          {
-            if (stats.io_in[i] > 0)
-            {
-              hvpp_info("    in (0x%04x): %u", i, stats.io_in[i]);
-            }
-          }
-
-          for (uint32_t i = 0; i < std::size(stats.io_out); ++i)
-          {
-            if (stats.io_out[i] > 0)
-            {
-              hvpp_info("    out (0x%04x): %u", i, stats.io_out[i]);
-            }
-          }
+          storage_dump_table(stats.io_in,  "    in (0x%04x): %llu");
+          storage_dump_table(stats.io_out, "    out (0x%04x): %llu");
           break;
 
         case vmx::exit_reason::execute_rdmsr:
-          for (uint32_t i = 0; i < std::size(stats.rdmsr_0); ++i)
-          {
-            if (stats.rdmsr_0[i])
-            {
-              hvpp_info("    0x%08x: %u", i, stats.rdmsr_0[i]);
-            }
-          }
-
-          for (uint32_t i = 0; i < std::size(stats.rdmsr_c); ++i)
-          {
-            if (stats.rdmsr_c[i])
-            {
-              hvpp_info("    0x%08x: %u", i + 0xc000'0000u, stats.rdmsr_c[i]);
-            }
-          }
-
-          if (stats.rdmsr_other > 0)
-          {
-            hvpp_info("    (OTHER): %u", stats.rdmsr_other);
-          }
+          storage_dump_table(stats.rdmsr, "    0x%08x: %llu");
           break;
 
         case vmx::exit_reason::execute_wrmsr:
-          for (uint32_t i = 0; i < std::size(stats.wrmsr_0); ++i)
-          {
-            if (stats.wrmsr_0[i])
-            {
-              hvpp_info("    0x%08x: %u", i, stats.wrmsr_0[i]);
-            }
-          }
-
-          for (uint32_t i = 0; i < std::size(stats.wrmsr_c); ++i)
-          {
-            if (stats.wrmsr_c[i])
-            {
-              hvpp_info("    0x%08x: %u", i + 0xc000'0000u, stats.wrmsr_c[i]);
-            }
-          }
-
-          if (stats.wrmsr_other > 0)
-          {
-            hvpp_info("    (OTHER): %u", stats.wrmsr_other);
-          }
+          storage_dump_table(stats.wrmsr, "    0x%08x: %llu");
           break;
       }
     }
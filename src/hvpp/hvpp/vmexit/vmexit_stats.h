@@ -1,5 +1,6 @@
 #pragma once
 #include "hvpp/vmexit.h"
+#include "vmexit_stats_storage.h"
 
 #include "lib/bitmap.h"
 
@@ -7,13 +8,6 @@
 
 namespace hvpp {
 
-//
-// Structure for storing statistics about VM-exits.
-// Each member of the vmexit_storage_t structure
-// is treated as VM-exit counter.
-//
-using vmexit_stats_storage_t = vmexit_storage_t<uint32_t>;
-
 //
 // Simple VM-exit handler which performs statistics about VM-exits
 // and also allows their tracing (by hvpp_trace()).
@@ -37,11 +31,6 @@ class vmexit_stats_handler
     void dump() noexcept;
 
   private:
-    //
-    // Update "lhs" stats by adding to them values of "rhs" stats.
-    //
-    void storage_merge(vmexit_stats_storage_t& lhs, const vmexit_stats_storage_t& rhs) const noexcept;
-
     //
     // Dump this stats structure.
     //
@@ -0,0 +1,273 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+//
+// Storage of VM-exit statistics.
+//
+// This header doesn't depend on any other hvpp header, so that it can be
+// included by user-mode tools (e.g. hvppctrl) which read the statistics.
+//
+// See vmexit_stats_handler.
+//
+
+namespace hvpp {
+
+//
+// Small open-addressing table of 64-bit counters keyed by 32-bit value
+// (CPUID leaf, I/O port, MSR number).
+//
+// Slots are assigned in order in which the keys occur and they're never
+// freed.  If the table is full, the counter is added to "other" instead.
+// Key is stored incremented by 1, so that zeroed table is empty table -
+// the key 0xffff'ffff therefore can't be stored and it is always counted
+// in "other".
+//
+template <uint32_t CAPACITY>
+struct vmexit_stats_table_t
+{
+  static_assert((CAPACITY & (CAPACITY - 1)) == 0,
+                "CAPACITY must be power of 2");
+
+  static constexpr uint32_t capacity = CAPACITY;
+
+  uint64_t count[capacity];
+  uint32_t key[capacity];
+  uint64_t other;
+
+  bool is_used(uint32_t index) const noexcept
+  { return key[index] != 0; }
+
+  uint32_t key_at(uint32_t index) const noexcept
+  { return key[index] - 1; }
+
+  void add(uint32_t key_value, uint64_t value = 1) noexcept
+  {
+    if (auto counter = find(key_value, true))
+    {
+      *counter += value;
+    }
+    else
+    {
+      other += value;
+    }
+  }
+
+  void merge(const vmexit_stats_table_t& other_table) noexcept
+  {
+    for (uint32_t i = 0; i < capacity; ++i)
+    {
+      if (other_table.is_used(i))
+      {
+        add(other_table.key_at(i), other_table.count[i]);
+      }
+    }
+
+    other += other_table.other;
+  }
+
+  //
+  // Returns pointer to the counter of the key.  If the key isn't in the
+  // table and insert is true, free slot is assigned to it.  Returns
+  // nullptr if the key hasn't been found and it couldn't be inserted.
+  //
+  uint64_t* find(uint32_t key_value, bool insert) noexcept
+  {
+    constexpr auto mask = capacity - 1;
+
+    const auto stored_key = key_value + 1;
+
+    if (!stored_key)
+    {
+      return nullptr;
+    }
+
+    auto index = static_cast<uint32_t>((stored_key * 0x9e3779b97f4a7c15) >> 32) & mask;
+
+    for (uint32_t i = 0; i < capacity; ++i, index = (index + 1) & mask)
+    {
+      if (key[index] == stored_key)
+      {
+        return &count[index];
+      }
+
+      if (!key[index])
+      {
+        if (!insert)
+        {
+          return nullptr;
+        }
+
+        key[index] = stored_key;
+        return &count[index];
+      }
+    }
+
+    return nullptr;
+  }
+};
+
+//
+// Statistics of single CPU.  Each counter is 64-bit, so that it doesn't
+// wrap even at very high VM-exit rates.
+//
+// Statistics of each CPU begin on separate page, so that VCPUs don't
+// share cache lines when updating them and so that they can be mapped
+// into the guest (see vmexit_custom_handler, vmcall 0xd2).  The most
+// frequently updated counters (sequence, vmexit) are at the beginning
+// of the structure.
+//
+// Zeroed structure represents empty statistics.
+//
+struct alignas(4096) vmexit_stats_storage_t
+{
+  //
+  // Sequence counter (seqlock).  The owning VCPU increments it before
+  // and after each update, therefore it's odd while the update is in
+  // progress.  Readers on other CPUs take consistent copy by snapshot()
+  // without stopping the VCPU.
+  //
+  uint64_t                    sequence;
+
+  //
+  // Counter for each VM-exit reason (ia32::vmx::exit_reason).
+  // Currently the highest ID of exit reason is 65.
+  //
+  uint64_t                    vmexit[65];
+
+  //
+  // Counter for each exception vector (ia32::exception_vector).
+  // This is subcategory of exit_reason::exception_or_nmi (0).
+  //
+  uint64_t                    expt_vector[20];
+
+  //
+  // Counter for each MOV CR (from/to), CLTS and LMSW instruction.
+  // Each array item in mov_from_cr/mov_to_cr represents counter for
+  // specific CRn register.
+  // This is subcategory of exit_reason::mov_cr (28).
+  //
+  uint64_t                    mov_from_cr[8];
+  uint64_t                    mov_to_cr[8];
+  uint64_t                    clts;
+  uint64_t                    lmsw;
+
+  //
+  // Counter for each MOV DR (from/to) instruction.
+  // This is subcategory of exit_reason::mov_dr (29).
+  //
+  uint64_t                    mov_from_dr[8];
+  uint64_t                    mov_to_dr[8];
+
+  //
+  // Counter for each SGDT, SIDT, LGDT and LIDT instruction (see
+  // instruction_info_gdtr_idtr_access) and for each SLDT, STR, LLDT
+  // and LTR instruction (see instruction_info_ldtr_tr_access).
+  // This is subcategory of exit_reason::gdtr_idtr_access (46)
+  //                    and exit_reason::ldtr_tr_access (47).
+  //
+  uint64_t                    gdtr_idtr[4];
+  uint64_t                    ldtr_tr[4];
+
+  //
+  // Counter for each CPUID leaf (eax).
+  // This is subcategory of exit_reason::execute_cpuid (10).
+  //
+  vmexit_stats_table_t<64>    cpuid;
+
+  //
+  // Counter for each I/O port of IN/OUT (INS/OUTS) instructions.
+  // This is subcategory of exit_reason::execute_io_instruction (30).
+  //
+  vmexit_stats_table_t<128>   io_in;
+  vmexit_stats_table_t<128>   io_out;
+
+  //
+  // Counter for each MSR number of RDMSR/WRMSR instructions.
+  // This is subcategory of exit_reason::execute_rdmsr (31)
+  //                    and exit_reason::execute_wrmsr (32).
+  //
+  vmexit_stats_table_t<128>   rdmsr;
+  vmexit_stats_table_t<128>   wrmsr;
+
+  //
+  // Writer side of the seqlock - must be called by the owning VCPU
+  // around each update.  x86 doesn't reorder stores with other stores,
+  // therefore only the compiler has to be prevented from reordering.
+  //
+  void write_begin() noexcept
+  {
+    *static_cast<volatile uint64_t*>(&sequence) = sequence + 1;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  }
+
+  void write_end() noexcept
+  {
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    *static_cast<volatile uint64_t*>(&sequence) = sequence + 1;
+  }
+
+  //
+  // Reader side of the seqlock - copy these stats into "destination"
+  // and retry if the owning VCPU has updated them meanwhile.  x86
+  // doesn't reorder loads with other loads, therefore only the compiler
+  // has to be prevented from reordering.
+  //
+  void snapshot(vmexit_stats_storage_t& destination) const noexcept
+  {
+    for (;;)
+    {
+      auto sequence_begin = *static_cast<const volatile uint64_t*>(&sequence);
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+
+      if (sequence_begin & 1)
+      {
+        continue;
+      }
+
+      memcpy(&destination, this, sizeof(destination));
+
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      auto sequence_end = *static_cast<const volatile uint64_t*>(&sequence);
+
+      if (sequence_begin == sequence_end)
+      {
+        break;
+      }
+    }
+  }
+
+  //
+  // Update these stats by adding to them values of "other" stats.
+  // The sequence counter isn't touched.
+  //
+  void merge(const vmexit_stats_storage_t& other) noexcept
+  {
+    //
+    // Dense counters (everything from vmexit up to the first table) are
+    // merged as one flat array of 64-bit counters - the compiler
+    // vectorizes this loop.  Tables are merged by visiting only their
+    // used slots.
+    //
+    constexpr auto dense_count = (offsetof(vmexit_stats_storage_t, cpuid) -
+                                  offsetof(vmexit_stats_storage_t, vmexit)) / sizeof(uint64_t);
+
+    auto lhs = &vmexit[0];
+    auto rhs = &other.vmexit[0];
+
+    for (uint32_t i = 0; i < dense_count; ++i)
+    {
+      lhs[i] += rhs[i];
+    }
+
+    cpuid.merge(other.cpuid);
+    io_in.merge(other.io_in);
+    io_out.merge(other.io_out);
+    rdmsr.merge(other.rdmsr);
+    wrmsr.merge(other.wrmsr);
+  }
+};
+
+}
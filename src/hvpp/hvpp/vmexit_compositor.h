@@ -1,12 +1,146 @@
 #pragma once
+#include "config.h"
 #include "vmexit.h"
+#include "vcpu.h"
 
+#include "lib/log.h"
+#include "lib/mp.h"
 #include "lib/typelist.h"
 
+#include <array>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 
 namespace hvpp
 {
+  //
+  // Type of the VM-exit handler methods of vmexit_handler.
+  //
+  using vmexit_handler_method_t = void (vmexit_handler::*)(vcpu_t&) noexcept;
+
+  //
+  // Returns true if handler T overrides the handle() method.
+  //
+  template <typename T>
+  constexpr bool vmexit_overrides_handle_v =
+    !std::is_same_v<decltype(&T::handle), vmexit_handler_method_t>;
+
+  //
+  // Primary template describes reserved exit reasons - these are handled
+  // by handle_fallback() (see vmexit_handler::vmexit_handler()).
+  //
+  // handled_by<T> is true if handler T overrides the method for this
+  // exit reason (or the fallback method this exit reason ends up in).
+  // handle() calls the method of T directly (non-virtually).  Only the
+  // public interface of T is used - handler methods of vmexit_handler
+  // are public and so must be their overrides.
+  //
+  template <int EXIT_REASON>
+  struct vmexit_reason_traits
+  {
+    template <typename T>
+    static constexpr bool handled_by =
+      !std::is_same_v<decltype(&T::handle_fallback), vmexit_handler_method_t>;
+
+    template <typename T>
+    static void handle(T& handler, vcpu_t& vp) noexcept
+    { handler.T::handle_fallback(vp); }
+  };
+
+#define HVPP_VMEXIT_REASON_TRAITS(reason, method, fallback)                         \
+  template <>                                                                       \
+  struct vmexit_reason_traits<static_cast<int>(vmx::exit_reason::reason)>           \
+  {                                                                                 \
+    template <typename T>                                                           \
+    static constexpr bool handled_by =                                              \
+      !std::is_same_v<decltype(&T::method), vmexit_handler_method_t> ||             \
+      !std::is_same_v<decltype(&T::fallback), vmexit_handler_method_t>;             \
+                                                                                    \
+    template <typename T>                                                           \
+    static void handle(T& handler, vcpu_t& vp) noexcept                             \
+    { handler.T::method(vp); }                                                      \
+  }
+
+  HVPP_VMEXIT_REASON_TRAITS(exception_or_nmi,             handle_exception_or_nmi,             handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(external_interrupt,           handle_external_interrupt,           handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(triple_fault,                 handle_triple_fault,                 handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(init_signal,                  handle_init_signal,                  handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(startup_ipi,                  handle_startup_ipi,                  handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(io_smi,                       handle_io_smi,                       handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(smi,                          handle_smi,                          handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(interrupt_window,             handle_interrupt_window,             handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(nmi_window,                   handle_nmi_window,                   handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(task_switch,                  handle_task_switch,                  handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_cpuid,                handle_execute_cpuid,                handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_getsec,               handle_execute_getsec,               handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_hlt,                  handle_execute_hlt,                  handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_invd,                 handle_execute_invd,                 handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_invlpg,               handle_execute_invlpg,               handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_rdpmc,                handle_execute_rdpmc,                handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_rdtsc,                handle_execute_rdtsc,                handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_rsm_in_smm,           handle_execute_rsm_in_smm,           handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_vmcall,               handle_execute_vmcall,               handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_vmclear,              handle_execute_vmclear,              handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_vmlaunch,             handle_execute_vmlaunch,             handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_vmptrld,              handle_execute_vmptrld,              handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_vmptrst,              handle_execute_vmptrst,              handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_vmread,               handle_execute_vmread,               handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_vmresume,             handle_execute_vmresume,             handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_vmwrite,              handle_execute_vmwrite,              handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_vmxoff,               handle_execute_vmxoff,               handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_vmxon,                handle_execute_vmxon,                handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(mov_cr,                       handle_mov_cr,                       handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(mov_dr,                       handle_mov_dr,                       handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_io_instruction,       handle_execute_io_instruction,       handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_rdmsr,                handle_execute_rdmsr,                handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_wrmsr,                handle_execute_wrmsr,                handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(error_invalid_guest_state,    handle_error_invalid_guest_state,    handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(error_msr_load,               handle_error_msr_load,               handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_mwait,                handle_execute_mwait,                handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(monitor_trap_flag,            handle_monitor_trap_flag,            handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_monitor,              handle_execute_monitor,              handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_pause,                handle_execute_pause,                handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(error_machine_check,          handle_error_machine_check,          handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(tpr_below_threshold,          handle_tpr_below_threshold,          handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(apic_access,                  handle_apic_access,                  handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(virtualized_eoi,              handle_virtualized_eoi,              handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(gdtr_idtr_access,             handle_gdtr_idtr_access,             handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(ldtr_tr_access,               handle_ldtr_tr_access,               handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(ept_violation,                handle_ept_violation,                handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(ept_misconfiguration,         handle_ept_misconfiguration,         handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_invept,               handle_execute_invept,               handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_rdtscp,               handle_execute_rdtscp,               handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(vmx_preemption_timer_expired, handle_vmx_preemption_timer_expired, handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_invvpid,              handle_execute_invvpid,              handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_wbinvd,               handle_execute_wbinvd,               handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_xsetbv,               handle_execute_xsetbv,               handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(apic_write,                   handle_apic_write,                   handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_rdrand,               handle_execute_rdrand,               handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_invpcid,              handle_execute_invpcid,              handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_vmfunc,               handle_execute_vmfunc,               handle_vm_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_encls,                handle_execute_encls,                handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_rdseed,               handle_execute_rdseed,               handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(page_modification_log_full,   handle_page_modification_log_full,   handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_xsaves,               handle_execute_xsaves,               handle_fallback);
+  HVPP_VMEXIT_REASON_TRAITS(execute_xrstors,              handle_execute_xrstors,              handle_fallback);
+
+#undef HVPP_VMEXIT_REASON_TRAITS
+
+  //
+  // Combines multiple VM-exit handlers into one.
+  //
+  // Dispatch is resolved at compile-time: for each exit reason there
+  // is one entry in a flat table, which calls (non-virtually) only the
+  // children interested in that exit reason - i.e. children which
+  // override either handle() or the handler method of that exit reason.
+  // Other children are skipped.  The order in which the children are
+  // called is the same as the order of ARGS.
+  //
+  // If HVPP_ENABLE_COMPOSITOR_ACCOUNTING is defined, TSC cycles spent
+  // in each child are accumulated per exit reason (per VCPU) and dumped
+  // in destroy().  Children are identified by their index in ARGS.
+  //
   template <
     typename ...ARGS
   >
@@ -37,11 +171,32 @@ namespace hvpp
           }
         });
 
+#ifdef HVPP_ENABLE_COMPOSITOR_ACCOUNTING
+        accounting_ = new accounting_t[mp::cpu_count()];
+
+        if (!accounting_)
+        {
+          return err ? err : make_error_code_t(std::errc::not_enough_memory);
+        }
+
+        memset(accounting_, 0, sizeof(*accounting_) * mp::cpu_count());
+#endif
+
         return err;
       }
 
       void destroy() noexcept override
       {
+#ifdef HVPP_ENABLE_COMPOSITOR_ACCOUNTING
+        if (accounting_)
+        {
+          accounting_dump();
+
+          delete[] accounting_;
+          accounting_ = nullptr;
+        }
+#endif
+
         for_each_element(handlers, [&](auto&& handler, int) {
           handler.destroy();
         });
@@ -56,9 +211,13 @@ namespace hvpp
 
       void handle(vcpu_t& vp) noexcept override
       {
-        for_each_element(handlers, [&](auto&& handler, int) {
-          handler.handle(vp);
-        });
+        auto handler_index = static_cast<uint32_t>(vp.exit_reason());
+
+        if (handler_index < dispatch_table_.size() &&
+            dispatch_table_[handler_index])
+        {
+          dispatch_table_[handler_index](*this, vp);
+        }
       }
 
       void invoke_termination() noexcept override
@@ -67,6 +226,132 @@ namespace hvpp
           handler.invoke_termination();
         });
       }
+
+      void teardown(vcpu_t& vp) noexcept override
+      {
+        for_each_element(handlers, [&](auto&& handler, int) {
+          handler.teardown(vp);
+        });
+      }
+
+    private:
+      using dispatch_fn_t = void (*)(vmexit_compositor_handler&, vcpu_t&) noexcept;
+
+      template <int EXIT_REASON, size_t INDEX>
+      static void dispatch_one(vmexit_compositor_handler& self, vcpu_t& vp) noexcept
+      {
+        using handler_t = std::tuple_element_t<INDEX, vmexit_handler_tuple_t>;
+        using traits_t  = vmexit_reason_traits<EXIT_REASON>;
+
+        auto& handler = std::get<INDEX>(self.handlers);
+
+        if constexpr (vmexit_overrides_handle_v<handler_t> ||
+                      traits_t::template handled_by<handler_t>)
+        {
+#ifdef HVPP_ENABLE_COMPOSITOR_ACCOUNTING
+          auto tsc = ia32_asm_read_tsc();
+#endif
+
+          if constexpr (vmexit_overrides_handle_v<handler_t>)
+          {
+            handler.handler_t::handle(vp);
+          }
+          else
+          {
+            traits_t::handle(handler, vp);
+          }
+
+#ifdef HVPP_ENABLE_COMPOSITOR_ACCOUNTING
+          auto& accounting = self.accounting_[mp::cpu_index()];
+          accounting.cycles[INDEX][EXIT_REASON] += ia32_asm_read_tsc() - tsc;
+          accounting.count[INDEX][EXIT_REASON] += 1;
+#endif
+        }
+      }
+
+      template <int EXIT_REASON, size_t ...INDEX>
+      static void dispatch(vmexit_compositor_handler& self, vcpu_t& vp) noexcept
+      {
+        (dispatch_one<EXIT_REASON, INDEX>(self, vp), ...);
+      }
+
+      template <int EXIT_REASON, size_t ...INDEX>
+      static constexpr dispatch_fn_t dispatch_entry(std::index_sequence<INDEX...>) noexcept
+      {
+        using traits_t = vmexit_reason_traits<EXIT_REASON>;
+
+        constexpr bool handled = ((vmexit_overrides_handle_v<ARGS> ||
+                                   traits_t::template handled_by<ARGS>) || ...);
+
+        if constexpr (handled)
+        {
+          return &dispatch<EXIT_REASON, INDEX...>;
+        }
+        else
+        {
+          return nullptr;
+        }
+      }
+
+      template <size_t ...EXIT_REASON>
+      static constexpr auto make_dispatch_table(std::index_sequence<EXIT_REASON...>) noexcept
+      {
+        return std::array<dispatch_fn_t, sizeof...(EXIT_REASON)> { {
+          dispatch_entry<static_cast<int>(EXIT_REASON)>(std::index_sequence_for<ARGS...>{})...
+        } };
+      }
+
+      //
+      // Currently the highest ID of exit reason is 65 (see vmexit_handler).
+      //
+      static const std::array<dispatch_fn_t, 65> dispatch_table_;
+
+#ifdef HVPP_ENABLE_COMPOSITOR_ACCOUNTING
+      //
+      // Cycles spent in each child, per exit reason.  Each VCPU has its
+      // own instance, therefore no synchronization is needed.
+      //
+      struct accounting_t
+      {
+        uint64_t cycles[sizeof...(ARGS)][65];
+        uint64_t count[sizeof...(ARGS)][65];
+      };
+
+      void accounting_dump() const noexcept
+      {
+        for (uint32_t index = 0; index < sizeof...(ARGS); ++index)
+        {
+          for (uint32_t exit_reason = 0; exit_reason < 65; ++exit_reason)
+          {
+            uint64_t cycles = 0;
+            uint64_t count = 0;
+
+            for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+            {
+              cycles += accounting_[i].cycles[index][exit_reason];
+              count  += accounting_[i].count[index][exit_reason];
+            }
+
+            if (count)
+            {
+              hvpp_info("handler #%u: %-30s count: %10llu, cycles: %14llu (%llu avg)",
+                        index,
+                        vmx::exit_reason_to_string(static_cast<vmx::exit_reason>(exit_reason)),
+                        count, cycles, cycles / count);
+            }
+          }
+        }
+      }
+
+      accounting_t* accounting_ = nullptr;
+#endif
   };
 
+  template <
+    typename ...ARGS
+  >
+  const std::array<typename vmexit_compositor_handler<ARGS...>::dispatch_fn_t, 65>
+  vmexit_compositor_handler<ARGS...>::dispatch_table_ =
+    vmexit_compositor_handler<ARGS...>::make_dispatch_table(std::make_index_sequence<65>{});
+
 }
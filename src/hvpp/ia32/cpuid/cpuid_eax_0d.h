@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+
+namespace ia32 {
+
+//
+// Processor Extended State Enumeration Main Leaf (EAX = 0DH, ECX = 0)
+// (ref: Vol2A[CPUID-CPU Identification])
+//
+struct cpuid_eax_0d
+{
+  union
+  {
+    struct
+    {
+      int cpu_info[4];
+    };
+
+    struct
+    {
+      uint32_t eax;
+      uint32_t ebx;
+      uint32_t ecx;
+      uint32_t edx;
+    };
+
+    struct
+    {
+      uint32_t xcr0_supported_low;        // supported bits of XCR0[31:0]
+      uint32_t xsave_area_size_enabled;   // size of XSAVE area for features enabled in XCR0
+      uint32_t xsave_area_size_supported; // size of XSAVE area for all supported features
+      uint32_t xcr0_supported_high;       // supported bits of XCR0[63:32]
+    };
+  };
+};
+
+//
+// Processor Extended State Enumeration Sub-leaf (EAX = 0DH, ECX = 1)
+// (ref: Vol2A[CPUID-CPU Identification])
+//
+struct cpuid_eax_0d_ecx_01
+{
+  union
+  {
+    struct
+    {
+      int cpu_info[4];
+    };
+
+    struct
+    {
+      uint32_t eax;
+      uint32_t ebx;
+      uint32_t ecx;
+      uint32_t edx;
+    };
+
+    struct
+    {
+      union
+      {
+        uint32_t flags;
+
+        struct
+        {
+          uint32_t xsaveopt : 1;
+          uint32_t xsavec_and_compaction : 1;
+          uint32_t xgetbv_ecx_1 : 1;
+          uint32_t xsaves_xrstors_and_ia32_xss : 1;
+          uint32_t reserved1 : 28;
+        };
+      } extended_state_features;
+
+      uint32_t xsave_area_size_xcr0_xss;  // size of XSAVE area for features enabled in XCR0 | IA32_XSS
+      uint32_t ia32_xss_supported_low;
+      uint32_t ia32_xss_supported_high;
+    };
+  };
+};
+
+}
@@ -13,6 +13,9 @@
 #include "vmx/exception_bitmap.h"
 #include "vmx/io_bitmap.h"
 #include "vmx/msr_bitmap.h"
+#include "vmx/pml.h"
+#include "vmx/ve.h"
+#include "vmx/vmfunc.h"
 
 #include <cstdint>
 
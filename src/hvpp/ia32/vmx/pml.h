@@ -0,0 +1,24 @@
+#pragma once
+#include "../memory.h"
+
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// Page-modification log.
+// Each entry holds guest physical address (4kb aligned) of the page,
+// which had its EPT dirty flag set by the CPU.  The log is filled from
+// the last entry (index 511) towards the first one (index 0).
+// (ref: Vol3C[28.2.6(Page-Modification Logging)])
+//
+struct alignas(page_size) pml_t
+{
+  static constexpr uint16_t count = 512;
+
+  uint64_t entries[count];
+};
+
+static_assert(sizeof(pml_t) == page_size);
+
+}
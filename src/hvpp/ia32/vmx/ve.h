@@ -0,0 +1,35 @@
+#pragma once
+#include "../memory.h"
+
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// Virtualization-exception information area.
+// If the "EPT-violation #VE" control is enabled, EPT violation caused
+// by the entry with cleared "suppress #VE" bit is delivered to the guest
+// as virtualization exception (vector 20) instead of VM-exit - but only
+// if the "busy" field of this area is 0.  The processor saves the
+// information about the EPT violation here and sets the "busy" field
+// to 0xFFFFFFFF.  The guest #VE handler is responsible for resetting
+// the "busy" field back to 0, otherwise subsequent EPT violations cause
+// VM-exits.
+// (ref: Vol3C[25.5.6.2(Convertible EPT Violations)])
+// (ref: Vol3C[25.5.6.3(Delivery of Virtualization Exceptions)])
+//
+struct alignas(page_size) ve_info_t
+{
+  static constexpr uint32_t busy_value = 0xFFFFFFFF;
+
+  uint32_t exit_reason;                 // always 48 (exit_reason::ept_violation)
+  uint32_t busy;
+  uint64_t exit_qualification;
+  uint64_t guest_linear_address;
+  uint64_t guest_physical_address;
+  uint16_t eptp_index;
+};
+
+static_assert(sizeof(ve_info_t) == page_size);
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "../ept.h"
+#include "../memory.h"
+
+#include <cstdint>
+
+namespace ia32::vmx {
+
+//
+// VM-function controls.
+// Each bit enables corresponding VM function (EAX value of the VMFUNC
+// instruction).  Only VM function 0 (EPTP switching) is defined.
+// (ref: Vol3C[24.6.14(VM-Function Controls)])
+//
+struct vmfunc_controls_t
+{
+  union
+  {
+    uint64_t flags;
+
+    struct
+    {
+      uint64_t eptp_switching : 1;
+    };
+  };
+};
+
+//
+// EPTP list.
+// VMFUNC with EAX == 0 (EPTP switching) loads EPT pointer from the entry
+// of this list selected by ECX.  If ECX >= 512 or the selected entry
+// isn't valid EPT pointer, the VMFUNC causes VM-exit.
+// (ref: Vol3C[25.5.5.3(EPTP Switching)])
+//
+struct alignas(page_size) eptp_list_t
+{
+  static constexpr uint16_t count = 512;
+
+  ept_ptr_t entries[count];
+};
+
+static_assert(sizeof(eptp_list_t) == page_size);
+
+}
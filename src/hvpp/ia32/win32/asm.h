@@ -83,6 +83,11 @@ unsigned char       ia32_asm_inv_vpid           (_In_ unsigned long type, _In_ v
 #define             ia32_asm_fx_save            _fxsave
 #define             ia32_asm_fx_restore         _fxrstor
 
+#define             ia32_asm_xsave              _xsave64
+#define             ia32_asm_xsave_opt          _xsaveopt64
+#define             ia32_asm_xsave_c            _xsavec64
+#define             ia32_asm_xrstor             _xrstor64
+
 #define             ia32_asm_pause              _mm_pause
 
 #define             ia32_asm_enable_interrupts  _enable
@@ -379,6 +379,20 @@ namespace memory_manager
     return number_of_free_bytes;
   }
 
+  bool contains(const void* address) noexcept
+  {
+    //
+    // Check whether the address belongs to the assigned memory space
+    // (including the page bitmap and the page allocation map).
+    //
+    const auto byte_address = reinterpret_cast<const uint8_t*>(address);
+    const auto size = available_size + page_bitmap_buffer_size + page_allocation_map_size;
+
+    return base_address &&
+           byte_address >= base_address &&
+           byte_address <  base_address + size;
+  }
+
   const ia32::physical_memory_descriptor& physical_memory_descriptor() noexcept
   {
     return *memory_descriptor;
@@ -23,6 +23,8 @@ namespace memory_manager
   size_t allocated_bytes() noexcept;
   size_t free_bytes() noexcept;
 
+  bool contains(const void* address) noexcept;
+
   const ia32::physical_memory_descriptor& physical_memory_descriptor() noexcept;
   const ia32::mtrr& mtrr() noexcept;
 
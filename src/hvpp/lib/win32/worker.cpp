@@ -0,0 +1,82 @@
+#include "../worker.h"
+#include "../mp.h"
+
+#include <ntddk.h>
+
+auto worker::start(callback_t callback, void* context, uint32_t period) noexcept -> error_code_t
+{
+  callback_ = callback;
+  context_ = context;
+  period_ = period;
+  stop_requested_ = false;
+  thread_ = nullptr;
+
+  HANDLE thread_handle;
+  NTSTATUS status = PsCreateSystemThread(&thread_handle,
+                                         THREAD_ALL_ACCESS,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         &worker::thread_routine,
+                                         this);
+
+  if (!NT_SUCCESS(status))
+  {
+    return make_error_code_t(std::errc::resource_unavailable_try_again);
+  }
+
+  //
+  // Keep reference to the thread object, so that stop() can wait for
+  // the thread to terminate.
+  //
+  PVOID thread_object;
+  status = ObReferenceObjectByHandle(thread_handle,
+                                     SYNCHRONIZE,
+                                     *PsThreadType,
+                                     KernelMode,
+                                     &thread_object,
+                                     NULL);
+
+  ZwClose(thread_handle);
+
+  if (!NT_SUCCESS(status))
+  {
+    //
+    // This shouldn't happen - the handle has been just created with
+    // THREAD_ALL_ACCESS.  Let the thread exit on its own.
+    //
+    stop_requested_ = true;
+    return make_error_code_t(std::errc::resource_unavailable_try_again);
+  }
+
+  thread_ = thread_object;
+  return error_code_t{};
+}
+
+void worker::stop() noexcept
+{
+  if (!thread_)
+  {
+    return;
+  }
+
+  stop_requested_ = true;
+
+  KeWaitForSingleObject(thread_, Executive, KernelMode, FALSE, NULL);
+  ObDereferenceObject(thread_);
+
+  thread_ = nullptr;
+}
+
+void worker::thread_routine(void* context) noexcept
+{
+  auto self = reinterpret_cast<worker*>(context);
+
+  while (!self->stop_requested_)
+  {
+    self->callback_(self->context_);
+    mp::sleep(self->period_);
+  }
+
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
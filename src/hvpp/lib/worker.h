@@ -0,0 +1,33 @@
+#pragma once
+#include "lib/error.h"
+
+#include <cstdint>
+
+//
+// Periodic worker - system thread which calls the callback every
+// "period" milliseconds at PASSIVE_LEVEL until stop() is called.
+//
+// It's meant for housekeeping which can't be done in VMX-root mode,
+// e.g. allocation of memory which is later consumed by VM-exit handlers
+// (see ept_t::pool_refill()).
+//
+
+class worker
+{
+  public:
+    using callback_t = void(*)(void* context) noexcept;
+
+    auto start(callback_t callback, void* context, uint32_t period) noexcept -> error_code_t;
+    void stop() noexcept;
+
+    bool is_running() const noexcept { return thread_ != nullptr; }
+
+  private:
+    static void thread_routine(void* context) noexcept;
+
+    callback_t    callback_;
+    void*         context_;
+    uint32_t      period_;
+    volatile bool stop_requested_;
+    void*         thread_;
+};
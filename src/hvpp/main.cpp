@@ -75,6 +75,13 @@ namespace driver
     std::get<hvpp::vmexit_stats_handler>(vmexit_handler->handlers)
       .trace_bitmap().set(int(ia32::vmx::exit_reason::execute_io_instruction));
 
+    //
+    // Let the guest read VM-exit statistics while the hypervisor is
+    // running (see vmcall 0xd2).
+    //
+    std::get<vmexit_custom_handler>(vmexit_handler->handlers)
+      .stats_storage(std::get<hvpp::vmexit_stats_handler>(vmexit_handler->handlers).storage());
+
     //
     // If debugger is enabled, break on first IN 0x64
     // and OUT 0x64 instruction.
@@ -1,13 +1,237 @@
 #include "vmexit_custom.h"
 
+#include "ia32/asm.h"
+
 #include "lib/cr3_guard.h"
 #include "lib/mp.h"
 #include "lib/log.h"
 
+#include <algorithm> // std::min(), std::copy_n()
+#include <cstring>   // memcpy
+#include <iterator>  // std::size()
+#include <mutex>     // std::lock_guard
+
+auto vmexit_custom_handler::initialize() noexcept -> error_code_t
+{
+  if (auto err = base_type::initialize())
+  {
+    return err;
+  }
+
+  hooks_ = new ept_hook_manager[mp::cpu_count()];
+  views_ = new ept_view_cache[mp::cpu_count()];
+  memory_snapshots_ = new memory_snapshot[mp::cpu_count()];
+  memory_session_states_ = new memory_session_state_t[mp::cpu_count()];
+
+  //
+  // EPT snapshots are serialized in VMX-root mode - preallocate
+  // the buffers here.
+  //
+  snapshots_ = new uint8_t[mp::cpu_count() * snapshot_capacity];
+
+  //
+  // Original PTEs of the guest pages which are remapped to the VM-exit
+  // statistics (see vmcall 0xd2).
+  //
+  stats_page_count_ = sizeof(vmexit_stats_storage_t) * mp::cpu_count() / page_size;
+  stats_mappings_ = new stats_mapping_t[mp::cpu_count()];
+
+  if (!hooks_ || !views_ || !snapshots_ || !memory_snapshots_ ||
+      !memory_session_states_ || !stats_mappings_)
+  {
+    return make_error_code_t(std::errc::not_enough_memory);
+  }
+
+  memory_session_.generation = 0;
+  memory_session_.id = 0;
+  memory_session_.owner = memory_session_no_owner;
+  memory_session_.range_count = 0;
+  memory_session_.foreign_write_count = 0;
+
+  for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+  {
+    memory_session_states_[i].generation = 0;
+    memory_session_states_[i].id = 0;
+    memory_session_states_[i].range_count = 0;
+  }
+
+  for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+  {
+    auto& mapping = stats_mappings_[i];
+
+    mapping.guest_pa = new pa_t[stats_page_count_];
+    mapping.original = new epte_t[stats_page_count_ * vcpu_t::ept_view_count];
+    mapping.page_count = 0;
+
+    if (!mapping.guest_pa || !mapping.original)
+    {
+      return make_error_code_t(std::errc::not_enough_memory);
+    }
+  }
+
+  //
+  // Per-process EPT views are attached in VMX-root mode - preallocate
+  // them here.
+  //
+  for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+  {
+    if (auto err = views_[i].initialize(view_capacity))
+    {
+      return err;
+    }
+  }
+
+  return error_code_t{};
+}
+
+void vmexit_custom_handler::destroy() noexcept
+{
+  if (hooks_)
+  {
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      hooks_[i].destroy();
+    }
+
+    delete[] hooks_;
+    hooks_ = nullptr;
+  }
+
+  if (views_)
+  {
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      auto& views = views_[i];
+
+      if (views.switch_count())
+      {
+        hvpp_info("cpu %u: CR3 loads: %llu (switched to view: %llu), cycles per load: %llu",
+                  i, views.switch_count(), views.switch_hits(),
+                  views.switch_cycles() / views.switch_count());
+      }
+
+      views.destroy();
+    }
+
+    delete[] views_;
+    views_ = nullptr;
+  }
+
+  if (snapshots_)
+  {
+    delete[] snapshots_;
+    snapshots_ = nullptr;
+  }
+
+  if (memory_snapshots_)
+  {
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      auto& memory = memory_snapshots_[i];
+
+      if (memory.reset_count())
+      {
+        hvpp_info("cpu %u: memory snapshot resets: %llu, dirtied pages: %llu (overflow: %llu), cycles per reset: %llu",
+                  i, memory.reset_count(), memory.dirtied_count(), memory.overflow_count(),
+                  memory.reset_cycles() / memory.reset_count());
+      }
+
+      memory.destroy();
+    }
+
+    delete[] memory_snapshots_;
+    memory_snapshots_ = nullptr;
+  }
+
+  if (memory_session_states_)
+  {
+    delete[] memory_session_states_;
+    memory_session_states_ = nullptr;
+  }
+
+  if (stats_mappings_)
+  {
+    for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+    {
+      delete[] stats_mappings_[i].guest_pa;
+      delete[] stats_mappings_[i].original;
+    }
+
+    delete[] stats_mappings_;
+    stats_mappings_ = nullptr;
+  }
+
+  base_type::destroy();
+}
+
 void vmexit_custom_handler::setup(vcpu_t& vp) noexcept
 {
   base_type::setup(vp);
 
+  //
+  // Each VCPU has its own EPTs - therefore each VCPU needs its own
+  // hook registry.  Hooks and memory snapshots are applied to all EPT
+  // views of the VCPU.
+  //
+  static_assert(vcpu_t::ept_view_count <= ept_hook_manager::max_ept_count &&
+                vcpu_t::ept_view_count <= memory_snapshot::max_ept_count);
+
+  ept_t* ept_list[vcpu_t::ept_view_count];
+
+  for (uint16_t index = 0; index < vcpu_t::ept_view_count; ++index)
+  {
+    ept_list[index] = &vp.ept(index);
+  }
+
+  hooks_[mp::cpu_index()].initialize(ept_list, std::size(ept_list), hook_capacity);
+
+  //
+  // Per-process EPT views are copy-on-write views of the active EPT view.
+  //
+  views_[mp::cpu_index()].bind(vp.ept());
+
+  //
+  // Shadow pool of the memory snapshot can't be allocated in VMX-root
+  // mode.
+  //
+  memory_snapshots_[mp::cpu_index()].initialize(ept_list, std::size(ept_list), memory_snapshot_capacity);
+
+  //
+  // The EPT violation handler maps "page_exec" to "page_read" - enable
+  // reverse map so that these aliases can be found by host address.
+  // Overflows are reported by hypervisor::destroy().
+  //
+  for (uint16_t index = 0; index < vcpu_t::ept_view_count; ++index)
+  {
+    if (vp.ept(index).rmap_enable(rmap_capacity))
+    {
+      hvpp_info("cpu %u: EPT view %u: reverse map not enabled",
+                mp::cpu_index(), index);
+    }
+  }
+
+  //
+  // Extended processor state doesn't have to be saved for exit reasons
+  // whose handlers don't touch x87/SSE/AVX registers.  Verify this in
+  // the disassembly of the handler before uncommenting.
+  //
+  // vp.xstate_save(vmx::exit_reason::execute_rdtsc, false);
+  //
+
+  //
+  // Handle the hottest trivial VM-exits by the fast path (RDTSC/RDTSCP
+  // don't cause VM-exit at all).  These VM-exits bypass all handlers -
+  // vmexit_stats_handler and vmexit_dbgbreak_handler don't see them and
+  // they're counted only by vcpu_t::fast_path_count():
+  //   - CPUID of the leaves listed in fast_execute_cpuid()
+  //   - XSETBV
+  //   - VMCALL 0xcf (ping)
+  // The fast path can be disabled by vmcall 0xd0.
+  //
+  vp.fast_handler(vmx::exit_reason::execute_cpuid,  &fast_execute_cpuid);
+  vp.fast_handler(vmx::exit_reason::execute_xsetbv, &fast_execute_xsetbv);
+  vp.fast_handler(vmx::exit_reason::execute_vmcall, &fast_execute_vmcall);
+
 #if 0
   //
   // Turn on VM-exit on everything we support.
@@ -115,8 +339,27 @@ void vmexit_custom_handler::setup(vcpu_t& vp) noexcept
 #endif
 }
 
+void vmexit_custom_handler::teardown(vcpu_t& vp) noexcept
+{
+  //
+  // Per-process EPT views must be detached before the VCPU destroys
+  // their base EPT.
+  //
+  views_[mp::cpu_index()].release_all();
+
+  //
+  // The guest pages remapped to the VM-exit statistics get their memory
+  // back with the EPTs - the guest runs without EPT from now on.
+  //
+  stats_mappings_[mp::cpu_index()].page_count = 0;
+
+  base_type::teardown(vp);
+}
+
 void vmexit_custom_handler::handle_execute_cpuid(vcpu_t& vp) noexcept
 {
+  memory_snapshot_sync(vp);
+
   if (vp.exit_context().eax == 'ppvh')
   {
     //
@@ -135,52 +378,751 @@ void vmexit_custom_handler::handle_execute_cpuid(vcpu_t& vp) noexcept
 
 void vmexit_custom_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
 {
-  auto& data = data_[mp::cpu_index()];
+  memory_snapshot_sync(vp);
+
+  auto& hooks = hooks_[mp::cpu_index()];
 
   switch (vp.exit_context().rcx)
   {
     case 0xc1:
       {
-        cr3_guard _(vp.guest_cr3());
+        pa_t page_read;
+        pa_t page_exec;
 
-        data.page_read = pa_t::from_va(vp.exit_context().rdx_as_pointer);
-        data.page_exec = pa_t::from_va(vp.exit_context().r8_as_pointer);
+        {
+          cr3_guard _(vp.guest_cr3());
+
+          page_read = pa_t::from_va(vp.exit_context().rdx_as_pointer);
+          page_exec = pa_t::from_va(vp.exit_context().r8_as_pointer);
+        }
+
+        hvpp_trace("vmcall (hook) EXEC: 0x%p READ: 0x%p", page_exec.value(), page_read.value());
+
+        //
+        // Set execute-only access on the page we want to hook.
+        // The 2MB page where the code resides is split automatically
+        // and EPT mappings are invalidated.
+        //
+        vp.exit_context().rax = hooks.install(page_read, page_exec);
       }
+      break;
+
+    case 0xc2:
+      //
+      // Unhook the page (or all pages, if no page has been provided).
+      // The access rights are set back to read_write_execute.  The split
+      // 2MB pages are joined back by the EPT coalescing.
+      //
+      if (vp.exit_context().r8_as_pointer)
+      {
+        pa_t page_exec;
+
+        {
+          cr3_guard _(vp.guest_cr3());
+
+          page_exec = pa_t::from_va(vp.exit_context().r8_as_pointer);
+        }
+
+        hvpp_trace("vmcall (unhook) EXEC: 0x%p", page_exec.value());
+
+        vp.exit_context().rax = hooks.remove(page_exec);
+      }
+      else
+      {
+        hvpp_trace("vmcall (unhook all)");
+
+        vp.exit_context().rax = hooks.remove_all();
+      }
+      break;
+
+    case 0xc3:
+      {
+        //
+        // Bulk hook - rdx points to the array of { page_read, page_exec }
+        // pairs of guest virtual addresses, r8 contains number of pairs
+        // (at most hook_capacity).  Pairs are copied from the guest and
+        // installed in batches, each batch is followed by one
+        // invalidation of EPT mappings.  Installation stops at the first
+        // batch which can't be copied (see guest_read()).
+        //
+        struct hook_va_t
+        {
+          void* page_read;
+          void* page_exec;
+        };
+
+        auto hook_va_list = vp.exit_context().rdx;
+        auto hook_va_count = std::min<size_t>(vp.exit_context().r8, hook_capacity);
+
+        size_t installed_count = 0;
+
+        for (size_t i = 0; i < hook_va_count; )
+        {
+          hook_va_t hook_va_batch[64];
+          ept_hook_manager::hook_t hook_list[64];
 
-      hvpp_trace("vmcall (hook) EXEC: 0x%p READ: 0x%p", data.page_exec.value(), data.page_read.value());
+          const auto hook_count = std::min(hook_va_count - i, std::size(hook_list));
 
+          if (!guest_read(vp, hook_va_list + i * sizeof(hook_va_t),
+                          hook_va_batch, hook_count * sizeof(hook_va_t)))
+          {
+            break;
+          }
+
+          {
+            cr3_guard _(vp.guest_cr3());
+
+            for (size_t j = 0; j < hook_count; ++j)
+            {
+              hook_list[j].page_read = pa_t::from_va(hook_va_batch[j].page_read);
+              hook_list[j].page_exec = pa_t::from_va(hook_va_batch[j].page_exec);
+            }
+          }
+
+          installed_count += hooks.install(hook_list, hook_count);
+          i += hook_count;
+        }
+
+        hvpp_trace("vmcall (bulk hook) %u/%u", static_cast<uint32_t>(installed_count),
+                                               static_cast<uint32_t>(hook_va_count));
+
+        vp.exit_context().rax = installed_count;
+      }
+      break;
+
+    case 0xc4:
       //
-      // Split the 2MB page where the code we want to hook resides.
+      // Switch EPT view - rdx contains index of the view.  This is
+      // a fallback for CPUs which don't support EPTP switching (the guest
+      // uses VMFUNC otherwise).
       //
-      vp.ept().split_2mb_to_4kb(data.page_exec & ept_pd_t::mask, data.page_exec & ept_pd_t::mask);
+      if (vp.exit_context().rdx < vcpu_t::ept_view_count)
+      {
+        vp.ept_index(static_cast<uint16_t>(vp.exit_context().rdx));
+        vp.exit_context().rax = true;
+      }
+      else
+      {
+        vp.exit_context().rax = false;
+      }
+      break;
 
+    case 0xc5:
       //
-      // Set execute-only access on the page we want to hook.
+      // Query whether the guest can switch EPT views by VMFUNC.
       //
-      vp.ept().map_4kb(data.page_exec, data.page_exec, epte_t::access_type::execute);
+      vp.exit_context().rax = vp.ept_vmfunc_enabled();
+      break;
 
+    case 0xc6:
       //
-      // We've changed EPT structure - mappings derived from EPT need to be
-      // invalidated.
+      // Register (or unregister, if no page has been provided) the guest
+      // virtualization-exception information area - rdx points to the page
+      // owned by the guest #VE handler.  The page must be writable by the
+      // caller (see guest_translate() and vcpu_t::ve_register()).
       //
-      vmx::invept_single_context(vp.ept().ept_pointer());
-    break;
+      if (!vp.ve_enabled())
+      {
+        vp.exit_context().rax = false;
+      }
+      else if (vp.exit_context().rdx_as_pointer)
+      {
+        pa_t ve_info_pa;
 
-    case 0xc2:
-      hvpp_trace("vmcall (unhook)");
+        if (!guest_translate(vp, vp.exit_context().rdx, true, ve_info_pa))
+        {
+          vp.exit_context().rax = false;
+          break;
+        }
+
+        hvpp_trace("vmcall (ve register) 0x%p", ve_info_pa.value());
+
+        vp.exit_context().rax = vp.ve_register(ve_info_pa);
+      }
+      else
+      {
+        hvpp_trace("vmcall (ve unregister)");
+
+        vp.ve_unregister();
+        vp.exit_context().rax = true;
+      }
+      break;
+
+    case 0xc7:
+    case 0xc8:
+      {
+        //
+        // View hook (0xc7) / unhook (0xc8) - rdx points to the "page_read",
+        // r8 points to the "page_exec".
+        //
+        // Unlike hooks installed by 0xc1, the hooked page is mapped
+        // differently in each EPT view - the read view maps it to the
+        // "page_read" with read-write access, the execute view maps it
+        // to the "page_exec" with execute-only access.  Both mappings don't
+        // suppress #VE, therefore the guest #VE handler can flip the views
+        // by VMFUNC without any VM-exit.  If #VE isn't delivered, the views
+        // are flipped in handle_ept_violation().
+        //
+        pa_t page_read;
+        pa_t page_exec;
+
+        {
+          cr3_guard _(vp.guest_cr3());
+
+          page_read = pa_t::from_va(vp.exit_context().rdx_as_pointer) & ept_pt_t::mask;
+          page_exec = pa_t::from_va(vp.exit_context().r8_as_pointer) & ept_pt_t::mask;
+        }
+
+        auto& ept_read = vp.ept(ept_view_read);
+        auto& ept_exec = vp.ept(ept_view_exec);
+
+        if (vp.exit_context().rcx == 0xc7)
+        {
+          hvpp_trace("vmcall (view hook) EXEC: 0x%p READ: 0x%p", page_exec.value(), page_read.value());
+
+          //
+          // The call fails if the EPT table pool is exhausted - the views
+          // may be left partially updated (but still consistent).
+          //
+          vp.exit_context().rax =
+            !ept_read.protect_range(page_exec, page_size, epte_t::access_type::read_write) &&
+            ept_read.map_4kb(page_exec, page_read, epte_t::access_type::read_write, false) &&
+            !ept_exec.protect_range(page_exec, page_size, epte_t::access_type::execute) &&
+            ept_exec.map_4kb(page_exec, page_exec, epte_t::access_type::execute, false);
+        }
+        else
+        {
+          hvpp_trace("vmcall (view unhook) EXEC: 0x%p", page_exec.value());
+
+          vp.exit_context().rax =
+            ept_read.map_4kb(page_exec, page_exec) &&
+            ept_exec.map_4kb(page_exec, page_exec);
+          vp.ept_index(ept_view_read);
+        }
+
+        ept_read.invalidate();
+        ept_exec.invalidate();
+      }
+      break;
+
+    case 0xc9:
+    case 0xca:
+      {
+        //
+        // Process hide (0xc9) / unhide (0xca) - rdx points to the page
+        // which should be hidden, r8 points to the page which is shown
+        // instead.  Only the current process (address space) is affected.
+        //
+        // Each 0xc9 call acquires the EPT view of the current address
+        // space (attached on the first call), each 0xca call releases it
+        // (the view is detached on the last release).  The guest must
+        // release the view before the process exits, otherwise the view
+        // would be inherited by the process which reuses the CR3.
+        //
+        // Each VCPU has its own EPTs and therefore its own views - the
+        // guest must issue both calls on each CPU (e.g. by setting the
+        // thread affinity), otherwise the process is hidden only while
+        // it runs on the CPU which has issued the call.  Views which are
+        // still acquired are detached by teardown().
+        //
+        auto& views = views_[mp::cpu_index()];
+        auto cr3 = vp.guest_cr3();
+
+        if (vp.exit_context().rcx == 0xc9)
+        {
+          pa_t page_hide;
+          pa_t page_show;
+
+          {
+            cr3_guard _(cr3);
+
+            page_hide = pa_t::from_va(vp.exit_context().rdx_as_pointer) & ept_pt_t::mask;
+            page_show = pa_t::from_va(vp.exit_context().r8_as_pointer) & ept_pt_t::mask;
+          }
+
+          hvpp_trace("vmcall (process hide) CR3: 0x%p HIDE: 0x%p SHOW: 0x%p",
+                     cr3.flags, page_hide.value(), page_show.value());
+
+          auto ept = views.acquire(cr3);
+
+          if (!ept)
+          {
+            vp.exit_context().rax = false;
+            break;
+          }
+
+          //
+          // protect_range() copies shared tables on the path and splits
+          // the large page, so that the PTE can be remapped.
+          //
+          if (ept->protect_range(page_hide, page_size, epte_t::access_type::read_write_execute) ||
+              !ept->map_4kb(page_hide, page_show))
+          {
+            views.release(cr3);
+            vp.exit_context().rax = false;
+            break;
+          }
+
+          ept->invalidate();
+
+          vp.ept_load(ept);
+          cr3_load_exiting(vp, true);
+        }
+        else
+        {
+          hvpp_trace("vmcall (process unhide) CR3: 0x%p", cr3.flags);
+
+          views.release(cr3);
+
+          vp.ept_load(views.find(cr3));
+          cr3_load_exiting(vp, views.count() != 0);
+        }
+
+        vp.exit_context().rax = true;
+      }
+      break;
+
+    case 0xcb:
+      {
+        //
+        // EPT snapshot - rdx points to the guest buffer, r8 contains its
+        // size, r9 contains index of the EPT view (see ept_snapshot.h).
+        // The snapshot is serialized into the preallocated per-VCPU buffer
+        // first and then copied into the guest buffer (see guest_write()).
+        // Returns size of the whole snapshot - if it's greater than the
+        // size of the guest buffer (or than snapshot_capacity), the
+        // snapshot is truncated.  Returns 0 if the guest buffer isn't
+        // writable.
+        //
+        if (vp.exit_context().r9 >= vcpu_t::ept_view_count)
+        {
+          vp.exit_context().rax = 0;
+          break;
+        }
+
+        auto buffer = snapshots_ + mp::cpu_index() * snapshot_capacity;
+        auto& ept = vp.ept(static_cast<uint16_t>(vp.exit_context().r9));
+
+        auto snapshot_size = ept.snapshot(buffer, snapshot_capacity);
+        auto copy_size = std::min(std::min(snapshot_size, snapshot_capacity),
+                                  static_cast<size_t>(vp.exit_context().r8));
+
+        hvpp_trace("vmcall (ept snapshot) view: %u size: %u",
+                   static_cast<uint32_t>(vp.exit_context().r9),
+                   static_cast<uint32_t>(snapshot_size));
+
+        if (copy_size >= sizeof(ept_snapshot_header_t))
+        {
+          //
+          // Drop records which don't fit into the guest buffer, so that
+          // the guest always receives valid (possibly truncated) snapshot.
+          //
+          auto header = reinterpret_cast<ept_snapshot_header_t*>(buffer);
+          header->record_count = std::min<uint64_t>(
+            header->record_count,
+            (copy_size - sizeof(*header)) / sizeof(ept_snapshot_record_t));
+
+          if (!guest_write(vp, vp.exit_context().rdx, buffer, copy_size))
+          {
+            vp.exit_context().rax = 0;
+            break;
+          }
+        }
+
+        vp.exit_context().rax = snapshot_size;
+      }
+      break;
 
+    case 0xcc:
+      {
+        //
+        // Memory snapshot - rdx points to the guest buffer, r8 contains
+        // its size (at most memory_snapshot::max_page_count pages).
+        // Current content of the buffer becomes the snapshot, its pages
+        // are write-protected (pages dirtied by this VCPU are saved on
+        // the first write - see handle_ept_violation()).  This VCPU
+        // becomes the owner of the snapshot, other VCPUs protect the
+        // buffer too (see memory_session_t).  Repeated calls extend the
+        // snapshot.
+        //
+        // Each page of the buffer must be present and writable by the
+        // caller (see guest_translate()) - the buffer should be locked in
+        // memory.  Returns number of protected ranges (physically
+        // contiguous pages are merged), or -1 if any page is invalid,
+        // if the buffer doesn't fit into the range table or if the
+        // snapshot is owned by another VCPU.
+        //
+        const auto va = vp.exit_context().rdx & ~uint64_t(page_mask);
+        const auto va_end = vp.exit_context().rdx + vp.exit_context().r8;
+
+        vp.exit_context().rax = ~0ull;
+
+        if (va_end < vp.exit_context().rdx ||
+            vp.exit_context().r8 > memory_snapshot::max_page_count * page_size)
+        {
+          break;
+        }
+
+        memory_snapshot::range_t range_list[memory_snapshot::max_range_count];
+        size_t range_count = 0;
+        bool valid = true;
+
+        for (auto page_va = va; page_va < va_end && valid; page_va += page_size)
+        {
+          pa_t pa;
+
+          if (!guest_translate(vp, page_va, true, pa))
+          {
+            valid = false;
+          }
+          else if (range_count &&
+                   range_list[range_count - 1].guest_pa + range_list[range_count - 1].size == pa)
+          {
+            range_list[range_count - 1].size += page_size;
+          }
+          else if (range_count < std::size(range_list))
+          {
+            range_list[range_count++] = { pa, page_size };
+          }
+          else
+          {
+            valid = false;
+          }
+        }
+
+        if (!valid)
+        {
+          break;
+        }
+
+        auto& session = memory_session_;
+        std::lock_guard _(session.lock);
+
+        if ((session.owner != memory_session_no_owner && session.owner != mp::cpu_index()) ||
+            session.range_count + range_count > std::size(session.range))
+        {
+          break;
+        }
+
+        auto& state = memory_session_states_[mp::cpu_index()];
+
+        if (session.owner == memory_session_no_owner)
+        {
+          session.owner = mp::cpu_index();
+          session.id = session.generation + 1;
+          session.range_count = 0;
+          session.foreign_write_count = 0;
+
+          state.id = session.id;
+          state.range_count = 0;
+        }
+
+        std::copy_n(range_list, range_count, session.range + session.range_count);
+        session.range_count += range_count;
+
+        const auto protected_count = memory_snapshots_[mp::cpu_index()].protect(range_list, range_count);
+
+        state.range_count = session.range_count;
+        state.generation = ++session.generation;
+
+        hvpp_trace("vmcall (memory snapshot) ranges: %u", static_cast<uint32_t>(protected_count));
+
+        vp.exit_context().rax = protected_count;
+      }
+      break;
+
+    case 0xcd:
+      {
+        //
+        // Memory snapshot reset - returns number of restored pages in rax
+        // and TSC cycles spent by the reset in rdx.  Returns -1 in rax if
+        // some dirtied page couldn't be saved (the shadow pool has been
+        // exhausted) or if some page has been written through EPT of
+        // another VCPU - the snapshot must be released and taken again.
+        // Returns -1 also until all VCPUs have protected the snapshot
+        // (see memory_snapshot_sync()) and if this VCPU doesn't own it.
+        //
+        auto& memory = memory_snapshots_[mp::cpu_index()];
+
+        if (memory_session_.owner != mp::cpu_index())
+        {
+          vp.exit_context().rax = ~0ull;
+          vp.exit_context().rdx = 0;
+          break;
+        }
+
+        size_t reset_count;
+        auto cycles = memory.reset_cycles();
+        auto err = memory.reset(reset_count);
+
+        vp.exit_context().rax = err || memory_session_.foreign_write_count || !memory_snapshot_established()
+          ? ~0ull
+          : reset_count;
+        vp.exit_context().rdx = memory.reset_cycles() - cycles;
+      }
+      break;
+
+    case 0xce:
+      {
+        //
+        // Memory snapshot release - other VCPUs release their protection
+        // on their next VM-exit.
+        //
+        hvpp_trace("vmcall (memory snapshot release)");
+
+        auto& session = memory_session_;
+        std::lock_guard _(session.lock);
+
+        if (session.owner != mp::cpu_index() ||
+            memory_snapshots_[mp::cpu_index()].release())
+        {
+          vp.exit_context().rax = false;
+          break;
+        }
+
+        auto& state = memory_session_states_[mp::cpu_index()];
+
+        session.owner = memory_session_no_owner;
+        session.id = session.generation + 1;
+        session.range_count = 0;
+
+        state.id = session.id;
+        state.range_count = 0;
+        state.generation = ++session.generation;
+
+        vp.exit_context().rax = true;
+      }
+      break;
+
+    case 0xcf:
       //
-      // Merge the 4kb pages back to the original 2MB large page.
-      // Note that this will also automatically set the access
-      // rights to read_write_execute.
+      // Ping (see fast_execute_vmcall()) - reached only if the fast
+      // path is disabled.
       //
-      vp.ept().join_4kb_to_2mb(data.page_exec & ept_pd_t::mask, data.page_exec & ept_pd_t::mask);
+      vp.exit_context().rax = 'hvpp';
+      break;
 
+    case 0xd0:
       //
-      // We've changed EPT structure - mappings derived from EPT
-      // need to be invalidated.
+      // Enable (rdx != 0) or disable (rdx == 0) the fast path.
       //
-      vmx::invept_single_context(vp.ept().ept_pointer());
+      hvpp_trace("vmcall (fast path) %s", vp.exit_context().rdx ? "enable" : "disable");
+
+      vp.fast_path_enable(vp.exit_context().rdx != 0);
+      vp.exit_context().rax = true;
+      break;
+
+#ifdef HVPP_ENABLE_EXIT_LATENCY
+    case 0xd1:
+      {
+        //
+        // VM-exit latency histograms of this VCPU - rdx points to the
+        // guest buffer, r8 contains its size (see exit_latency.h).  If r9
+        // is non-zero, histograms are reset after they have been copied.
+        // Returns size of the histograms (nothing is copied if the guest
+        // buffer is too small) or 0 if the guest buffer isn't writable
+        // (see guest_write()).  The copy is taken under the seqlock of
+        // the histograms.
+        //
+        auto& latency = vp.exit_latency();
+
+        vp.exit_context().rax = sizeof(exit_latency_t);
+
+        if (vp.exit_context().r8 >= sizeof(exit_latency_t))
+        {
+          bool copied;
+          uint64_t sequence;
+
+          do
+          {
+            sequence = latency.read_begin();
+            copied = guest_write(vp, vp.exit_context().rdx, &latency, sizeof(exit_latency_t));
+          } while (copied && latency.read_retry(sequence));
+
+          if (!copied)
+          {
+            vp.exit_context().rax = 0;
+            break;
+          }
+        }
+
+        if (vp.exit_context().r9)
+        {
+          vp.exit_latency_reset();
+        }
+      }
+      break;
+#endif
+
+    case 0xd2:
+      {
+        //
+        // Map VM-exit statistics of all VCPUs (see vmexit_stats_storage_t)
+        // into the guest buffer - rdx points to the page-aligned buffer,
+        // r8 contains its size.  Each page of the buffer is remapped
+        // read-only to the page of the statistics in all EPT views of
+        // this VCPU (and therefore in per-process views too) - the guest
+        // reads live statistics without any copying (consistent copy of
+        // each VCPU's statistics is taken by snapshot()).
+        //
+        // Each page of the buffer must be present and writable in the
+        // current address space (see guest_translate()) - the guest
+        // should lock the buffer in the memory.  Original PTEs of the
+        // buffer are saved and they are restored by 0xd3, by the first
+        // write to any page of the buffer (e.g. when the guest frees the
+        // pages and they are reused) or by unloading of the hypervisor,
+        // whichever comes first.  The guest must call 0xd2 and 0xd3 on
+        // each CPU.
+        //
+        // Returns size of the statistics (nothing is mapped if the buffer
+        // is too small) or 0 if the statistics aren't available, if the
+        // buffer is invalid or if the statistics are already mapped on
+        // this CPU.
+        //
+        const auto size = stats_page_count_ * page_size;
+
+        vp.exit_context().rax = stats_storage_ ? size : 0;
+
+        if (!stats_storage_ || vp.exit_context().r8 < size)
+        {
+          break;
+        }
+
+        hvpp_trace("vmcall (stats map) VA: 0x%p", vp.exit_context().rdx);
+
+        if (!stats_map(vp, vp.exit_context().rdx))
+        {
+          vp.exit_context().rax = 0;
+        }
+      }
+      break;
+
+    case 0xd3:
+      //
+      // Unmap VM-exit statistics mapped by 0xd2 on this CPU.  Returns
+      // false if they haven't been mapped (anymore).
+      //
+      hvpp_trace("vmcall (stats unmap)");
+
+      vp.exit_context().rax = stats_mappings_[mp::cpu_index()].page_count != 0;
+      stats_unmap(vp);
+      break;
+
+    case 0xd4:
+      {
+        //
+        // Harvest accessed/dirty flags of the active EPT view (see
+        // ept_t::harvest()) - rdx contains guest physical address, r8
+        // contains size of the range (both are page-aligned, the range
+        // is limited to 512GB).  Returns number of entries whose flags
+        // have been cleared in rax and TSC cycles spent by the scan in
+        // rdx, or -1 in rax if EPT accessed/dirty flags aren't enabled
+        // (see HVPP_ENABLE_PML).
+        //
+        auto& ept = vp.ept();
+
+        const auto guest_pa = pa_t(vp.exit_context().rdx & ~page_mask);
+        const auto size     = vp.exit_context().r8 & ~page_mask;
+
+        if (!ept.ad_enabled() || size > ept_pml4_t::size)
+        {
+          vp.exit_context().rax = static_cast<uint64_t>(-1);
+          vp.exit_context().rdx = 0;
+          break;
+        }
+
+        auto cycles = ept.harvest_cycles();
+        vp.exit_context().rax = ept.harvest(guest_pa, size, nullptr, nullptr);
+        vp.exit_context().rdx = ept.harvest_cycles() - cycles;
+      }
+      break;
+
+    case 0xd5:
+      {
+        //
+        // Hook statistics of this VCPU (see ept_hook_manager) - rdx
+        // points to the guest buffer of 3 uint64_t values, which receives
+        // number of handled EPT violations on hooked pages, TSC cycles
+        // spent by them and the maximum of a single one.  Returns number
+        // of copied bytes (0 on failure).
+        //
+        const uint64_t statistics[] = {
+          hooks.violation_count(),
+          hooks.violation_cycles(),
+          hooks.violation_cycles_max(),
+        };
+
+        vp.exit_context().rax = guest_write(vp, vp.exit_context().rdx, statistics, sizeof(statistics))
+          ? sizeof(statistics)
+          : 0;
+      }
+      break;
+
+    case 0xd6:
+      {
+        //
+        // EPT lookup benchmark - performs r9 lookups (see
+        // ept_t::ept_entry()) of 4kb pages in the active EPT view.  rdx
+        // contains guest physical address and r8 size of the range (both
+        // are page-aligned, the range is limited to 512GB).  Pages are
+        // visited in scattered order within the largest power-of-2 number
+        // of pages which fits into the range, so that consecutive walks
+        // don't hit the same cache lines.  The number of lookups is
+        // limited to max_lookup_count, so that the guest isn't stalled
+        // for too long.  Returns number of found entries in rax and TSC
+        // cycles spent by the lookups in rdx, or -1 in rax if the range
+        // is invalid.
+        //
+        static constexpr uint64_t max_lookup_count = 1 << 24;
+
+        auto& ept = vp.ept();
+
+        const auto guest_pa     = vp.exit_context().rdx & ~page_mask;
+        const auto size         = vp.exit_context().r8 & ~page_mask;
+        const auto lookup_count = std::min(vp.exit_context().r9, max_lookup_count);
+
+        if (!size || size > ept_pml4_t::size)
+        {
+          vp.exit_context().rax = static_cast<uint64_t>(-1);
+          vp.exit_context().rdx = 0;
+          break;
+        }
+
+        uint64_t page_count = 1;
+
+        while (page_count * 2 <= (size >> page_shift))
+        {
+          page_count *= 2;
+        }
+
+        const auto index_mask = page_count - 1;
+
+        uint64_t found_count = 0;
+        uint64_t index = 0;
+
+        auto tsc_start = ia32_asm_read_tsc();
+
+        for (uint64_t i = 0; i < lookup_count; ++i)
+        {
+          //
+          // Odd stride visits each page of the power-of-2 range exactly
+          // once before it repeats.
+          //
+          index = (index + 0x9e3779b1) & index_mask;
+
+          if (ept.ept_entry(pa_t(guest_pa + (index << page_shift))))
+          {
+            ++found_count;
+          }
+        }
+
+        vp.exit_context().rdx = ia32_asm_read_tsc() - tsc_start;
+        vp.exit_context().rax = found_count;
+
+        hvpp_trace("vmcall (ept lookup) lookups: %u cycles: %u",
+                   static_cast<uint32_t>(lookup_count),
+                   static_cast<uint32_t>(vp.exit_context().rdx));
+      }
       break;
 
     default:
@@ -189,37 +1131,182 @@ void vmexit_custom_handler::handle_execute_vmcall(vcpu_t& vp) noexcept
   }
 }
 
+bool vmexit_custom_handler::fast_execute_cpuid(vcpu_t& vp) noexcept
+{
+  //
+  // Same as handle_execute_cpuid(), but only for the leaves which are
+  // queried most often (e.g. by the OS on each context switch).  All
+  // other leaves go through the regular path.
+  //
+  switch (vp.exit_context().eax)
+  {
+    case 'ppvh':
+      vp.exit_context().rax = 'lleh';
+      vp.exit_context().rbx = 'rf o';
+      vp.exit_context().rcx = 'h mo';
+      vp.exit_context().rdx = 'ppv';
+      return true;
+
+    case 0x0000'0000:
+    case 0x0000'0001:
+    case 0x0000'0007:
+    case 0x8000'0000:
+    case 0x8000'0001:
+      break;
+
+    default:
+      return false;
+  }
+
+  int cpu_info[4];
+  ia32_asm_cpuid_ex(cpu_info,
+                    vp.exit_context().eax,
+                    vp.exit_context().ecx);
+
+  vp.exit_context().rax = cpu_info[0];
+  vp.exit_context().rbx = cpu_info[1];
+  vp.exit_context().rcx = cpu_info[2];
+  vp.exit_context().rdx = cpu_info[3];
+
+  return true;
+}
+
+bool vmexit_custom_handler::fast_execute_xsetbv(vcpu_t& vp) noexcept
+{
+  ia32_asm_write_xcr(vp.exit_context().ecx,
+                     vp.exit_context().rdx << 32 |
+                     vp.exit_context().rax);
+
+  return true;
+}
+
+bool vmexit_custom_handler::fast_execute_vmcall(vcpu_t& vp) noexcept
+{
+  //
+  // Only "ping" is handled here, everything else goes through
+  // handle_execute_vmcall().
+  //
+  if (vp.exit_context().rcx != 0xcf)
+  {
+    return false;
+  }
+
+  vp.exit_context().rax = 'hvpp';
+
+  return true;
+}
+
+void vmexit_custom_handler::handle_mov_cr(vcpu_t& vp) noexcept
+{
+  base_type::handle_mov_cr(vp);
+
+  //
+  // On each CR3 load, switch to the EPT view of the new address space
+  // (or back to the active EPT view, if the address space doesn't have
+  // any).  Cached guest-physical mappings are associated with the EP4TA,
+  // therefore no INVEPT is needed.
+  //
+  auto exit_qualification = vp.exit_qualification().mov_cr;
+
+  if (exit_qualification.access_type == vmx::exit_qualification_mov_cr_t::access_to_cr &&
+      exit_qualification.cr_number == 3)
+  {
+    auto& views = views_[mp::cpu_index()];
+
+    auto tsc_start = ia32_asm_read_tsc();
+
+    auto ept = views.find(vp.guest_cr3());
+    vp.ept_load(ept);
+
+    views.account_switch(ept != nullptr, ia32_asm_read_tsc() - tsc_start);
+  }
+}
+
 void vmexit_custom_handler::handle_ept_violation(vcpu_t& vp) noexcept
 {
+  memory_snapshot_sync(vp);
+
   auto exit_qualification = vp.exit_qualification().ept_violation;
   auto guest_pa = vp.exit_guest_physical_address();
-  auto guest_la = vp.exit_guest_linear_address();
 
-  auto& data = data_[mp::cpu_index()];
+  auto& hooks = hooks_[mp::cpu_index()];
+
+  //
+  // EPT which caused the violation - either one of the EPT views or
+  // the per-process EPT view (see ept_view_cache).
+  //
+  auto& ept = vp.ept_current();
+
+  //
+  // If someone requested read or write access to the hooked page,
+  // (which has execute-only access), the hook manager maps the page
+  // with the "page_read" and sets the access to RW.
+  //
+  // If someone requested execute access to the hooked page (which has
+  // read-write access), the hook manager maps the page with the
+  // "page_exec" and sets the access to execute-only.
+  //
+  bool execute = !exit_qualification.data_read  &&
+                 !exit_qualification.data_write &&
+                  exit_qualification.data_execute;
 
-  if (exit_qualification.data_read || exit_qualification.data_write)
+  //
+  // Any write to the guest pages which are remapped to the VM-exit
+  // statistics (see vmcall 0xd2) removes the mapping - the guest has
+  // most likely freed the buffer and the pages are being reused.
+  //
+  if (exit_qualification.data_write)
   {
-    //
-    // Someone requested read or write access to the guest_pa,
-    // but the page has execute-only access.  Map the page with
-    // the "data.page_read" we've saved before in the VMCALL
-    // handler and set the access to RW.
-    //
-    hvpp_trace("data_read LA: 0x%p PA: 0x%p", guest_la, guest_pa.value());
+    auto& mapping = stats_mappings_[mp::cpu_index()];
 
-    vp.ept().map_4kb(data.page_exec, data.page_read, epte_t::access_type::read_write);
+    for (size_t i = 0; i < mapping.page_count; ++i)
+    {
+      if (mapping.guest_pa[i] == (guest_pa & ept_pt_t::mask))
+      {
+        stats_unmap(vp);
+        vp.suppress_rip_adjust();
+        return;
+      }
+    }
   }
-  else if (exit_qualification.data_execute)
+
+  //
+  // Writes to the pages of the memory snapshot are handled first - the
+  // page is saved and the write access is restored.  Pages dirtied
+  // by a VCPU which doesn't own the snapshot are foreign writes (see
+  // memory_session_t).
+  //
+  auto& memory = memory_snapshots_[mp::cpu_index()];
+  const auto dirtied_count = memory.dirtied_count() + memory.overflow_count();
+
+  if (memory.handle_ept_violation(ept, guest_pa, exit_qualification.data_write))
+  {
+    if (memory.dirtied_count() + memory.overflow_count() != dirtied_count &&
+        memory_session_.owner != mp::cpu_index())
+    {
+      ++memory_session_.foreign_write_count;
+    }
+
+    vp.suppress_rip_adjust();
+    return;
+  }
+
+  if (!hooks.handle_ept_violation(ept, guest_pa, execute))
   {
     //
-    // Someone requested execute access to the guest_pa, but
-    // the page has only read-write access.  Map the page with
-    // the "data.page_execute" we've saved before in the VMCALL
-    // handler and set the access to execute-only.
+    // Not a hook managed by the hook manager - check whether it's
+    // a view hook (see 0xc7 VMCALL) and flip the views, if so.  This is
+    // what the guest #VE handler does if the #VE is delivered.
     //
-    hvpp_trace("data_execute LA: 0x%p PA: 0x%p", guest_la, guest_pa.value());
+    auto entry = ept.ept_entry(guest_pa);
+
+    if (!entry || !entry->is_present() || entry->suppress_ve)
+    {
+      base_type::handle_ept_violation(vp);
+      return;
+    }
 
-    vp.ept().map_4kb(data.page_exec, data.page_exec, epte_t::access_type::execute);
+    vp.ept_index(execute ? ept_view_exec : ept_view_read);
   }
 
   //
@@ -255,3 +1342,361 @@ void vmexit_custom_handler::handle_ept_violation(vcpu_t& vp) noexcept
   //
   vp.suppress_rip_adjust();
 }
+
+bool vmexit_custom_handler::guest_translate(vcpu_t& vp, uint64_t va, bool write, pa_t& guest_pa) noexcept
+{
+  //
+  // Only canonical addresses can be translated.
+  //
+  if (static_cast<uint64_t>(static_cast<int64_t>(va << 16) >> 16) != va)
+  {
+    return false;
+  }
+
+  //
+  // Walk the 4-level paging structures of the current address space.
+  // Callers at CPL 3 can access only pages which are accessible from
+  // user-mode (U/S bit is set on all levels).
+  //
+  const bool user = vp.guest_ss().access.descriptor_privilege_level == 3;
+  const pa_t address = va;
+
+  auto table = pa_t::from_pfn(::detail::kernel_cr3(vp.guest_cr3()).page_frame_number);
+
+  for (auto level = pml::pml4; ; --level)
+  {
+    const auto entry = reinterpret_cast<const pe_t*>(table.va())[address.index(level)];
+
+    if (!entry.present || (write && !entry.write) || (user && !entry.supervisor))
+    {
+      return false;
+    }
+
+    if (level == pml::pt || (level != pml::pml4 && entry.large_page))
+    {
+      //
+      // Offset into the (possibly large) page - PAT bit of large pages
+      // falls into it and it is masked out.
+      //
+      const auto offset_mask = (uint64_t(1) << (page_shift + static_cast<uint8_t>(level) * 9)) - 1;
+
+      guest_pa = ((entry.page_frame_number << page_shift) & ~offset_mask) |
+                 (va & offset_mask & ~uint64_t(page_mask));
+
+      return true;
+    }
+
+    table = pa_t::from_pfn(entry.page_frame_number);
+  }
+}
+
+bool vmexit_custom_handler::guest_read(vcpu_t& vp, uint64_t va, void* buffer, size_t size) noexcept
+{
+  return guest_copy(vp, va, buffer, size, false);
+}
+
+bool vmexit_custom_handler::guest_write(vcpu_t& vp, uint64_t va, const void* buffer, size_t size) noexcept
+{
+  return guest_copy(vp, va, const_cast<void*>(buffer), size, true);
+}
+
+bool vmexit_custom_handler::guest_copy(vcpu_t& vp, uint64_t va, void* buffer, size_t size, bool write) noexcept
+{
+  if (va + size < va)
+  {
+    return false;
+  }
+
+  //
+  // Translate guest virtual address of the page into host physical
+  // address - through the guest paging structures and then through the
+  // EPT which is currently used by the guest.  Pages which aren't
+  // accessible in the EPT (e.g. write-protected by the memory snapshot)
+  // are rejected.
+  //
+  auto translate = [&vp, write](uint64_t page_va, pa_t& host_pa) noexcept {
+    pa_t guest_pa;
+
+    return guest_translate(vp, page_va, write, guest_pa) &&
+           vp.ept_current().translate(guest_pa, write, host_pa);
+  };
+
+  auto for_each_page = [&](auto&& function) noexcept {
+    for (size_t offset = 0; offset < size; )
+    {
+      const auto page_offset = (va + offset) & page_mask;
+      const auto chunk = std::min<size_t>(page_size - page_offset, size - offset);
+
+      pa_t host_pa;
+
+      if (!translate(va + offset - page_offset, host_pa))
+      {
+        return false;
+      }
+
+      function(host_pa + page_offset, offset, chunk);
+      offset += chunk;
+    }
+
+    return true;
+  };
+
+  //
+  // Validate the whole range first, so that nothing is copied if any
+  // page is invalid.  Pages are translated again during the copy - the
+  // guest paging structures might have been changed by other CPUs
+  // meanwhile.
+  //
+  auto bytes = static_cast<uint8_t*>(buffer);
+
+  return for_each_page([](pa_t, size_t, size_t) noexcept {}) &&
+         for_each_page([bytes, write](pa_t host_pa, size_t offset, size_t chunk) noexcept {
+           if (write)
+           {
+             memcpy(host_pa.va(), bytes + offset, chunk);
+           }
+           else
+           {
+             memcpy(bytes + offset, host_pa.va(), chunk);
+           }
+         });
+}
+
+bool vmexit_custom_handler::stats_map(vcpu_t& vp, uint64_t va) noexcept
+{
+  auto& mapping = stats_mappings_[mp::cpu_index()];
+
+  if (mapping.page_count || (va & page_mask))
+  {
+    return false;
+  }
+
+  //
+  // Translate the whole buffer first - nothing is mapped if any page
+  // can't be translated, if it isn't mapped by some EPT view or if the
+  // same physical page occurs twice.
+  //
+  for (size_t i = 0; i < stats_page_count_; ++i)
+  {
+    auto& guest_pa = mapping.guest_pa[i];
+
+    if (!guest_translate(vp, va + i * page_size, true, guest_pa))
+    {
+      return false;
+    }
+
+    for (size_t j = 0; j < i; ++j)
+    {
+      if (mapping.guest_pa[j] == guest_pa)
+      {
+        return false;
+      }
+    }
+
+    for (uint16_t index = 0; index < vcpu_t::ept_view_count; ++index)
+    {
+      if (!vp.ept(index).walk(guest_pa))
+      {
+        return false;
+      }
+    }
+  }
+
+  //
+  // protect_range() (with the current access) splits the large pages,
+  // so that the PTEs can be saved and remapped.  This is done for all
+  // pages before anything is remapped - if the EPT table pool runs dry,
+  // the mapping fails without any visible change.
+  //
+  for (size_t i = 0; i < stats_page_count_; ++i)
+  {
+    const auto guest_pa = mapping.guest_pa[i];
+
+    for (uint16_t index = 0; index < vcpu_t::ept_view_count; ++index)
+    {
+      auto& ept = vp.ept(index);
+
+      if (ept.protect_range(guest_pa, page_size, static_cast<epte_t::access_type>(ept.walk(guest_pa)->access)))
+      {
+        return false;
+      }
+    }
+  }
+
+  //
+  // Save the original PTEs and pin their PTs, so that coalesce() doesn't
+  // join them while the pages are remapped.
+  //
+  for (size_t i = 0; i < stats_page_count_; ++i)
+  {
+    for (uint16_t index = 0; index < vcpu_t::ept_view_count; ++index)
+    {
+      auto& ept = vp.ept(index);
+      auto pte = ept.walk(mapping.guest_pa[i]);
+
+      mapping.original[i * vcpu_t::ept_view_count + index] = *pte;
+      ept.pin(pte);
+    }
+  }
+
+  mapping.page_count = stats_page_count_;
+
+  //
+  // remap_4kb() fails only if the change can't be propagated into some
+  // attached view - stats_unmap() then restores the original PTEs (those
+  // which weren't remapped yet are left as they are).
+  //
+  for (size_t i = 0; i < stats_page_count_; ++i)
+  {
+    const auto guest_pa = mapping.guest_pa[i];
+    const auto host_pa  = pa_t::from_va(reinterpret_cast<uint8_t*>(stats_storage_) + i * page_size);
+
+    for (uint16_t index = 0; index < vcpu_t::ept_view_count; ++index)
+    {
+      auto& ept = vp.ept(index);
+
+      if (!ept.remap_4kb(ept.walk(guest_pa), guest_pa, host_pa, epte_t::access_type::read))
+      {
+        stats_unmap(vp);
+        return false;
+      }
+    }
+  }
+
+  for (uint16_t index = 0; index < vcpu_t::ept_view_count; ++index)
+  {
+    vp.ept(index).invalidate();
+  }
+
+  return true;
+}
+
+void vmexit_custom_handler::stats_unmap(vcpu_t& vp) noexcept
+{
+  auto& mapping = stats_mappings_[mp::cpu_index()];
+
+  if (!mapping.page_count)
+  {
+    return;
+  }
+
+  for (size_t i = 0; i < mapping.page_count; ++i)
+  {
+    const auto guest_pa = mapping.guest_pa[i];
+
+    for (uint16_t index = 0; index < vcpu_t::ept_view_count; ++index)
+    {
+      auto& ept = vp.ept(index);
+      auto& original = mapping.original[i * vcpu_t::ept_view_count + index];
+
+      auto pte = ept.walk(guest_pa);
+
+      //
+      // The PTE itself is always restored - only the propagation into
+      // attached views can fail (see ept_t::map()).
+      //
+      if (!ept.remap_4kb(pte, guest_pa,
+                         pa_t::from_pfn(original.page_frame_number),
+                         static_cast<epte_t::access_type>(original.access)))
+      {
+        hvpp_trace("stats unmap: 0x%p not propagated", guest_pa.value());
+      }
+
+      ept.unpin(pte);
+    }
+  }
+
+  mapping.page_count = 0;
+
+  for (uint16_t index = 0; index < vcpu_t::ept_view_count; ++index)
+  {
+    vp.ept(index).invalidate();
+  }
+}
+
+void vmexit_custom_handler::memory_snapshot_sync(vcpu_t& vp) noexcept
+{
+  (void)vp;
+
+  auto& session = memory_session_;
+  auto& state = memory_session_states_[mp::cpu_index()];
+
+  if (state.generation == session.generation)
+  {
+    return;
+  }
+
+  std::lock_guard _(session.lock);
+
+  if (session.owner == mp::cpu_index())
+  {
+    state.generation = session.generation.load();
+    return;
+  }
+
+  auto& memory = memory_snapshots_[mp::cpu_index()];
+
+  if (state.id != session.id)
+  {
+    //
+    // The snapshot has been released (or taken again) - release the
+    // protection of the previous one first.  If it fails, the release
+    // is retried on the next VM-exit.
+    //
+    if (state.range_count && memory.release())
+    {
+      return;
+    }
+
+    state.id = session.id;
+    state.range_count = 0;
+  }
+
+  if (state.range_count < session.range_count)
+  {
+    //
+    // Pages which couldn't be protected aren't tracked by this VCPU,
+    // writes to them can't be detected - count them as foreign writes.
+    //
+    const auto lost_count = memory.lost_count();
+
+    memory.protect(session.range + state.range_count,
+                   session.range_count - state.range_count);
+
+    if (memory.lost_count() != lost_count)
+    {
+      ++session.foreign_write_count;
+    }
+
+    state.range_count = session.range_count;
+  }
+
+  state.generation = session.generation.load();
+}
+
+bool vmexit_custom_handler::memory_snapshot_established() const noexcept
+{
+  for (uint32_t i = 0; i < mp::cpu_count(); ++i)
+  {
+    if (memory_session_states_[i].generation != memory_session_.generation)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void vmexit_custom_handler::cr3_load_exiting(vcpu_t& vp, bool enable) noexcept
+{
+  //
+  // CR3 loads cause VM-exits only while any per-process EPT view exists.
+  //
+  auto procbased_ctls = vp.processor_based_controls();
+
+  if (procbased_ctls.cr3_load_exiting != enable)
+  {
+    procbased_ctls.cr3_load_exiting = enable;
+    vp.processor_based_controls(procbased_ctls);
+  }
+}
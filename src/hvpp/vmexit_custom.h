@@ -1,11 +1,18 @@
 #pragma once
 #include "hvpp/config.h"
+#include "hvpp/ept_hook.h"
+#include "hvpp/ept_view_cache.h"
+#include "hvpp/memory_snapshot.h"
 #include "hvpp/vcpu.h"
 #include "hvpp/vmexit.h"
 #include "hvpp/vmexit/vmexit_stats.h"
 #include "hvpp/vmexit/vmexit_dbgbreak.h"
 #include "hvpp/vmexit/vmexit_passthrough.h"
 
+#include "lib/spinlock.h"
+
+#include <atomic>
+
 using namespace ia32;
 using namespace hvpp;
 
@@ -15,18 +22,144 @@ class vmexit_custom_handler
   public:
     using base_type = vmexit_passthrough_handler;
 
+    auto initialize() noexcept -> error_code_t override;
+    void destroy() noexcept override;
+
     void setup(vcpu_t& vp) noexcept override;
+    void teardown(vcpu_t& vp) noexcept override;
 
     void handle_execute_cpuid(vcpu_t& vp) noexcept override;
     void handle_execute_vmcall(vcpu_t& vp) noexcept override;
+    void handle_mov_cr(vcpu_t& vp) noexcept override;
     void handle_ept_violation(vcpu_t& vp) noexcept override;
 
+    //
+    // VM-exit statistics exported to the guest (see vmcall 0xd2).
+    //
+    void stats_storage(vmexit_stats_storage_t* storage) noexcept
+    { stats_storage_ = storage; }
+
   private:
-    struct per_vcpu_data
+    static constexpr size_t hook_capacity = 16384;
+    static constexpr size_t view_capacity = 64;
+
+    //
+    // Size of the per-VCPU EPT snapshot buffer (see vmcall 0xcb).
+    //
+    static constexpr size_t snapshot_capacity = 64 * 1024;
+
+    //
+    // Number of pages in the per-VCPU memory snapshot shadow pool
+    // (see vmcall 0xcc).
+    //
+    static constexpr size_t memory_snapshot_capacity = 1024;
+
+    //
+    // Capacity of the EPT reverse map.  Each hook and each memory snapshot
+    // page can create one alias - ept_t keeps the load factor of the
+    // reverse map below 3/4.
+    //
+    static constexpr size_t rmap_capacity = (hook_capacity + memory_snapshot_capacity) * 4 / 3 + 1;
+
+    //
+    // EPT views used by view hooks.
+    //
+    static constexpr uint16_t ept_view_read = 0;
+    static constexpr uint16_t ept_view_exec = 1;
+
+    void cr3_load_exiting(vcpu_t& vp, bool enable) noexcept;
+
+    //
+    // Guest buffers of VMCALLs are accessed by walking the guest paging
+    // structures - never through the guest virtual address, which could
+    // page-fault in VMX-root mode (see cr3_guard).
+    //
+    // guest_translate() returns guest physical address of the page which
+    // contains "va".  It fails if the page isn't present (or writable, if
+    // "write" is set) or if it is supervisor page and the caller runs at
+    // CPL 3.  guest_write() copies the buffer into the guest page by page
+    // through the current EPT (which must allow the write too) - nothing
+    // is copied if any page of the guest range fails the translation.
+    // guest_read() is its counterpart - it copies the guest range into
+    // the buffer (read access is required).
+    //
+    static bool guest_translate(vcpu_t& vp, uint64_t va, bool write, pa_t& guest_pa) noexcept;
+    static bool guest_read(vcpu_t& vp, uint64_t va, void* buffer, size_t size) noexcept;
+    static bool guest_write(vcpu_t& vp, uint64_t va, const void* buffer, size_t size) noexcept;
+    static bool guest_copy(vcpu_t& vp, uint64_t va, void* buffer, size_t size, bool write) noexcept;
+
+    //
+    // Memory snapshot (see vmcall 0xcc) is taken by single VCPU - the
+    // owner - but the guest memory can be written by any VCPU.  Every
+    // VCPU therefore write-protects the ranges of the snapshot in its
+    // own EPTs: the owner immediately, other VCPUs on their next VM-exit
+    // handled by this handler (see memory_snapshot_sync()).  Pages
+    // dirtied through EPTs of other VCPUs are counted as foreign writes
+    // - the owner can't roll them back and its reset fails until the
+    // snapshot is released.  The reset fails also until all VCPUs have
+    // protected the ranges.
+    //
+    // Each protect or release increments the generation, each VCPU keeps
+    // the last generation it has applied.  The session is modified only
+    // in VMX-root mode, under its lock.
+    //
+    struct memory_session_t
+    {
+      spinlock                 lock;
+      std::atomic<uint64_t>    generation;
+      uint64_t                 id;
+      uint32_t                 owner;
+      memory_snapshot::range_t range[memory_snapshot::max_range_count];
+      size_t                   range_count;
+      std::atomic<uint64_t>    foreign_write_count;
+    };
+
+    struct memory_session_state_t
+    {
+      std::atomic<uint64_t>    generation;
+      uint64_t                 id;
+      size_t                   range_count;
+    };
+
+    static constexpr uint32_t memory_session_no_owner = ~0u;
+
+    void memory_snapshot_sync(vcpu_t& vp) noexcept;
+    bool memory_snapshot_established() const noexcept;
+
+    //
+    // Mapping of the VM-exit statistics into the guest (see vmcall 0xd2).
+    //
+    bool stats_map(vcpu_t& vp, uint64_t va) noexcept;
+    void stats_unmap(vcpu_t& vp) noexcept;
+
+    //
+    // Fast handlers (see vcpu_t::fast_handler()).
+    //
+    static bool fast_execute_cpuid(vcpu_t& vp) noexcept;
+    static bool fast_execute_xsetbv(vcpu_t& vp) noexcept;
+    static bool fast_execute_vmcall(vcpu_t& vp) noexcept;
+
+    ept_hook_manager* hooks_ = nullptr;
+    ept_view_cache*   views_ = nullptr;
+    uint8_t*          snapshots_ = nullptr;
+    memory_snapshot*  memory_snapshots_ = nullptr;
+
+    memory_session_t        memory_session_;
+    memory_session_state_t* memory_session_states_ = nullptr;
+
+    vmexit_stats_storage_t* stats_storage_ = nullptr;
+
+    //
+    // Guest pages remapped to the VM-exit statistics by single VCPU and
+    // their original PTEs in each EPT view.
+    //
+    struct stats_mapping_t
     {
-      pa_t page_read;
-      pa_t page_exec;
+      pa_t*   guest_pa;     // stats_page_count_ items
+      epte_t* original;     // stats_page_count_ * vcpu_t::ept_view_count items
+      size_t  page_count;   // 0 == not mapped
     };
 
-    per_vcpu_data data_[32];
+    stats_mapping_t* stats_mappings_ = nullptr;
+    size_t           stats_page_count_ = 0;
 };
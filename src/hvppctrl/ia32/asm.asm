@@ -161,6 +161,13 @@ INCLUDE ksamd64.inc
         ret
     ia32_asm_vmx_vmcall ENDP
 
+    ia32_asm_vmx_vmfunc PROC
+        mov     eax, ecx
+        mov     ecx, edx
+        db      0fh, 01h, 0d4h          ; vmfunc
+        ret
+    ia32_asm_vmx_vmfunc ENDP
+
     ;                                   ;
     ; --------------------------------- ;
     ;                                   ;
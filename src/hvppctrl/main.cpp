@@ -1,5 +1,8 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdint>
+#include <cstring>
+#include <iterator>
 
 #include <windows.h>
 
@@ -8,6 +11,10 @@
 #include "detours/detours.h"
 #include "udis86/udis86.h"
 
+#include "../hvpp/hvpp/ept_snapshot.h"
+#include "../hvpp/hvpp/exit_latency.h"
+#include "../hvpp/hvpp/vmexit/vmexit_stats_storage.h"
+
 #define PAGE_SIZE       4096
 #define PAGE_ALIGN(Va)  ((PVOID)((ULONG_PTR)(Va) & ~(PAGE_SIZE - 1)))
 
@@ -38,6 +45,159 @@ void TestCpuid()
   printf("CPUID: '%s'\n\n", (const char*)CpuInfo);
 }
 
+void TestExitLatency()
+{
+  //
+  // Measure round-trip of VM-exits caused by CPUID and by VMCALL "ping"
+  // (see vmexit_custom_handler::fast_execute_vmcall()).  Both are handled
+  // with the smallest possible overhead, therefore the result is dominated
+  // by the VM-exit/VM-entry path itself (see vcpu_t::entry_host_() in
+  // vcpu.asm).  Each of them is measured once with the fast path enabled
+  // and once disabled (see vcpu_t::fast_handler()).
+  //
+  constexpr int ExitCount = 100000;
+  static uint64_t Samples[ExitCount];
+
+  //
+  // Fast path is toggled per-VCPU - stay on single core while measuring.
+  //
+  DWORD_PTR PreviousAffinityMask = SetThreadAffinityMask(GetCurrentThread(), 1);
+
+  auto Measure = [](const char* Name, void (*ExitFunction)())
+  {
+    for (int i = 0; i < ExitCount; ++i)
+    {
+      uint64_t Start = ia32_asm_read_tsc();
+      ExitFunction();
+      Samples[i] = ia32_asm_read_tsc() - Start;
+    }
+
+    std::sort(std::begin(Samples), std::end(Samples));
+
+    printf("  %-8s p50: %6llu  p90: %6llu  p99: %6llu  p99.9: %6llu  max: %8llu cycles\n",
+           Name,
+           Samples[ExitCount / 2],
+           Samples[ExitCount * 90 / 100],
+           Samples[ExitCount * 99 / 100],
+           Samples[ExitCount * 999 / 1000],
+           Samples[ExitCount - 1]);
+  };
+
+  for (int FastPath = 1; FastPath >= 0; --FastPath)
+  {
+    ia32_asm_vmx_vmcall(0xd0, FastPath, 0, 0);
+
+    printf("VM-exit round-trip (fast path %s):\n", FastPath ? "enabled" : "disabled");
+    Measure("CPUID",  []() { int CpuInfo[4]; ia32_asm_cpuid(CpuInfo, 0); });
+    Measure("VMCALL", []() { ia32_asm_vmx_vmcall(0xcf, 0, 0, 0); });
+  }
+
+  ia32_asm_vmx_vmcall(0xd0, 1, 0, 0);
+
+  printf("\n");
+
+  SetThreadAffinityMask(GetCurrentThread(), PreviousAffinityMask);
+}
+
+void PrintLatencyHistogram(const char* Name, const hvpp::latency_histogram_t& Histogram)
+{
+  printf("  %-20s count: %10llu  p50: %6llu  p99: %6llu  p99.9: %6llu  max: %8llu cycles\n",
+         Name,
+         Histogram.count,
+         Histogram.value_at(50, 100),
+         Histogram.value_at(99, 100),
+         Histogram.value_at(999, 1000),
+         Histogram.max);
+}
+
+void TestExitLatencyHistograms()
+{
+  //
+  // See vmexit_custom_handler::handle_execute_vmcall() and
+  // vcpu_t::exit_latency().
+  //
+  // Fetch VM-exit latency histograms of each VCPU (histograms are reset
+  // after they're fetched, so that the next run measures only new
+  // VM-exits), merge them and print them.  VCPUs keep running while the
+  // histograms are being copied.
+  //
+  struct CONTEXT { hvpp::exit_latency_t* Buffer; hvpp::exit_latency_t* Merged; } Context;
+
+  Context.Buffer = (hvpp::exit_latency_t*)VirtualAlloc(nullptr, sizeof(hvpp::exit_latency_t), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  Context.Merged = (hvpp::exit_latency_t*)VirtualAlloc(nullptr, sizeof(hvpp::exit_latency_t), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  //
+  // The histograms take almost 1MB - more than the default minimum
+  // working set, which limits the size of locked memory.
+  //
+  SIZE_T MinimumWorkingSetSize;
+  SIZE_T MaximumWorkingSetSize;
+
+  if (!Context.Buffer || !Context.Merged ||
+      !GetProcessWorkingSetSize(GetCurrentProcess(), &MinimumWorkingSetSize, &MaximumWorkingSetSize) ||
+      !SetProcessWorkingSetSize(GetCurrentProcess(),
+                                MinimumWorkingSetSize + sizeof(hvpp::exit_latency_t),
+                                MaximumWorkingSetSize + sizeof(hvpp::exit_latency_t)) ||
+      !VirtualLock(Context.Buffer, sizeof(hvpp::exit_latency_t)))
+  {
+    printf("VM-exit latency: failed to lock the buffer (error %u)\n\n", GetLastError());
+
+    if (Context.Buffer)
+    {
+      VirtualFree(Context.Buffer, 0, MEM_RELEASE);
+    }
+
+    if (Context.Merged)
+    {
+      VirtualFree(Context.Merged, 0, MEM_RELEASE);
+    }
+
+    return;
+  }
+
+  ForEachLogicalCore([](void* ContextPtr) {
+    CONTEXT* Context = (CONTEXT*)ContextPtr;
+
+    if (ia32_asm_vmx_vmcall(0xd1, (uint64_t)Context->Buffer, sizeof(hvpp::exit_latency_t), 1) == sizeof(hvpp::exit_latency_t))
+    {
+      Context->Merged->merge(*Context->Buffer);
+    }
+  }, &Context);
+
+  printf("VM-exit latency:\n");
+
+  for (uint32_t Reason = 0; Reason < hvpp::exit_latency_t::exit_reason_count; ++Reason)
+  {
+    if (Context.Merged->by_exit_reason[Reason].count)
+    {
+      char Name[32];
+      sprintf_s(Name, "reason %u", Reason);
+      PrintLatencyHistogram(Name, Context.Merged->by_exit_reason[Reason]);
+    }
+  }
+
+  for (auto& SubReason : Context.Merged->by_sub_reason)
+  {
+    if (SubReason.key)
+    {
+      char Name[32];
+      sprintf_s(Name, "reason %u 0x%08x", SubReason.exit_reason(), SubReason.value());
+      PrintLatencyHistogram(Name, SubReason.histogram);
+    }
+  }
+
+  if (Context.Merged->sub_reason_overflow_count)
+  {
+    printf("  (%llu VM-exits with untracked sub-reason)\n", Context.Merged->sub_reason_overflow_count);
+  }
+
+  printf("\n");
+
+  VirtualUnlock(Context.Buffer, sizeof(hvpp::exit_latency_t));
+  VirtualFree(Context.Buffer, 0, MEM_RELEASE);
+  VirtualFree(Context.Merged, 0, MEM_RELEASE);
+}
+
 void TestHook()
 {
   pfnZwClose ZwCloseFn = (pfnZwClose)GetProcAddress(LoadLibraryA("ntdll.dll"), "ZwClose");
@@ -209,10 +369,868 @@ void TestHook()
   free(OriginalFunctionBackup);
 }
 
-int main()
+void TestBulkHook()
+{
+  //
+  // See vmexit_custom_handler::handle_execute_vmcall() and
+  // ept_hook_manager.
+  //
+  // Install 10k hooks by single bulk VMCALL (0xc3), read each hooked
+  // page once (each read causes EPT violation which flips the page to
+  // "PageRead") and print the cost of installation and of the EPT
+  // violation handling (as measured by the hypervisor - vmcall 0xd5).
+  // Hooks are per-VCPU - stay on single core.
+  //
+  constexpr size_t HookCount = 10000;
+
+  struct HOOK { void* PageRead; void* PageExecute; };
+
+  DWORD_PTR PreviousAffinityMask = SetThreadAffinityMask(GetCurrentThread(), 1);
+
+  uint8_t* PageExecute = (uint8_t*)VirtualAlloc(nullptr, HookCount * PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  uint8_t* PageRead    = (uint8_t*)VirtualAlloc(nullptr, PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  HOOK*    HookList    = (HOOK*)VirtualAlloc(nullptr, HookCount * sizeof(HOOK), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  printf("Bulk hook:\n");
+
+  //
+  // Hooked pages must stay in the memory - the working set must be
+  // enlarged first, otherwise VirtualLock() fails.
+  //
+  SIZE_T MinimumWorkingSetSize;
+  SIZE_T MaximumWorkingSetSize;
+  SIZE_T LockSize = (HookCount + 1) * PAGE_SIZE + HookCount * sizeof(HOOK);
+
+  if (!PageExecute || !PageRead || !HookList ||
+      !GetProcessWorkingSetSize(GetCurrentProcess(), &MinimumWorkingSetSize, &MaximumWorkingSetSize) ||
+      !SetProcessWorkingSetSize(GetCurrentProcess(), MinimumWorkingSetSize + LockSize, MaximumWorkingSetSize + LockSize) ||
+      !VirtualLock(PageExecute, HookCount * PAGE_SIZE) ||
+      !VirtualLock(PageRead, PAGE_SIZE) ||
+      !VirtualLock(HookList, HookCount * sizeof(HOOK)))
+  {
+    printf("  failed to allocate the pages (error %u)\n\n", GetLastError());
+  }
+  else
+  {
+    memset(PageExecute, 0xc3, HookCount * PAGE_SIZE);
+    memset(PageRead, 0xcc, PAGE_SIZE);
+
+    for (size_t i = 0; i < HookCount; ++i)
+    {
+      HookList[i] = { PageRead, PageExecute + i * PAGE_SIZE };
+    }
+
+    uint64_t Before[3] = {};
+    uint64_t After[3]  = {};
+
+    ia32_asm_vmx_vmcall(0xd5, (uint64_t)Before, 0, 0);
+
+    uint64_t Start = ia32_asm_read_tsc();
+    uint64_t InstalledCount = ia32_asm_vmx_vmcall(0xc3, (uint64_t)HookList, HookCount, 0);
+    uint64_t InstallCycles = ia32_asm_read_tsc() - Start;
+
+    size_t ReadCount = 0;
+
+    for (size_t i = 0; i < HookCount; ++i)
+    {
+      ReadCount += *(volatile uint8_t*)(PageExecute + i * PAGE_SIZE) == 0xcc;
+    }
+
+    ia32_asm_vmx_vmcall(0xd5, (uint64_t)After, 0, 0);
+    ia32_asm_vmx_vmcall(0xc2, 0, 0, 0);
+
+    uint64_t ViolationCount  = After[0] - Before[0];
+    uint64_t ViolationCycles = After[1] - Before[1];
+
+    printf("  installed hooks: %llu/%zu, %llu cycles per hook\n",
+           InstalledCount, HookCount, InstalledCount ? InstallCycles / InstalledCount : 0);
+    printf("  pages read through the hook: %zu/%zu\n", ReadCount, HookCount);
+    printf("  EPT violations: %llu, %llu cycles per violation (max: %llu)\n\n",
+           ViolationCount, ViolationCount ? ViolationCycles / ViolationCount : 0, After[2]);
+  }
+
+  if (HookList)    VirtualFree(HookList, 0, MEM_RELEASE);
+  if (PageRead)    VirtualFree(PageRead, 0, MEM_RELEASE);
+  if (PageExecute) VirtualFree(PageExecute, 0, MEM_RELEASE);
+
+  SetThreadAffinityMask(GetCurrentThread(), PreviousAffinityMask);
+}
+
+void TestEptView()
+{
+  //
+  // See vmexit_custom_handler::handle_execute_vmcall() and
+  // vmexit_passthrough_handler::handle_execute_vmfunc().
+  //
+  // Flip between EPT views 0 and 1 - once by VMCALL (each flip causes
+  // VM-exit) and once by VMFUNC (EPTP switching, no VM-exit), if the CPU
+  // supports it.  Both views are identity-mapped, so flipping them
+  // doesn't change the memory seen by this process.
+  //
+  constexpr int FlipCount = 100000;
+
+  //
+  // Views are per-VCPU - stay on single core while measuring.
+  //
+  DWORD_PTR PreviousAffinityMask = SetThreadAffinityMask(GetCurrentThread(), 1);
+
+  auto Measure = [](void (*FlipFunction)(int Index)) -> double
+  {
+    LARGE_INTEGER Frequency, Start, End;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+
+    for (int i = 0; i < FlipCount; ++i)
+    {
+      FlipFunction(i & 1);
+    }
+
+    FlipFunction(0);
+
+    QueryPerformanceCounter(&End);
+
+    return (double)FlipCount * Frequency.QuadPart / (End.QuadPart - Start.QuadPart);
+  };
+
+  double VmcallFlips = Measure([](int Index) { ia32_asm_vmx_vmcall(0xc4, Index, 0, 0); });
+  printf("EPT view flips/s (VMCALL) : %.0f\n", VmcallFlips);
+
+  if (ia32_asm_vmx_vmcall(0xc5, 0, 0, 0))
+  {
+    double VmfuncFlips = Measure([](int Index) { ia32_asm_vmx_vmfunc(0, Index); });
+    printf("EPT view flips/s (VMFUNC) : %.0f\n", VmfuncFlips);
+  }
+  else
+  {
+    printf("EPT view flips/s (VMFUNC) : not supported\n");
+  }
+
+  printf("\n");
+
+  SetThreadAffinityMask(GetCurrentThread(), PreviousAffinityMask);
+}
+
+//
+// Virtualization-exception information area.
+// See ia32/vmx/ve.h in hvpp.
+//
+struct VE_INFO
+{
+  uint32_t ExitReason;
+  uint32_t Busy;
+  uint64_t ExitQualification;
+  uint64_t GuestLinearAddress;
+  uint64_t GuestPhysicalAddress;
+  uint16_t EptpIndex;
+};
+
+//
+// EPT views used by view hooks.
+// See vmexit_custom_handler::handle_execute_vmcall().
+//
+#define EPT_VIEW_READ   0
+#define EPT_VIEW_EXEC   1
+
+//
+// Reference #VE handler.
+//
+// In a real deployment, this is the body of the vector 20 (#VE) IDT
+// handler installed by a guest kernel driver, which registers its
+// information area by VMCALL 0xc6.  Because user-mode can't install
+// IDT handlers, TestVe() calls it directly with the information area
+// filled the same way the CPU fills it.
+//
+// The handler resolves EPT violations on view-hooked pages the same
+// way as vmexit_custom_handler::handle_ept_violation() does - it flips
+// the EPT view by VMFUNC - and re-arms the #VE delivery by resetting
+// the "busy" field.
+//
+void ReferenceVeHandler(volatile VE_INFO* VeInfo)
+{
+  //
+  // Bit 0: data read, bit 1: data write, bit 2: instruction fetch.
+  //
+  bool Execute = (VeInfo->ExitQualification & 0b111) == 0b100;
+
+  ia32_asm_vmx_vmfunc(0, Execute ? EPT_VIEW_EXEC : EPT_VIEW_READ);
+
+  VeInfo->Busy = 0;
+}
+
+void TestVe()
+{
+  //
+  // Compare latency of resolving EPT violation on a view-hooked page:
+  //   - by VM-exit (#VE not delivered, hypervisor flips the views)
+  //   - in the guest (ReferenceVeHandler() flips the views by VMFUNC)
+  //
+  // Note that the second number doesn't include the delivery of #VE
+  // itself (which costs about as much as any other exception delivery).
+  //
+  constexpr int FlipCount = 100000;
+
+  printf("#VE supported           : %s\n", ia32_asm_vmx_vmcall(0xc6, 0, 0, 0) ? "yes" : "no");
+
+  //
+  // View hooks are per-VCPU - stay on single core.
+  //
+  DWORD_PTR PreviousAffinityMask = SetThreadAffinityMask(GetCurrentThread(), 1);
+
+  //
+  // The "execute" page contains just "ret" instruction, the "read" page
+  // is its copy.
+  //
+  uint8_t* PageExecute = (uint8_t*)VirtualAlloc(nullptr, PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+  uint8_t* PageRead    = (uint8_t*)VirtualAlloc(nullptr, PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  memset(PageExecute, 0xc3, PAGE_SIZE);
+  memcpy(PageRead, PageExecute, PAGE_SIZE);
+
+  VirtualLock(PageExecute, PAGE_SIZE);
+  VirtualLock(PageRead, PAGE_SIZE);
+
+  ia32_asm_vmx_vmcall(0xc7, (uint64_t)PageRead, (uint64_t)PageExecute, 0);
+
+  //
+  // Exit path - each read and each call of the hooked page causes
+  // EPT violation.
+  //
+  {
+    auto Function = (void (*)())PageExecute;
+    volatile uint8_t Value;
+
+    uint64_t Start = ia32_asm_read_tsc();
+
+    for (int i = 0; i < FlipCount / 2; ++i)
+    {
+      Value = *(volatile uint8_t*)PageExecute;
+      Function();
+    }
+
+    uint64_t Cycles = ia32_asm_read_tsc() - Start;
+    (void)(Value);
+
+    printf("Cycles per flip (exit)  : %llu\n", Cycles / FlipCount);
+  }
+
+  //
+  // In-guest path.
+  //
+  if (ia32_asm_vmx_vmcall(0xc5, 0, 0, 0))
+  {
+    VE_INFO* VeInfo = (VE_INFO*)VirtualAlloc(nullptr, PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+    VeInfo->ExitReason = 48;
+    VeInfo->GuestLinearAddress = (uint64_t)PageExecute;
+
+    uint64_t Start = ia32_asm_read_tsc();
+
+    for (int i = 0; i < FlipCount; ++i)
+    {
+      VeInfo->Busy = 0xffffffff;
+      VeInfo->ExitQualification = (i & 1) ? 0b100 : 0b001;
+      ReferenceVeHandler(VeInfo);
+    }
+
+    uint64_t Cycles = ia32_asm_read_tsc() - Start;
+
+    printf("Cycles per flip (#VE)   : %llu\n", Cycles / FlipCount);
+
+    VirtualFree(VeInfo, 0, MEM_RELEASE);
+  }
+  else
+  {
+    printf("Cycles per flip (#VE)   : VMFUNC not supported\n");
+  }
+
+  printf("\n");
+
+  ia32_asm_vmx_vmcall(0xc8, (uint64_t)PageRead, (uint64_t)PageExecute, 0);
+
+  VirtualUnlock(PageExecute, PAGE_SIZE);
+  VirtualUnlock(PageRead, PAGE_SIZE);
+  VirtualFree(PageExecute, 0, MEM_RELEASE);
+  VirtualFree(PageRead, 0, MEM_RELEASE);
+
+  SetThreadAffinityMask(GetCurrentThread(), PreviousAffinityMask);
+}
+
+void TestProcessHide()
+{
+  //
+  // See vmexit_custom_handler::handle_execute_vmcall().
+  //
+  // Hide "PageHidden" from this process - reads of it should return
+  // content of "PageShown" instead.  Other processes still see the
+  // original content.  Cost of the view switching on context switches
+  // is printed by the hypervisor when it's unloaded.
+  //
+  // Each CPU has its own EPT views - the page must be hidden (and
+  // unhidden) on each of them, because the thread can migrate.
+  //
+  char* PageHidden = (char*)VirtualAlloc(nullptr, PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  char* PageShown  = (char*)VirtualAlloc(nullptr, PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  strcpy(PageHidden, "original");
+  strcpy(PageShown, "replaced");
+
+  VirtualLock(PageHidden, PAGE_SIZE);
+  VirtualLock(PageShown, PAGE_SIZE);
+
+  printf("Process hide:\n");
+
+  struct CONTEXT { char* PageHidden; char* PageShown; } Context { PageHidden, PageShown };
+  ForEachLogicalCore([](void* ContextPtr) {
+    CONTEXT* Context = (CONTEXT*)ContextPtr;
+    ia32_asm_vmx_vmcall(0xc9, (uint64_t)Context->PageHidden, (uint64_t)Context->PageShown, 0);
+  }, &Context);
+
+  //
+  // Let some context switches happen.
+  //
+  Sleep(100);
+  printf("PageHidden = '%s' (expected: 'replaced')\n", PageHidden);
+
+  ForEachLogicalCore([](void*) { ia32_asm_vmx_vmcall(0xca, 0, 0, 0); }, nullptr);
+  printf("PageHidden = '%s' (expected: 'original')\n\n", PageHidden);
+
+  VirtualUnlock(PageHidden, PAGE_SIZE);
+  VirtualUnlock(PageShown, PAGE_SIZE);
+  VirtualFree(PageHidden, 0, MEM_RELEASE);
+  VirtualFree(PageShown, 0, MEM_RELEASE);
+}
+
+void PrintEptSnapshot(const void* Snapshot, size_t Size)
+{
+  auto Header  = (const hvpp::ept_snapshot_header_t*)Snapshot;
+  auto Records = hvpp::ept_snapshot_records(Snapshot, Size);
+
+  if (!Records)
+  {
+    printf("  invalid snapshot\n");
+    return;
+  }
+
+  static const char* LevelName[] = { "4kb", "2MB", "1GB" };
+
+  printf("  EPTP: 0x%016llx, records: %llu\n", Header->ept_pointer, Header->record_count);
+
+  for (uint64_t i = 0; i < Header->record_count; ++i)
+  {
+    auto& Record = Records[i];
+
+    printf("  0x%016llx - 0x%016llx -> 0x%016llx %s x %-6u %c%c%c MT:%u%s\n",
+           Record.guest_pa, Record.guest_pa_end(), Record.host_pa,
+           Record.level < 3 ? LevelName[Record.level] : "???", Record.page_count,
+           Record.access & 1 ? 'R' : '-',
+           Record.access & 2 ? 'W' : '-',
+           Record.access & 4 ? 'X' : '-',
+           Record.memory_type,
+           Record.flags & hvpp::ept_snapshot_record_t::flag_suppress_ve ? "" : " #VE");
+  }
+}
+
+void TestEptSnapshot()
+{
+  //
+  // See vmexit_custom_handler::handle_execute_vmcall() and
+  // ept_t::snapshot().
+  //
+  // Take snapshot of the EPT view 0, view-hook a page (which remaps it
+  // in the view 0), take another snapshot and print the difference.
+  // The difference should consist of the hooked page only (and of the
+  // rest of its 2MB region, which has been split).
+  //
+  constexpr size_t SnapshotSize = 64 * 1024;
+
+  //
+  // EPTs are per-VCPU - stay on single core.
+  //
+  DWORD_PTR PreviousAffinityMask = SetThreadAffinityMask(GetCurrentThread(), 1);
+
+  void* Snapshot1 = VirtualAlloc(nullptr, SnapshotSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  void* Snapshot2 = VirtualAlloc(nullptr, SnapshotSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  char* PageRead  = (char*)VirtualAlloc(nullptr, PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  char* PageExec  = (char*)VirtualAlloc(nullptr, PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+  VirtualLock(Snapshot1, SnapshotSize);
+  VirtualLock(Snapshot2, SnapshotSize);
+  VirtualLock(PageRead, PAGE_SIZE);
+  VirtualLock(PageExec, PAGE_SIZE);
+
+  printf("EPT snapshot:\n");
+
+  uint64_t Size1 = ia32_asm_vmx_vmcall(0xcb, (uint64_t)Snapshot1, SnapshotSize, 0);
+  PrintEptSnapshot(Snapshot1, SnapshotSize);
+
+  if (Size1 > SnapshotSize)
+  {
+    printf("  (truncated, %llu bytes needed)\n", Size1);
+  }
+
+  ia32_asm_vmx_vmcall(0xc7, (uint64_t)PageRead, (uint64_t)PageExec, 0);
+  ia32_asm_vmx_vmcall(0xcb, (uint64_t)Snapshot2, SnapshotSize, 0);
+  ia32_asm_vmx_vmcall(0xc8, (uint64_t)PageRead, (uint64_t)PageExec, 0);
+
+  printf("EPT snapshot diff (after view hook):\n");
+
+  int64_t DiffCount = hvpp::ept_snapshot_diff(
+    Snapshot1, SnapshotSize,
+    Snapshot2, SnapshotSize,
+    [](uint64_t GuestPa, uint64_t Size,
+       const hvpp::ept_snapshot_record_t* Record1,
+       const hvpp::ept_snapshot_record_t* Record2)
+    {
+      printf("  0x%016llx - 0x%016llx: 0x%016llx -> 0x%016llx\n",
+             GuestPa, GuestPa + Size,
+             Record1 ? Record1->host_pa + (GuestPa - Record1->guest_pa) : 0,
+             Record2 ? Record2->host_pa + (GuestPa - Record2->guest_pa) : 0);
+    });
+
+  printf("  %lld differing ranges\n\n", DiffCount);
+
+  VirtualUnlock(Snapshot1, SnapshotSize);
+  VirtualUnlock(Snapshot2, SnapshotSize);
+  VirtualUnlock(PageRead, PAGE_SIZE);
+  VirtualUnlock(PageExec, PAGE_SIZE);
+  VirtualFree(Snapshot1, 0, MEM_RELEASE);
+  VirtualFree(Snapshot2, 0, MEM_RELEASE);
+  VirtualFree(PageRead, 0, MEM_RELEASE);
+  VirtualFree(PageExec, 0, MEM_RELEASE);
+
+  SetThreadAffinityMask(GetCurrentThread(), PreviousAffinityMask);
+}
+
+void TestMemorySnapshot()
+{
+  //
+  // See vmexit_custom_handler::handle_execute_vmcall() and
+  // memory_snapshot.
+  //
+  // Snapshot a buffer, then repeatedly dirty some of its pages and
+  // reset it back.  The VCPU which took the snapshot owns it - reset
+  // and release must be called on the same core.  Other VCPUs protect
+  // the buffer on their next VM-exit, the reset fails until all of
+  // them did (and if the buffer has been written on another core).
+  //
+  constexpr size_t PageCount  = 64;
+  constexpr size_t DirtyCount = 8;
+  constexpr int    ResetCount = 10000;
+
+  DWORD_PTR PreviousAffinityMask = SetThreadAffinityMask(GetCurrentThread(), 1);
+
+  uint8_t* Buffer = (uint8_t*)VirtualAlloc(nullptr, PageCount * PAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  VirtualLock(Buffer, PageCount * PAGE_SIZE);
+
+  for (size_t i = 0; i < PageCount * PAGE_SIZE; ++i)
+  {
+    Buffer[i] = (uint8_t)i;
+  }
+
+  printf("Memory snapshot:\n");
+
+  uint64_t RangeCount = ia32_asm_vmx_vmcall(0xcc, (uint64_t)Buffer, PageCount * PAGE_SIZE, 0);
+
+  if (RangeCount == ~0ull)
+  {
+    printf("  snapshot failed\n\n");
+
+    VirtualUnlock(Buffer, PageCount * PAGE_SIZE);
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+
+    SetThreadAffinityMask(GetCurrentThread(), PreviousAffinityMask);
+    return;
+  }
+
+  printf("  protected ranges: %llu\n", RangeCount);
+
+  //
+  // Force VM-exit on every core, so that all VCPUs protect the buffer.
+  //
+  ForEachLogicalCore([](void*) { ia32_asm_vmx_vmcall(0xc5, 0, 0, 0); }, nullptr);
+
+  uint64_t ResetPages = 0;
+
+  LARGE_INTEGER Frequency, Start, End;
+  QueryPerformanceFrequency(&Frequency);
+  QueryPerformanceCounter(&Start);
+
+  bool Overflow = false;
+
+  for (int i = 0; i < ResetCount; ++i)
+  {
+    for (size_t Page = 0; Page < DirtyCount; ++Page)
+    {
+      Buffer[((i + Page * 7) % PageCount) * PAGE_SIZE] = 0xcc;
+    }
+
+    uint64_t Result = ia32_asm_vmx_vmcall(0xcd, 0, 0, 0);
+
+    if (Result == ~0ull)
+    {
+      Overflow = true;
+      break;
+    }
+
+    ResetPages += Result;
+  }
+
+  QueryPerformanceCounter(&End);
+
+  bool Intact = true;
+
+  for (size_t i = 0; i < PageCount * PAGE_SIZE; ++i)
+  {
+    Intact &= Buffer[i] == (uint8_t)i;
+  }
+
+  ia32_asm_vmx_vmcall(0xce, 0, 0, 0);
+
+  printf("  dirtied pages per reset: %.1f\n", (double)ResetPages / ResetCount);
+  printf("  resets/s: %.0f\n", (double)ResetCount * Frequency.QuadPart / (End.QuadPart - Start.QuadPart));
+  printf("  buffer intact after reset: %s%s\n\n", Intact ? "yes" : "NO",
+         Overflow ? " (reset failed)" : "");
+
+  VirtualUnlock(Buffer, PageCount * PAGE_SIZE);
+  VirtualFree(Buffer, 0, MEM_RELEASE);
+
+  SetThreadAffinityMask(GetCurrentThread(), PreviousAffinityMask);
+}
+
+void TestHarvest()
 {
+  //
+  // See vmexit_custom_handler::handle_execute_vmcall() and
+  // ept_t::harvest().
+  //
+  // Scan accessed/dirty flags of the whole guest physical memory (as
+  // reported by the OS) in the EPT of this VCPU several times and print
+  // the scan throughput.  The first scan clears flags accumulated since
+  // the VCPU was started, the following ones see only pages touched
+  // in between.  EPTs are per-VCPU - stay on single core.
+  //
+  constexpr int HarvestCount = 4;
+
+  DWORD_PTR PreviousAffinityMask = SetThreadAffinityMask(GetCurrentThread(), 1);
+
+  MEMORYSTATUSEX MemoryStatus = { sizeof(MemoryStatus) };
+  GlobalMemoryStatusEx(&MemoryStatus);
+
+  uint64_t Size = MemoryStatus.ullTotalPhys & ~(uint64_t)(PAGE_SIZE - 1);
+
+  printf("EPT accessed/dirty harvest:\n");
+
+  LARGE_INTEGER Frequency, Start, End;
+  QueryPerformanceFrequency(&Frequency);
+
+  for (int i = 0; i < HarvestCount; ++i)
+  {
+    QueryPerformanceCounter(&Start);
+    uint64_t EntryCount = ia32_asm_vmx_vmcall(0xd4, 0, Size, 0);
+    QueryPerformanceCounter(&End);
+
+    if (EntryCount == (uint64_t)-1)
+    {
+      printf("  EPT accessed/dirty flags aren't enabled\n");
+      break;
+    }
+
+    double Milliseconds = (double)(End.QuadPart - Start.QuadPart) * 1000 / Frequency.QuadPart;
+
+    printf("  scanned: %llu MB, cleared entries: %8llu, %.3f ms (%.2f GB/ms)\n",
+           Size >> 20,
+           EntryCount,
+           Milliseconds,
+           (double)Size / (1024 * 1024 * 1024) / Milliseconds);
+  }
+
+  printf("\n");
+
+  SetThreadAffinityMask(GetCurrentThread(), PreviousAffinityMask);
+}
+
+void TestEptLookup()
+{
+  //
+  // See vmexit_custom_handler::handle_execute_vmcall() and
+  // ept_t::ept_entry().
+  //
+  // Time EPT lookups of pages scattered over the whole guest physical
+  // memory (as reported by the OS) in the EPT of this VCPU.  Cost of the
+  // single VM-exit is negligible compared to the lookups.  EPTs are
+  // per-VCPU - stay on single core.
+  //
+  constexpr uint64_t LookupCount = 1 << 22;
+
+  DWORD_PTR PreviousAffinityMask = SetThreadAffinityMask(GetCurrentThread(), 1);
+
+  MEMORYSTATUSEX MemoryStatus = { sizeof(MemoryStatus) };
+  GlobalMemoryStatusEx(&MemoryStatus);
+
+  uint64_t Size = MemoryStatus.ullTotalPhys & ~(uint64_t)(PAGE_SIZE - 1);
+
+  printf("EPT lookup:\n");
+
+  LARGE_INTEGER Frequency, Start, End;
+  QueryPerformanceFrequency(&Frequency);
+
+  QueryPerformanceCounter(&Start);
+  uint64_t TscStart = ia32_asm_read_tsc();
+  uint64_t FoundCount = ia32_asm_vmx_vmcall(0xd6, 0, Size, LookupCount);
+  uint64_t Cycles = ia32_asm_read_tsc() - TscStart;
+  QueryPerformanceCounter(&End);
+
+  if (FoundCount == (uint64_t)-1)
+  {
+    printf("  invalid range\n\n");
+  }
+  else
+  {
+    double Seconds = (double)(End.QuadPart - Start.QuadPart) / Frequency.QuadPart;
+
+    printf("  lookups: %llu, found: %llu, %llu cycles per lookup, %.1f M lookups/s\n\n",
+           LookupCount,
+           FoundCount,
+           Cycles / LookupCount,
+           (double)LookupCount / Seconds / 1000000);
+  }
+
+  SetThreadAffinityMask(GetCurrentThread(), PreviousAffinityMask);
+}
+
+static volatile bool StatsStop = false;
+
+BOOL
+WINAPI
+StatsCtrlHandler(
+  _In_ DWORD CtrlType
+  )
+{
+  if (CtrlType == CTRL_C_EVENT || CtrlType == CTRL_BREAK_EVENT)
+  {
+    StatsStop = true;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+void StatsMerge(
+  hvpp::vmexit_stats_storage_t* Merged,
+  hvpp::vmexit_stats_storage_t* Snapshot,
+  const hvpp::vmexit_stats_storage_t* Stats,
+  size_t CpuCount
+  )
+{
+  memset(Merged, 0, sizeof(*Merged));
+
+  for (size_t i = 0; i < CpuCount; ++i)
+  {
+    Stats[i].snapshot(*Snapshot);
+    Merged->merge(*Snapshot);
+  }
+}
+
+template <uint32_t CAPACITY>
+void PrintStatsTable(const char* Format, const hvpp::vmexit_stats_table_t<CAPACITY>& Table)
+{
+  for (uint32_t i = 0; i < CAPACITY; ++i)
+  {
+    if (Table.is_used(i))
+    {
+      printf(Format, Table.key_at(i), Table.count[i]);
+    }
+  }
+
+  if (Table.other)
+  {
+    printf("    (other): %llu\n", Table.other);
+  }
+}
+
+int CommandStats(bool Watch)
+{
+  //
+  // See vmexit_custom_handler::handle_execute_vmcall() (vmcall 0xd2)
+  // and vmexit_stats_storage_t.
+  //
+  // Statistics of all VCPUs are mapped read-only into our buffer, so
+  // they're read directly from the hypervisor memory while VCPUs keep
+  // running.  Consistent copy of each VCPU's statistics is taken by the
+  // seqlock (see vmexit_stats_storage_t::snapshot()).
+  //
+  uint64_t Size = ia32_asm_vmx_vmcall(0xd2, 0, 0, 0);
+
+  if (!Size)
+  {
+    printf("VM-exit statistics are not available\n");
+    return 1;
+  }
+
+  size_t CpuCount = Size / sizeof(hvpp::vmexit_stats_storage_t);
+
+  auto Stats    = (hvpp::vmexit_stats_storage_t*)VirtualAlloc(nullptr, Size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  auto Snapshot = (hvpp::vmexit_stats_storage_t*)VirtualAlloc(nullptr, sizeof(hvpp::vmexit_stats_storage_t) * 3, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  auto Current  = Snapshot + 1;
+  auto Previous = Snapshot + 2;
+
+  if (!Stats || !Snapshot)
+  {
+    printf("Failed to allocate the buffers\n");
+
+    if (Stats)    VirtualFree(Stats, 0, MEM_RELEASE);
+    if (Snapshot) VirtualFree(Snapshot, 0, MEM_RELEASE);
+    return 1;
+  }
+
+  //
+  // The buffer must stay in the memory as long as it's mapped - the
+  // hypervisor rejects pages which aren't present and it unmaps the
+  // statistics on the first write into the buffer.  The working set
+  // must be enlarged first, otherwise VirtualLock() fails for larger
+  // buffers.  The buffer is touched before it is mapped, so that all
+  // its pages are present.
+  //
+  SIZE_T MinimumWorkingSetSize;
+  SIZE_T MaximumWorkingSetSize;
+
+  if (!GetProcessWorkingSetSize(GetCurrentProcess(), &MinimumWorkingSetSize, &MaximumWorkingSetSize) ||
+      !SetProcessWorkingSetSize(GetCurrentProcess(), MinimumWorkingSetSize + Size, MaximumWorkingSetSize + Size) ||
+      !VirtualLock(Stats, Size))
+  {
+    printf("Failed to lock the buffer (error %u)\n", GetLastError());
+
+    VirtualFree(Stats, 0, MEM_RELEASE);
+    VirtualFree(Snapshot, 0, MEM_RELEASE);
+    return 1;
+  }
+
+  memset(Stats, 0, Size);
+
+  struct CONTEXT { void* Buffer; uint64_t Size; bool Failed; } Context { Stats, Size, false };
+
+  ForEachLogicalCore([](void* ContextPtr) {
+    CONTEXT* Context = (CONTEXT*)ContextPtr;
+
+    if (ia32_asm_vmx_vmcall(0xd2, (uint64_t)Context->Buffer, Context->Size, 0) != Context->Size)
+    {
+      Context->Failed = true;
+    }
+  }, &Context);
+
+  if (Context.Failed)
+  {
+    //
+    // The statistics are unmapped below on the CPUs where they have been
+    // mapped.
+    //
+    printf("Failed to map VM-exit statistics\n");
+  }
+  else if (!Watch)
+  {
+    StatsMerge(Current, Snapshot, Stats, CpuCount);
+
+    printf("VM-exit statistics (%zu CPUs):\n", CpuCount);
+
+    for (uint32_t Reason = 0; Reason < std::size(Current->vmexit); ++Reason)
+    {
+      if (Current->vmexit[Reason])
+      {
+        printf("  reason %2u: %llu\n", Reason, Current->vmexit[Reason]);
+      }
+    }
+
+    printf("  CPUID:\n");
+    PrintStatsTable("    0x%08x: %llu\n", Current->cpuid);
+    printf("  IN:\n");
+    PrintStatsTable("    0x%04x: %llu\n", Current->io_in);
+    printf("  OUT:\n");
+    PrintStatsTable("    0x%04x: %llu\n", Current->io_out);
+    printf("  RDMSR:\n");
+    PrintStatsTable("    0x%08x: %llu\n", Current->rdmsr);
+    printf("  WRMSR:\n");
+    PrintStatsTable("    0x%08x: %llu\n", Current->wrmsr);
+  }
+  else
+  {
+    //
+    // Print per-second rate of each VM-exit reason until Ctrl+C is
+    // pressed.
+    //
+    SetConsoleCtrlHandler(&StatsCtrlHandler, TRUE);
+
+    LARGE_INTEGER Frequency, PreviousTime, CurrentTime;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&PreviousTime);
+
+    StatsMerge(Previous, Snapshot, Stats, CpuCount);
+
+    while (!StatsStop)
+    {
+      Sleep(1000);
+
+      QueryPerformanceCounter(&CurrentTime);
+      StatsMerge(Current, Snapshot, Stats, CpuCount);
+
+      double Seconds = (double)(CurrentTime.QuadPart - PreviousTime.QuadPart) / Frequency.QuadPart;
+      uint64_t Total = 0;
+
+      printf("VM-exits/s (Ctrl+C to stop):\n");
+
+      for (uint32_t Reason = 0; Reason < std::size(Current->vmexit); ++Reason)
+      {
+        uint64_t Delta = Current->vmexit[Reason] - Previous->vmexit[Reason];
+        Total += Delta;
+
+        if (Delta)
+        {
+          printf("  reason %2u: %12.0f\n", Reason, Delta / Seconds);
+        }
+      }
+
+      printf("  total:     %12.0f\n\n", Total / Seconds);
+
+      std::swap(Current, Previous);
+      PreviousTime = CurrentTime;
+    }
+
+    SetConsoleCtrlHandler(&StatsCtrlHandler, FALSE);
+  }
+
+  ForEachLogicalCore([](void*) {
+    ia32_asm_vmx_vmcall(0xd3, 0, 0, 0);
+  }, &Context);
+
+  VirtualUnlock(Stats, Size);
+  VirtualFree(Stats, 0, MEM_RELEASE);
+  VirtualFree(Snapshot, 0, MEM_RELEASE);
+
+  return Context.Failed ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+  //
+  // "hvppctrl stats [--watch]" prints VM-exit statistics (with --watch,
+  // per-second rates are printed continuously).
+  //
+  if (argc >= 2 && !strcmp(argv[1], "stats"))
+  {
+    return CommandStats(argc >= 3 && !strcmp(argv[2], "--watch"));
+  }
+
   TestCpuid();
+  TestExitLatency();
+  TestExitLatencyHistograms();
   TestHook();
+  TestBulkHook();
+  TestEptView();
+  TestVe();
+  TestProcessHide();
+  TestEptSnapshot();
+  TestMemorySnapshot();
+  TestHarvest();
+  TestEptLookup();
 
   return 0;
 }